@@ -0,0 +1,175 @@
+#ifndef _BUSYPOLL_H_
+#define _BUSYPOLL_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#include "reactor.h"
+
+/*
+ * busy poll ADT
+ *
+ * Paces a reactor so it spins on zero-timeout waits for a short budget
+ * after every wakeup before it goes back to blocking. Traffic that keeps
+ * arriving inside the budget is picked up without a sleep/wake round trip;
+ * once things go quiet we stop burning the core.
+ *
+ * The budget follows an average of recent inter-arrival gaps: a bit over
+ * twice the gap while that fits under the configured maximum, nothing at
+ * all when arrivals are further apart than spinning could ever catch.
+ */
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#define BUSY_POLL_DEFAULT_BUDGET 200    // microseconds
+#define BUSY_POLL_GAP_WEIGHT 8          // EWMA weight, 1/n
+
+typedef struct busypoll BusyPoll;
+
+struct busypoll {
+    void *self;
+    void (*cleanup)(const BusyPoll *bp);
+
+    // Lets the kernel busy poll the device queue under a blocking read.
+    bool (*enable_socket)(const BusyPoll *bp, int socket);
+
+    // Installs the spin-then-block policy on a reactor.
+    void (*attach)(const BusyPoll *bp, const Reactor *rc);
+
+    // Prints the CPU and latency counters since the last report.
+    void (*report)(const BusyPoll *bp);
+};
+
+typedef struct busypolldata {
+    long long maxBudget;     // ns
+    long long budget;        // ns
+    long long gap;           // ns, averaged
+    long long lastArrival;   // ns
+
+    // the spin in progress, if any
+    bool spinning;
+    long long spinStart;
+
+    // counters
+    long long spinHits;      // wakeups caught while spinning
+    long long spinMisses;    // spins that ran out and blocked
+    long long blockedWakeups;
+    long long spinTime;      // ns
+
+    // where the last report left off
+    long long reportWall;
+    long long reportCpu;
+} BusyPollData;
+
+static long long busy_poll_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static void busy_poll_cleanup(const BusyPoll *bp) {
+    free(bp->self);
+    free((void *)bp);
+}
+
+static bool busy_poll_enable_socket(const BusyPoll *bp, int socket) {
+    /* Sets SO_BUSY_POLL to our budget. Raising it needs CAP_NET_ADMIN. */
+    BusyPollData *bpd = (BusyPollData *)(bp->self);
+    int usec = (int)(bpd->maxBudget / 1000);
+    return setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == 0;
+}
+
+static void busy_poll_arrival(BusyPollData *bpd, long long now) {
+    /* Folds a wakeup into the gap average and resizes the budget. */
+    if (bpd->lastArrival != 0) {
+        // A long quiet spell only tells us to block; don't let it linger.
+        long long gap = now - bpd->lastArrival;
+        if (gap > (bpd->maxBudget * 4)) gap = bpd->maxBudget * 4;
+        if (bpd->gap == 0) bpd->gap = gap;
+        else bpd->gap += (gap - bpd->gap) / BUSY_POLL_GAP_WEIGHT;
+    }
+    bpd->lastArrival = now;
+
+    // Spinning past the maximum doesn't pay; below it, cover the gap twice.
+    if (bpd->gap > bpd->maxBudget) bpd->budget = 0;
+    else if ((bpd->gap * 2) > bpd->maxBudget) bpd->budget = bpd->maxBudget;
+    else bpd->budget = bpd->gap * 2;
+}
+
+static int busy_poll_pace(const Reactor *, int fired, void *context) {
+    /* Returns 0 while the spin budget lasts, -1 once it's time to block. */
+    BusyPollData *bpd = (BusyPollData *)context;
+    long long now = busy_poll_clock(CLOCK_MONOTONIC);
+
+    if (fired > 0) {
+        // Something showed up; note how we caught it and start a new spin.
+        if (bpd->spinning) {
+            bpd->spinHits += 1;
+            bpd->spinTime += now - bpd->spinStart;
+        } else {
+            bpd->blockedWakeups += 1;
+        }
+        busy_poll_arrival(bpd, now);
+        bpd->spinning = (bpd->budget > 0);
+        bpd->spinStart = now;
+        return bpd->spinning ? 0 : -1;
+    }
+
+    // Nothing yet -- keep spinning while the budget lasts.
+    if (!(bpd->spinning)) return -1;
+    if ((now - bpd->spinStart) < bpd->budget) return 0;
+    bpd->spinning = false;
+    bpd->spinMisses += 1;
+    bpd->spinTime += now - bpd->spinStart;
+    return -1;
+}
+
+static void busy_poll_attach(const BusyPoll *bp, const Reactor *rc) {
+    rc->set_pacer(rc, busy_poll_pace, bp->self);
+}
+
+static void busy_poll_report(const BusyPoll *bp) {
+    /* CPU use is over the last interval; the counters are running totals. */
+    BusyPollData *bpd = (BusyPollData *)(bp->self);
+    long long wall = busy_poll_clock(CLOCK_MONOTONIC);
+    long long cpu = busy_poll_clock(CLOCK_PROCESS_CPUTIME_ID);
+    double interval = (double)(wall - bpd->reportWall);
+    double cpuShare = (interval > 0) ? (100.0 * (cpu - bpd->reportCpu)) / interval : 0;
+    long long wakeups = bpd->spinHits + bpd->blockedWakeups;
+    double hitShare = (wakeups > 0) ? (100.0 * bpd->spinHits) / wakeups : 0;
+
+    printf("Busy poll: budget %lldus, arrival gap %lldus, CPU %.1f%%\n",
+           bpd->budget / 1000, bpd->gap / 1000, cpuShare);
+    printf("Busy poll: %lld spin hits (%.1f%% of wakeups), %lld spin misses, %lld blocking wakeups, %.3fs spinning\n",
+           bpd->spinHits, hitShare, bpd->spinMisses, bpd->blockedWakeups, bpd->spinTime / 1e9);
+    fflush(stdout);
+
+    bpd->reportWall = wall;
+    bpd->reportCpu = cpu;
+}
+
+const BusyPoll *BusyPoll_create(int maxBudgetUsec) {
+    /* Creates a busy poll policy that spins for at most maxBudgetUsec. */
+    BusyPoll *bp = (BusyPoll *)malloc(sizeof(BusyPoll));
+    memset(bp, 0, sizeof(BusyPoll));
+
+    BusyPollData *bpd = (BusyPollData *)malloc(sizeof(BusyPollData));
+    memset(bpd, 0, sizeof(BusyPollData));
+    bpd->maxBudget = maxBudgetUsec * 1000LL;
+    bpd->budget = bpd->maxBudget;
+    bpd->reportWall = busy_poll_clock(CLOCK_MONOTONIC);
+    bpd->reportCpu = busy_poll_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+    *bp = {NULL, busy_poll_cleanup, busy_poll_enable_socket, busy_poll_attach, busy_poll_report};
+    bp->self = (void *)bpd;
+    return bp;
+}
+
+#endif /* _BUSYPOLL_H_ */
@@ -12,6 +12,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 
+#include "duckchat.h"
 #include "utils.h"
 
 typedef struct channellist ChannelList;
@@ -30,8 +31,24 @@ struct channellist {
     void (*renew)(const ChannelList *cl, char *channelName);
     void (*age)(const ChannelList *cl);
     const ChannelList *(*find_outdated_channel)(const ChannelList *cl);
+
+    // Digests
+    unsigned long long (*digest)(const ChannelList *cl, int *count);
+    void (*renew_all)(const ChannelList *cl);
 };
 
+unsigned long long channel_list_hash(const char *channelName) {
+    /*
+      Hashes one channel name (FNV-1a, then mixed). Set digests add these
+      up, so they don't depend on the order channels were added in.
+    */
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; (i < CHANNEL_MAX) && (channelName[i] != '\0'); i++)
+        hash = (hash ^ (unsigned char)channelName[i]) * 0x100000001b3ULL;
+    hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdULL;
+    return hash ^ (hash >> 33);
+}
+
 
 typedef struct channellistdata {
     char *channelName;
@@ -68,7 +85,7 @@ static bool channel_list_add_channel(const ChannelList *cl, char *channelName) {
     const ChannelList *next = cld->next;
     if (next != NULL) {
         // add it to the end
-        return cl->add_channel(cl, channelName);
+        return next->add_channel(next, channelName);
     } else {
         if (cld->channelName == NULL) {
             // this is a singleton channel -- set this ones in particular
@@ -130,10 +147,16 @@ static bool channel_list_remove_channel(const ChannelList *cl, char *channelName
             } else {
                 // we are actually removing the first channel... hmm...
                 // lets go ahead and replace ourselves with the next in line.
+                free(cld->channelName);
                 cld->channelName = next_d->channelName;
+                cld->state = next_d->state;
                 cld->next = next_d->next;
-                cld->prev = NULL;;
+                cld->prev = NULL;
+                if (cld->next != NULL)
+                    ((ChannelListData *)(cld->next->self))->prev = cl;
 
+                // the name is ours now
+                next_d->channelName = NULL;
                 next_d->next = NULL;
                 next->cleanup(next);
             }
@@ -144,7 +167,7 @@ static bool channel_list_remove_channel(const ChannelList *cl, char *channelName
     } else {
         // check the next one
         if (next != NULL) {
-            return next->has_channel(next, channelName);
+            return next->remove_channel(next, channelName);
         } else {
             // could not find it
             return false;
@@ -237,6 +260,35 @@ static const ChannelList *channel_list_find_outdated_channel(const ChannelList *
     return NULL;
 }
 
+static unsigned long long channel_list_digest(const ChannelList *cl, int *count) {
+    /*
+      Digests the set of channels in this list, counting them into count.
+    */
+    ChannelListData *cld = (ChannelListData *)cl->self;
+    unsigned long long digest = 0;
+    if (cld->channelName != NULL) {
+        digest = channel_list_hash(cld->channelName);
+        *count += 1;
+    }
+
+    // Add in the rest.
+    const ChannelList *next = cld->next;
+    if (next != NULL)
+        digest += next->digest(next, count);
+    return digest;
+}
+
+static void channel_list_renew_all(const ChannelList *cl) {
+    /* Renews every channel in this list. */
+    ChannelListData *cld = (ChannelListData *)cl->self;
+    if (cld->channelName != NULL)
+        cld->state = 2;
+
+    const ChannelList *next = cld->next;
+    if (next != NULL)
+        next->renew_all(next);
+}
+
 const ChannelList *ChannelList_create() {
     ChannelList *cl = (ChannelList *)malloc(sizeof(ChannelList));
     memset(cl, 0, sizeof(ChannelList));
@@ -248,7 +300,8 @@ const ChannelList *ChannelList_create() {
     cld->prev = NULL;
 
     *cl = {NULL, channel_list_cleanup, channel_list_add_channel, channel_list_remove_channel, channel_list_has_channel,
-           channel_list_is_valid, channel_list_renew, channel_list_age, channel_list_find_outdated_channel};
+           channel_list_is_valid, channel_list_renew, channel_list_age, channel_list_find_outdated_channel,
+           channel_list_digest, channel_list_renew_all};
     cl->self = (void *)cld;
     return cl;
 }
@@ -5,14 +5,16 @@
 #include <signal.h>
 
 #include <sys/socket.h>
-#include <poll.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <cerrno>
 
 #include "client.h"
 #include "duckchat.h"
 #include "raw.h"
 #include "utils.h"
+#include "reactor.h"
 
 /*
  * Message Management
@@ -86,7 +88,8 @@ void good_morning() {
 // A small container struct for passing back socket data.
 struct socket_data {
     int socketFd;
-    sockaddr_in address;
+    sockaddr_storage address;    // sockaddr_in, or sockaddr_un for a local server
+    socklen_t addressLength;
 };
 
 static socket_data socketData;
@@ -129,12 +132,40 @@ bool create_socket(char *node, char *service) {
     socketData.socketFd = socketFd;
     memset(&(socketData.address), 0, sizeof(socketData.address));
     memcpy(&(socketData.address), res->ai_addr, res->ai_addrlen);
+    socketData.addressLength = res->ai_addrlen;
 
     // Everything is good to go! Cleanup.
     freeaddrinfo(res);
     return true;
 }
 
+bool create_unix_socket(char *path) {
+    /* Opens a unix datagram socket to a server on this host. */
+    if (strlen(path) >= UNIX_PATH_MAX) {
+        fprintf(stderr, "Unix socket path is too long.");
+        return false;
+    }
+    int socketFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (socketFd < 0) return false;
+
+    // The server needs somewhere to reply to; let the kernel pick an
+    // abstract name for us.
+    sa_family_t family = AF_UNIX;
+    if (bind(socketFd, (struct sockaddr *)&family, sizeof(family)) < 0) {
+        fprintf(stderr, "Could not bind unix socket.");
+        close(socketFd);
+        return false;
+    }
+
+    struct sockaddr_un *address = (struct sockaddr_un *)&(socketData.address);
+    memset(&(socketData.address), 0, sizeof(socketData.address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    socketData.socketFd = socketFd;
+    socketData.addressLength = sizeof(struct sockaddr_un);
+    return true;
+}
+
 bool login(char *username) {
     /*
      * Sends a login packet.
@@ -154,7 +185,7 @@ bool login(char *username) {
         socketData.socketFd,
         (void *)(&bad_request), 1, 0,
         (const struct sockaddr *)(&socketData.address),
-        sizeof(struct sockaddr_in)
+        socketData.addressLength
     );
 
     // Then send an actual login request.
@@ -162,7 +193,7 @@ bool login(char *username) {
         socketData.socketFd,
         (void *)datagram, sizeof(request_login), 0,
         (const struct sockaddr *)(&socketData.address),
-        sizeof(struct sockaddr_in)
+        socketData.addressLength
     );
     free((void *)datagram);
     if (result < 0) return false;
@@ -177,367 +208,387 @@ void keep_alive(int) {
         socketData.socketFd,
         (void *)(&datagram), message_size, 0,
         (const struct sockaddr *)(&(socketData.address)),
-        sizeof(struct sockaddr_in)
+        socketData.addressLength
     );
 
     // Prepare the next keepalive call.
     alarm(CLIENT_KEEPALIVE);
 }
 
-void event_loop() {
-    // Performs the event loop.
-    const int fds_cnt = 2;          // file descriptors
-    const int poll_timeout = 0;    // poll timeout
-
+void on_input_ready(const Reactor *rc, int, unsigned, void *) {
     // Various setup
     char buffer[BUFFER_SIZE + 1];
-    int result;
-    prepare_input();
 
     // Decompose our socket data.
     int openSocket = socketData.socketFd;
-    sockaddr_in address = socketData.address;
 
-    // Set up two file descriptors to poll for:
-    // our socket value and standard input.
-    struct pollfd fds[fds_cnt] = {
-        {fd: STDIN_FILENO, events: POLLIN, revents: 0},
-        {fd: openSocket, events: POLLIN, revents: 0}
-    };
+    // We got something from user input, kinda Epic.
+    if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
+        // Standard input is gone, so there is nobody left to chat.
+        rc->stop(rc);
+        return;
+    }
 
-    // Prepare keep-alive.
-    // signal(SIGALRM, keep_alive);
-    // alarm(CLIENT_KEEPALIVE);
+    // Some locals for our command.
+    void *raw_datagram;
+    size_t message_size;
+    bool send = false;
+    bool leave = false;
+
+    // Decipher our message.
+    if (!is_command(buffer)) {
+        // This is being sent out as a regular message.
+        request_say *datagram = (request_say *)malloc(sizeof(request_say));
+        if (datagram == NULL) {fprintf(stderr, "Out of memory"); rc->stop(rc); return;}
+        memset((void *)datagram, 0, sizeof(request_say));
+        datagram->req_type = REQ_SAY;
+        strncat(datagram->req_channel, current_channel, CHANNEL_MAX);
+        strncat(datagram->req_text, buffer, SAY_MAX);
+
+        // We will be sending this out.
+        raw_datagram = (void *)datagram;
+        message_size = sizeof(request_say);
+        send = true;
+    } else {
+        // Figure out which command this is.
+        if (test_command(buffer, "exit")) {
+            // Leave the chat.
+            printf("Goodbye!\n");
+
+            // Format datagram.
+            request_logout *datagram = (request_logout *)malloc(sizeof(request_logout));
+            memset((void *)datagram, 0, sizeof(request_logout));
+            datagram->req_type = REQ_LOGOUT;
+
+            // We will be sending this out.
+            raw_datagram = (void *)datagram;
+            message_size = sizeof(request_leave);
+            send = true;
+
+            // Set the leave flag.
+            leave = true;
+        } else if (test_command(buffer, "help")) {
+            // Print help.
+            printf("-=- Command List -=-\n");
+            printf("/join <channel>   - Joins/creates a specified channel.\n");
+            printf("/leave <channel>  - Leaves a specified channel.\n");
+            printf("/list             - Lists the name of all channels.\n");
+            printf("/who <channel>    - Lists the users on the given channel.\n");
+            printf("/switch <channel> - Switches to an existing named channel that has been joined.\n");
+            printf("/exit             - Exits DuckChat.\n");
+        } else if (test_command(buffer, "join")) {
+            // Ensure the argument is valid.
+            char *arg = get_command_argument(buffer);
+            if (arg == NULL) {
+                printf("Usage: /join <channel>\n");
+            } else {
+                // Format datagram.
+                request_join *datagram = (request_join *)malloc(sizeof(request_join));
+                if (datagram == NULL) {fprintf(stderr, "Out of memory"); rc->stop(rc); return;}
+                memset((void *)datagram, 0, sizeof(request_join));
+                datagram->req_type = REQ_JOIN;
+                strcpy(current_channel, arg);
+                strncat(datagram->req_channel, arg, CHANNEL_MAX);
+
+                scrub_channel_name(arg);
+                if (!is_channel_name_real(arg))
+                    add_channel(arg);
 
-    // Start the poll loop.
-    while (1) {
-        // Perform polling.
-        poll(fds, fds_cnt, poll_timeout);
-        // Determine what has updated.
-        if (fds[0].revents & POLLIN) {
-            // We got something from user input, kinda Epic.
-            fgets(buffer, BUFFER_SIZE, stdin);
-
-            // Some locals for our command.
-            void *raw_datagram;
-            size_t message_size;
-            bool send = false;
-            bool leave = false;
-
-            // Decipher our message.
-            if (!is_command(buffer)) {
-                // This is being sent out as a regular message.
-                request_say *datagram = (request_say *)malloc(sizeof(request_say));
-                if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                memset((void *)datagram, 0, sizeof(request_say));
-                datagram->req_type = REQ_SAY;
-                strncat(datagram->req_channel, current_channel, CHANNEL_MAX);
-                strncat(datagram->req_text, buffer, SAY_MAX);
+                // We will be sending this out.
+                raw_datagram = (void *)datagram;
+                message_size = sizeof(request_join);
+                send = true;
+            }
+        } else if (test_command(buffer, "leave")) {
+            // Ensure the argument is valid.
+            char *arg = get_command_argument(buffer);
+            if (arg == NULL) {
+                printf("Usage: /leave <channel>\n");
+            } else {
+                // Format datagram.
+                request_leave *datagram = (request_leave *)malloc(sizeof(request_leave));
+                if (datagram == NULL) {fprintf(stderr, "Out of memory"); rc->stop(rc); return;}
+                memset((void *)datagram, 0, sizeof(request_leave));
+                datagram->req_type = REQ_LEAVE;
+                strncat(datagram->req_channel, arg, CHANNEL_MAX);
+
+                scrub_channel_name(arg);
+                remove_channel(arg);
 
                 // We will be sending this out.
                 raw_datagram = (void *)datagram;
-                message_size = sizeof(request_say);
+                message_size = sizeof(request_leave);
                 send = true;
+            }
+        } else if (test_command(buffer, "list")) {
+            // Format datagram.
+            request_list *datagram = (request_list *)malloc(sizeof(request_list));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); rc->stop(rc); return;}
+            memset((void *)datagram, 0, sizeof(request_list));
+            datagram->req_type = REQ_LIST;
+
+            // We will be sending this out.
+            raw_datagram = (void *)datagram;
+            message_size = sizeof(request_list);
+            send = true;
+        } else if (test_command(buffer, "who")) {
+            // Ensure the argument is valid.
+            char *arg = get_command_argument(buffer);
+            if (arg == NULL) {
+                printf("Usage: /who <channel>\n");
             } else {
-                // Figure out which command this is.
-                if (test_command(buffer, "exit")) {
-                    // Leave the chat.
-                    printf("Goodbye!\n");
-
-                    // Format datagram.
-                    request_logout *datagram = (request_logout *)malloc(sizeof(request_logout));
-                    memset((void *)datagram, 0, sizeof(request_logout));
-                    datagram->req_type = REQ_LOGOUT;
-
-                    // We will be sending this out.
-                    raw_datagram = (void *)datagram;
-                    message_size = sizeof(request_leave);
-                    send = true;
-
-                    // Set the leave flag.
-                    leave = true;
-                } else if (test_command(buffer, "help")) {
-                    // Print help.
-                    printf("-=- Command List -=-\n");
-                    printf("/join <channel>   - Joins/creates a specified channel.\n");
-                    printf("/leave <channel>  - Leaves a specified channel.\n");
-                    printf("/list             - Lists the name of all channels.\n");
-                    printf("/who <channel>    - Lists the users on the given channel.\n");
-                    printf("/switch <channel> - Switches to an existing named channel that has been joined.\n");
-                    printf("/exit             - Exits DuckChat.\n");
-                } else if (test_command(buffer, "join")) {
-                    // Ensure the argument is valid.
-                    char *arg = get_command_argument(buffer);
-                    if (arg == NULL) {
-                        printf("Usage: /join <channel>\n");
-                    } else {
-                        // Format datagram.
-                        request_join *datagram = (request_join *)malloc(sizeof(request_join));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memset((void *)datagram, 0, sizeof(request_join));
-                        datagram->req_type = REQ_JOIN;
+                // Format datagram.
+                request_who *datagram = (request_who *)malloc(sizeof(request_who));
+                if (datagram == NULL) {fprintf(stderr, "Out of memory"); rc->stop(rc); return;}
+                memset((void *)datagram, 0, sizeof(request_who));
+                datagram->req_type = REQ_WHO;
+                strncat(datagram->req_channel, arg, CHANNEL_MAX);
+
+                // We will be sending this out.
+                raw_datagram = (void *)datagram;
+                message_size = sizeof(request_who);
+                send = true;
+            }
+        } else if (test_command(buffer, "switch")) {
+            // Ensure the argument is valid.
+            char *arg = get_command_argument(buffer);
+            if (arg == NULL) {
+                printf("Usage: /switch <channel>\n");
+            } else {
+                // Does the channel exist?
+                scrub_channel_name(arg);
+                if (is_channel_name_real(arg)) {
+                    if (strcmp(current_channel, arg) == 0)
+                        printf("You are already in channel [%s].\n", arg);
+                    else {
                         strcpy(current_channel, arg);
-                        strncat(datagram->req_channel, arg, CHANNEL_MAX);
+                        printf("Switched to channel [%s].\n", arg);
+                    }
+                } else
+                    printf("You are not in [%s], so you may not switch to it.\n", arg);
+            }
+        } else {
+            // Invalid command given.
+            printf("Invalid command. Use /help for a list of commands.\n");
+        }
+    }
 
-                        scrub_channel_name(arg);
-                        if (!is_channel_name_real(arg))
-                            add_channel(arg);
+    // Send our datagram.
+    if (send) {
+        int result = sendto(
+            openSocket,
+            (void *)raw_datagram, message_size, 0,
+            (const struct sockaddr *)(&(socketData.address)),
+            socketData.addressLength
+        );
+        free(raw_datagram);
+        if (result < 0) {
+            fprintf(stderr, "Message failed to transmit. Disconnecting...\n");
+            rc->stop(rc);
+            return;
+        }
+        // Reset keepalive.
+        alarm(CLIENT_KEEPALIVE);
+    }
 
-                        // We will be sending this out.
-                        raw_datagram = (void *)datagram;
-                        message_size = sizeof(request_join);
-                        send = true;
-                    }
-                } else if (test_command(buffer, "leave")) {
-                    // Ensure the argument is valid.
-                    char *arg = get_command_argument(buffer);
-                    if (arg == NULL) {
-                        printf("Usage: /leave <channel>\n");
-                    } else {
-                        // Format datagram.
-                        request_leave *datagram = (request_leave *)malloc(sizeof(request_leave));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memset((void *)datagram, 0, sizeof(request_leave));
-                        datagram->req_type = REQ_LEAVE;
-                        strncat(datagram->req_channel, arg, CHANNEL_MAX);
-
-                        scrub_channel_name(arg);
-                        remove_channel(arg);
-
-                        // We will be sending this out.
-                        raw_datagram = (void *)datagram;
-                        message_size = sizeof(request_leave);
-                        send = true;
-                    }
-                } else if (test_command(buffer, "list")) {
-                    // Format datagram.
-                    request_list *datagram = (request_list *)malloc(sizeof(request_list));
+    // Leave if necessary.
+    if (leave) {
+        rc->stop(rc);
+        return;
+    }
+
+    // Prepare input now for the next message.
+    prepare_input();
+}
+
+void on_server_ready(const Reactor *rc, int, unsigned, void *) {
+    // Various setup
+    char buffer[BUFFER_SIZE + 1];
+    int openSocket = socketData.socketFd;
+
+    // The server has sent us something. Drain all of it,
+    // since the socket is watched edge-triggered.
+    while (1) {
+        int result = recv(openSocket, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+        if (result < 0) {
+            // Nothing left to read.
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+
+            // We received a bad call. Let's close the connection
+            printf("Connection terminated.\n");
+            rc->stop(rc);
+            return;
+        } else {
+            // We received a message. First, undo the current client input.
+            for (int i = 0; i < 512; i++)
+                printf("\b");
+            fflush(stdout);
+
+            // Now, figure out the datagram that we received.
+            // What request type are we dealing with?
+            text_t *textType = (text_t *)malloc(sizeof(text_t));
+            if (textType == NULL) {fprintf(stderr, "Out of memory"); rc->stop(rc); return;}
+            memcpy((void *)textType, (const void *)buffer, sizeof(request_t));
+
+            // Handle the request types differently.
+            switch (*textType) {
+                //                                        //
+                // PERSON SAYS AWESOME IMPORTANT MESSAGES //
+                //                                        //
+                case TXT_SAY: {
+                    // Decipher the request.
+                    text_say *datagram = (text_say *)malloc(sizeof(text_say));
                     if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                    memset((void *)datagram, 0, sizeof(request_list));
-                    datagram->req_type = REQ_LIST;
-
-                    // We will be sending this out.
-                    raw_datagram = (void *)datagram;
-                    message_size = sizeof(request_list);
-                    send = true;
-                } else if (test_command(buffer, "who")) {
-                    // Ensure the argument is valid.
-                    char *arg = get_command_argument(buffer);
-                    if (arg == NULL) {
-                        printf("Usage: /who <channel>\n");
-                    } else {
-                        // Format datagram.
-                        request_who *datagram = (request_who *)malloc(sizeof(request_who));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memset((void *)datagram, 0, sizeof(request_who));
-                        datagram->req_type = REQ_WHO;
-                        strncat(datagram->req_channel, arg, CHANNEL_MAX);
-
-                        // We will be sending this out.
-                        raw_datagram = (void *)datagram;
-                        message_size = sizeof(request_who);
-                        send = true;
+                    memcpy((void *)datagram, (const void *)buffer, sizeof(text_say));
+
+                    // Print the message.
+                    scrub_channel_name(datagram->txt_channel);
+                    printf("[%s][%s]: %s\n", datagram->txt_channel, datagram->txt_username, datagram->txt_text);
+
+                    // Cleanup.
+                    fflush(stdout);
+                    free(datagram);
+                    } break;
+
+                //              //
+                // CHANNEL LIST //
+                //              //
+                case TXT_LIST: {
+                    // Decipher the request.
+                    text_list *datagram = (text_list *)malloc(sizeof(text_list));
+                    if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+                    memcpy((void *)datagram, (const void *)buffer, sizeof(text_list));
+
+                    // Re-allocate with real size.
+                    int datagram_size = get_channel_list_datagram_size((void *)datagram);
+                    datagram = (text_list *)realloc((void *)datagram, datagram_size);
+                    if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+                    memcpy((void *)datagram, (const void *)buffer, datagram_size);
+
+                    // Print the channel listing.
+                    printf("Existing channels:\n");
+                    for (int i = 0; i < datagram->txt_nchannels; i++) {
+                        // TODO - validate we aren't receiving bad data
+                        struct channel_info channelInfo = (datagram->txt_channels)[i];
+                        printf("  %s\n", channelInfo.ch_channel);
                     }
-                } else if (test_command(buffer, "switch")) {
-                    // Ensure the argument is valid.
-                    char *arg = get_command_argument(buffer);
-                    if (arg == NULL) {
-                        printf("Usage: /switch <channel>\n");
-                    } else {
-                        // Does the channel exist?
-                        scrub_channel_name(arg);
-                        if (is_channel_name_real(arg)) {
-                            if (strcmp(current_channel, arg) == 0)
-                                printf("You are already in channel [%s].\n", arg);
-                            else {
-                                strcpy(current_channel, arg);
-                                printf("Switched to channel [%s].\n", arg);
-                            }
-                        } else
-                            printf("You are not in [%s], so you may not switch to it.\n", arg);
+
+                    // Cleanup.
+                    fflush(stdout);
+                    free(datagram);
+                    } break;
+
+                //                //
+                // WHO IN CHANNEL //
+                //                //
+                case TXT_WHO: {
+                    // Decipher the request.
+                    text_who *datagram = (text_who *)malloc(sizeof(text_who));
+                    if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+                    memcpy((void *)datagram, (const void *)buffer, sizeof(text_who));
+
+                    // Re-allocate with real size.
+                    int datagram_size = get_who_datagram_size((void *)datagram);
+                    datagram = (text_who *)realloc((void *)datagram, datagram_size);
+                    if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+                    memcpy((void *)datagram, (const void *)buffer, datagram_size);
+
+                    // Print the channel listing.
+                    printf("Users on channel %s:\n", datagram->txt_channel);
+                    for (int i = 0; i < datagram->txt_nusernames; i++) {
+                        // TODO - validate we aren't receiving bad data
+                        struct user_info userInfo = (datagram->txt_users)[i];
+                        printf("  %s\n", userInfo.us_username);
                     }
-                } else {
-                    // Invalid command given.
-                    printf("Invalid command. Use /help for a list of commands.\n");
-                }
-            }
 
-            // Send our datagram.
-            if (send) {
-                result = sendto(
-                    openSocket,
-                    (void *)raw_datagram, message_size, 0,
-                    (const struct sockaddr *)(&address),
-                    sizeof(struct sockaddr_in)
-                );
-                free(raw_datagram);
-                if (result < 0) {
-                    fprintf(stderr, "Message failed to transmit. Disconnecting...\n");
+                    // Cleanup.
+                    fflush(stdout);
+                    free(datagram);
+                    } break;
+
+                //                //
+                // ERROR CALLBACK //
+                //                //
+                case TXT_ERROR: {
+                    // Decipher the request.
+                    text_error *datagram = (text_error *)malloc(sizeof(text_error));
+                    if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+                    memcpy((void *)datagram, (const void *)buffer, sizeof(text_error));
+
+                    // Print the message.
+                    printf("%s\n", datagram->txt_error);
+
+                    // Cleanup.
+                    fflush(stdout);
+                    free(datagram);
+                    } break;
+
+                //                 //
+                // UNKNOWN REQUEST //
+                //                 //
+                default:
+                    printf("Received undefined request, ignoring\n");
                     break;
-                }
-                // Reset keepalive.
-                alarm(CLIENT_KEEPALIVE);
             }
 
-            // Leave if necessary.
-            if (leave)
-                break;
-
-            // Prepare input now for the next message.
+            // Bring back the client input.
+            fflush(stdout);
             prepare_input();
         }
-        if (fds[1].revents & POLLIN) {
-            // The server has sent us something.
-            int result = recv(openSocket, buffer, BUFFER_SIZE, 0);
-            if (result < 0) {
-                // We received a bad call. Let's close the connection
-                printf("Connection terminated.\n");
-                break;
-            } else {
-                // We received a message. First, undo the current client input.
-                for (int i = 0; i < 512; i++)
-                    printf("\b");
-                fflush(stdout);
-
-                // Now, figure out the datagram that we received.
-                // What request type are we dealing with?
-                text_t *textType = (text_t *)malloc(sizeof(text_t));
-                if (textType == NULL) {fprintf(stderr, "Out of memory"); break;}
-                memcpy((void *)textType, (const void *)buffer, sizeof(request_t));
-
-                // Handle the request types differently.
-                switch (*textType) {
-                    //                                        //
-                    // PERSON SAYS AWESOME IMPORTANT MESSAGES //
-                    //                                        //
-                    case TXT_SAY: {
-                        // Decipher the request.
-                        text_say *datagram = (text_say *)malloc(sizeof(text_say));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(text_say));
-
-                        // Print the message.
-                        scrub_channel_name(datagram->txt_channel);
-                        printf("[%s][%s]: %s\n", datagram->txt_channel, datagram->txt_username, datagram->txt_text);
-
-                        // Cleanup.
-                        fflush(stdout);
-                        free(datagram);
-                        } break;
-
-                    //              //
-                    // CHANNEL LIST //
-                    //              //
-                    case TXT_LIST: {
-                        // Decipher the request.
-                        text_list *datagram = (text_list *)malloc(sizeof(text_list));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(text_list));
-
-                        // Re-allocate with real size.
-                        int datagram_size = get_channel_list_datagram_size((void *)datagram);
-                        datagram = (text_list *)realloc((void *)datagram, datagram_size);
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, datagram_size);
-
-                        // Print the channel listing.
-                        printf("Existing channels:\n");
-                        for (int i = 0; i < datagram->txt_nchannels; i++) {
-                            // TODO - validate we aren't receiving bad data
-                            struct channel_info channelInfo = (datagram->txt_channels)[i];
-                            printf("  %s\n", channelInfo.ch_channel);
-                        }
-
-                        // Cleanup.
-                        fflush(stdout);
-                        free(datagram);
-                        } break;
-
-                    //                //
-                    // WHO IN CHANNEL //
-                    //                //
-                    case TXT_WHO: {
-                        // Decipher the request.
-                        text_who *datagram = (text_who *)malloc(sizeof(text_who));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(text_who));
-
-                        // Re-allocate with real size.
-                        int datagram_size = get_who_datagram_size((void *)datagram);
-                        datagram = (text_who *)realloc((void *)datagram, datagram_size);
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, datagram_size);
-
-                        // Print the channel listing.
-                        printf("Users on channel %s:\n", datagram->txt_channel);
-                        for (int i = 0; i < datagram->txt_nusernames; i++) {
-                            // TODO - validate we aren't receiving bad data
-                            struct user_info userInfo = (datagram->txt_users)[i];
-                            printf("  %s\n", userInfo.us_username);
-                        }
-
-                        // Cleanup.
-                        fflush(stdout);
-                        free(datagram);
-                        } break;
-
-                    //                //
-                    // ERROR CALLBACK //
-                    //                //
-                    case TXT_ERROR: {
-                        // Decipher the request.
-                        text_error *datagram = (text_error *)malloc(sizeof(text_error));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(text_error));
-
-                        // Print the message.
-                        printf("%s\n", datagram->txt_error);
-
-                        // Cleanup.
-                        fflush(stdout);
-                        free(datagram);
-                        } break;
-
-                    //                 //
-                    // UNKNOWN REQUEST //
-                    //                 //
-                    default:
-                        printf("Received undefined request, ignoring\n");
-                        break;
-                }
-
-                // Bring back the client input.
-                fflush(stdout);
-                prepare_input();
-            }
-        }
     }
 }
 
+void event_loop() {
+    // Performs the event loop.
+    const int poll_timeout = 0;    // poll timeout
+    prepare_input();
+
+    // Register our two event sources:
+    // standard input and our socket value.
+    const Reactor *reactor = Reactor_create();
+    if (reactor == NULL) return;
+    reactor->add(reactor, STDIN_FILENO, REACTOR_READ, on_input_ready, NULL);
+    reactor->add(reactor, socketData.socketFd, REACTOR_READ | REACTOR_EDGE, on_server_ready, NULL);
+
+    // Prepare keep-alive.
+    // signal(SIGALRM, keep_alive);
+    // alarm(CLIENT_KEEPALIVE);
+
+    // Start the loop.
+    reactor->run(reactor, poll_timeout);
+    reactor->cleanup(reactor);
+}
+
 /*
  * Main
  */
 
 int main(int argc, char *argv[]) {
     // Validate arguments
-    if (argc != 4) {
+    bool local = ((argc == 3) && (strncmp(argv[1], "--unix=", 7) == 0));
+    if ((argc != 4) && !local) {
         fprintf(stderr, "Usage: %s <hostname> <port> <username>\n", argv[0]);
+        fprintf(stderr, "       %s --unix=<path> <username>\n", argv[0]);
         exit(0);
     }
 
-    // Get our arguments.
-    char *hostname = argv[1];
-    char *port = argv[2];
-
     // Open the socket.
-    bool result = create_socket(hostname, port);
+    bool result;
+    if (local) {
+        result = create_unix_socket(argv[1] + 7);
+    } else {
+        // Get our arguments.
+        char *hostname = argv[1];
+        char *port = argv[2];
+        result = create_socket(hostname, port);
+    }
     if (result == false) {
         fprintf(stderr, "Socket initialization failed.\n");
         return 0;
     }
 
     // Do some initiation.
-    login(argv[3]);
+    login(argv[argc - 1]);
 
     // TODO move the below out of here
     add_channel("Common");
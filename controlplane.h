@@ -0,0 +1,90 @@
+#ifndef _CONTROLPLANE_H_
+#define _CONTROLPLANE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+#include "duckchat.h"
+
+/*
+ * Control plane helpers
+ *
+ * A say flood and the traffic that keeps the mesh up -- logins, keep
+ * alives, joins and leaves, hellos, LSAs, acks -- used to share one
+ * socket. Once the flood filled its receive buffer the kernel dropped
+ * whatever came next, so routes expired and clients timed out, and the
+ * resyncs that followed only added to the load.
+ *
+ * Instead, two sockets share our port through SO_REUSEPORT, and a
+ * classic BPF program on the group picks the socket for each datagram
+ * by its type before it's queued: says, lists and whos to the data
+ * socket, everything else to the control socket. Each has its own
+ * receive buffer, and the event loop always empties the control socket
+ * first.
+ */
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+#define CONTROL_PLANE_DEFAULT_BUDGET 256    // kilobytes
+#define CONTROL_PLANE_INTERVAL 16           // data datagrams between control checks
+
+bool control_plane_prepare(int socket) {
+    /* Lets the control socket share the port; call before binding. */
+    int on = 1;
+    return setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+}
+
+bool control_plane_set_budget(int socket, int bytes) {
+    /* Sizes a receive buffer, past rmem_max if we're allowed to. */
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) == 0) return true;
+    return setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) == 0;
+}
+
+int control_plane_open(struct sockaddr_in *address, int budget) {
+    /*
+     * Binds the control socket next to the data socket, which must already
+     * be bound to address with control_plane_prepare. Returns the socket,
+     * or -1 if the kernel can't steer datagrams between them.
+     */
+    int controlSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (controlSocket < 0) return -1;
+    if (!control_plane_prepare(controlSocket) ||
+        (bind(controlSocket, (struct sockaddr *)address, sizeof(struct sockaddr_in)) < 0)) {
+        fprintf(stderr, "Could not bind the control socket. (%d)\n", errno);
+        close(controlSocket);
+        return -1;
+    }
+    if (!control_plane_set_budget(controlSocket, budget))
+        fprintf(stderr, "Could not size the control socket's buffer. (%d)\n", errno);
+
+    // The group's sockets are numbered in bind order: 0 is data, 1 is us.
+    // Loads see the UDP payload, and a word load is in network order.
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, 0},
+        {BPF_JMP | BPF_JEQ | BPF_K, 4, 0, htonl(REQ_SAY)},
+        {BPF_JMP | BPF_JEQ | BPF_K, 3, 0, htonl(S2S_SAY)},
+        {BPF_JMP | BPF_JEQ | BPF_K, 2, 0, htonl(REQ_LIST)},
+        {BPF_JMP | BPF_JEQ | BPF_K, 1, 0, htonl(REQ_WHO)},
+        {BPF_RET | BPF_K, 0, 0, 1},
+        {BPF_RET | BPF_K, 0, 0, 0},
+    };
+    struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(controlSocket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+        fprintf(stderr, "Could not steer control traffic. (%d)\n", errno);
+        close(controlSocket);
+        return -1;
+    }
+    return controlSocket;
+}
+
+#endif /* _CONTROLPLANE_H_ */
@@ -43,6 +43,18 @@ typedef int s2s_t;
 #define S2S_JOIN 8
 #define S2S_LEAVE 9
 #define S2S_SAY 10
+#define S2S_JOIN_BATCH 11
+#define S2S_LEAVE_BATCH 12
+#define S2S_DIGEST 13
+#define S2S_RESYNC 14
+#define S2S_LSA 15
+#define S2S_RELIABLE 16
+#define S2S_ACK 17
+#define S2S_HELLO 18
+#define S2S_PING 19
+#define S2S_PING_REQ 20
+#define S2S_PING_ACK 21
+#define S2S_MEMBERS 22
 
 #define REQ_BAD 255
 
@@ -112,6 +124,96 @@ struct request_server_leave {
         char req_channel[CHANNEL_MAX];
 };
 
+// Many channels in one datagram, as many as fit in BUFFER_SIZE. Servers
+// advertise them with an empty batch and only fill them for servers that
+// have sent one back; anyone else (ex_server) keeps getting the above.
+struct request_server_channels {
+        request_t req_type; /* = S2S_JOIN_BATCH or S2S_LEAVE_BATCH */
+        sockaddr_in address;
+        int req_count;
+        char req_channels[][CHANNEL_MAX];
+};
+
+// A summary of the channels the sender has, in place of renewing them one
+// by one. A receiver whose table for the sender disagrees asks for every
+// channel again with S2S_RESYNC, which carries its own view.
+struct request_server_digest {
+        request_t req_type; /* = S2S_DIGEST or S2S_RESYNC */
+        sockaddr_in address;
+        int req_count;
+        unsigned long long req_digest;
+};
+
+// One server's neighbors, flooded to every server so each can compute the
+// same Say distribution tree. The address is the hop it came from, the
+// origin whose links these are; a higher sequence replaces a lower one.
+struct server_link {
+        sockaddr_in address;
+        unsigned int cost;    // from the origin's measurements, 1 for a fast, clean link
+};
+
+struct request_server_lsa {
+        request_t req_type; /* = S2S_LSA */
+        sockaddr_in address;
+        sockaddr_in origin;
+        unsigned int req_seq;
+        int req_count;
+        struct server_link req_links[];
+};
+
+// A Join or Leave batch that has to arrive. Each sender numbers them per
+// neighbor and retransmits until acked; receivers apply them in order and
+// ack cumulatively. The epoch changes whenever the sender restarts.
+struct request_server_reliable {
+        request_t req_type; /* = S2S_RELIABLE */
+        sockaddr_in address;
+        unsigned int req_epoch;
+        unsigned int req_seq;
+        char req_payload[];    // a request_server_channels
+};
+
+struct request_server_ack {
+        request_t req_type; /* = S2S_ACK */
+        sockaddr_in address;
+        unsigned int req_epoch;    // the epoch being acked, the other side's
+        unsigned int req_seq;      // everything up to this one has been applied
+};
+
+// A heartbeat, sent to every neighbor a few times a second; a neighbor
+// whose heartbeats stop is routed around. Gaps in the sequence measure
+// loss, and echoing the receiver's last stamp back measures the round trip.
+struct request_server_hello {
+        request_t req_type; /* = S2S_HELLO */
+        sockaddr_in address;
+        unsigned int req_seq;
+        long long req_stamp;    // our clock, microseconds
+        long long req_echo;     // the last stamp we got from the receiver, 0 if none
+        long long req_held;     // microseconds between getting that and sending this
+};
+
+// Gossip membership (SWIM). Each period a server pings one member, and
+// failing an ack, asks a few others to ping it for it; what everyone has
+// heard about who's alive rides along on every ping and ack. A member only
+// ever raises its own incarnation, to refute a rumour that it's dead.
+#define GOSSIP_ALIVE 0
+#define GOSSIP_SUSPECT 1
+#define GOSSIP_DEAD 2
+
+struct gossip_update {
+        sockaddr_in address;
+        unsigned int incarnation;
+        int state;    // GOSSIP_ALIVE, GOSSIP_SUSPECT or GOSSIP_DEAD
+};
+
+struct request_server_gossip {
+        request_t req_type; /* = S2S_PING, S2S_PING_REQ, S2S_PING_ACK or S2S_MEMBERS */
+        sockaddr_in address;
+        sockaddr_in target;    // PING_REQ: whom to ping; PING and ACK: whom the ack is relayed to, if anyone
+        unsigned int req_seq;
+        int req_count;
+        struct gossip_update req_updates[];    // the sender's own first, but for MEMBERS
+};
+
 struct request_server_say {
         request_t req_type; /* = S2S_SAY */
         sockaddr_in address;
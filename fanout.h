@@ -0,0 +1,305 @@
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <cerrno>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "server.h"
+#include "iobackend.h"
+#include "sharedbuffer.h"
+
+/*
+ * Fan-out pool ADT
+ *
+ * Sends to very large address lists off the main thread. A broadcast is
+ * cut into chunks of FANOUT_CHUNK addresses, each holding a reference to
+ * the datagram, and dealt round-robin onto the workers' deques. Each
+ * worker sends its chunks through the backends itself. A worker that
+ * runs dry steals from the far end of another's deque, so one slow chunk
+ * doesn't hold the rest back.
+ *
+ * The main thread only pays for copying the addresses, and small
+ * channels never come near the pool.
+ */
+
+#define FANOUT_DEFAULT_THRESHOLD 4096
+#define FANOUT_CHUNK 1024
+#define FANOUT_DEQUE_SIZE 1024    // a power of two
+#define FANOUT_MAX_THREADS 16
+#define FANOUT_MAX_BACKENDS 4
+#define FANOUT_NICE 10
+
+typedef struct fanoutpool FanoutPool;
+
+struct fanoutpool {
+    void *self;
+    void (*cleanup)(const FanoutPool *fp);
+
+    // Queues the datagram for every address in the list; false if it couldn't.
+    bool (*submit)(const FanoutPool *fp, struct shared_buffer *buffer, struct AddressRef *addressList);
+};
+
+struct fanout_chunk {
+    struct shared_buffer *buffer;    // one reference per chunk
+    int count;
+    struct AddressRef *refs;    // count of them, linked in order
+    struct sockaddr_in *addresses;
+};
+
+struct fanout_deque {
+    pthread_mutex_t lock;
+    struct fanout_chunk *chunks[FANOUT_DEQUE_SIZE];
+    unsigned int top, bottom;    // steal from top, owner pops bottom
+};
+
+struct fanout_worker {
+    struct fanout_deque deque;
+    pthread_t thread;
+    int index;
+    struct fanoutdata *fpd;
+};
+
+typedef struct fanoutdata {
+    const IOBackend *backends[FANOUT_MAX_BACKENDS];
+    int backendCount;
+
+    struct fanout_worker workers[FANOUT_MAX_THREADS];
+    int workerCount;
+    int nextWorker;    // round-robin deal
+
+    // sleeping workers
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int pending;    // chunks not yet taken
+    bool stopping;
+
+    // counters
+    long long broadcasts, chunks, steals, dropped;
+} FanoutData;
+
+/*
+ * Deques
+ */
+
+static bool fanout_deque_push(struct fanout_deque *deque, struct fanout_chunk *chunk) {
+    pthread_mutex_lock(&(deque->lock));
+    bool pushed = (deque->bottom - deque->top) < FANOUT_DEQUE_SIZE;
+    if (pushed) {
+        deque->chunks[deque->bottom & (FANOUT_DEQUE_SIZE - 1)] = chunk;
+        deque->bottom += 1;
+    }
+    pthread_mutex_unlock(&(deque->lock));
+    return pushed;
+}
+
+static struct fanout_chunk *fanout_deque_pop(struct fanout_deque *deque, bool steal) {
+    /* Takes the newest chunk, or the oldest one if we're stealing. */
+    struct fanout_chunk *chunk = NULL;
+    pthread_mutex_lock(&(deque->lock));
+    if (deque->bottom != deque->top) {
+        if (steal) {
+            chunk = deque->chunks[deque->top & (FANOUT_DEQUE_SIZE - 1)];
+            deque->top += 1;
+        } else {
+            deque->bottom -= 1;
+            chunk = deque->chunks[deque->bottom & (FANOUT_DEQUE_SIZE - 1)];
+        }
+    }
+    pthread_mutex_unlock(&(deque->lock));
+    return chunk;
+}
+
+/*
+ * Workers
+ */
+
+static void fanout_release(struct fanout_chunk *chunk) {
+    shared_buffer_release(chunk->buffer);
+    free(chunk);
+}
+
+static struct fanout_chunk *fanout_take(struct fanout_worker *worker) {
+    /* Finds a chunk to send, sleeping until there is one. NULL means stop. */
+    FanoutData *fpd = worker->fpd;
+    while (1) {
+        struct fanout_chunk *chunk = fanout_deque_pop(&(worker->deque), false);
+        for (int i = 1; (chunk == NULL) && (i < fpd->workerCount); i++) {
+            struct fanout_worker *victim = &(fpd->workers[(worker->index + i) % fpd->workerCount]);
+            chunk = fanout_deque_pop(&(victim->deque), true);
+            if (chunk != NULL) __atomic_add_fetch(&(fpd->steals), 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&(fpd->lock));
+        if (chunk != NULL) {
+            fpd->pending -= 1;
+            pthread_mutex_unlock(&(fpd->lock));
+            return chunk;
+        }
+        if (fpd->stopping) {
+            pthread_mutex_unlock(&(fpd->lock));
+            return NULL;
+        }
+        // Someone may have pushed since we looked; only sleep if not.
+        if (fpd->pending == 0) pthread_cond_wait(&(fpd->wakeup), &(fpd->lock));
+        pthread_mutex_unlock(&(fpd->lock));
+    }
+}
+
+static void *fanout_worker_main(void *context) {
+    struct fanout_worker *worker = (struct fanout_worker *)context;
+    FanoutData *fpd = worker->fpd;
+    struct fanout_chunk *chunk;
+
+    // Bulk work; the main thread should win any fight for a core.
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), FANOUT_NICE) < 0)
+        fprintf(stderr, "Could not lower fan-out worker priority. (%d)\n", errno);
+    while ((chunk = fanout_take(worker)) != NULL) {
+        for (int i = 0; i < fpd->backendCount; i++) {
+            fpd->backends[i]->send(fpd->backends[i], chunk->buffer->data, chunk->buffer->size, chunk->refs);
+            fpd->backends[i]->flush(fpd->backends[i]);
+        }
+        fanout_release(chunk);
+    }
+    return NULL;
+}
+
+/*
+ * Pool
+ */
+
+static void fanout_cleanup(const FanoutPool *fp) {
+    /* Lets the workers finish what's queued, then joins them. */
+    FanoutData *fpd = (FanoutData *)(fp->self);
+    pthread_mutex_lock(&(fpd->lock));
+    fpd->stopping = true;
+    pthread_cond_broadcast(&(fpd->wakeup));
+    pthread_mutex_unlock(&(fpd->lock));
+
+    for (int i = 0; i < fpd->workerCount; i++) {
+        pthread_join(fpd->workers[i].thread, NULL);
+        pthread_mutex_destroy(&(fpd->workers[i].deque.lock));
+    }
+    pthread_mutex_destroy(&(fpd->lock));
+    pthread_cond_destroy(&(fpd->wakeup));
+
+    printf("Fan-out pool: %lld broadcasts in %lld chunks, %lld stolen, %lld dropped\n",
+           fpd->broadcasts, fpd->chunks, fpd->steals, fpd->dropped);
+    free(fp->self);
+    free((void *)fp);
+}
+
+static struct fanout_chunk *fanout_chunk_create(struct shared_buffer *buffer, struct AddressRef *addressList, int count) {
+    /* Copies up to count addresses into one allocation, linked in order. */
+    size_t size = sizeof(struct fanout_chunk) + (sizeof(struct AddressRef) + sizeof(struct sockaddr_in)) * count;
+    struct fanout_chunk *chunk = (struct fanout_chunk *)malloc(size);
+    if (chunk == NULL) return NULL;
+    chunk->buffer = buffer;
+    chunk->refs = (struct AddressRef *)(chunk + 1);
+    chunk->addresses = (struct sockaddr_in *)(chunk->refs + count);
+    chunk->count = 0;
+    while ((chunk->count < count) && (addressList != NULL) && (addressList->_this != NULL)) {
+        int i = chunk->count;
+        memcpy(&(chunk->addresses[i]), addressList->_this, sizeof(struct sockaddr_in));
+        chunk->refs[i]._this = &(chunk->addresses[i]);
+        chunk->refs[i]._next = NULL;
+        if (i > 0) chunk->refs[i - 1]._next = &(chunk->refs[i]);
+        chunk->count += 1;
+        addressList = addressList->_next;
+    }
+    return chunk;
+}
+
+static bool fanout_submit(const FanoutPool *fp, struct shared_buffer *buffer, struct AddressRef *addressList) {
+    /* Chunks the list up and deals the chunks out to the workers. */
+    FanoutData *fpd = (FanoutData *)(fp->self);
+    bool success = true;
+    int queued = 0;
+    while ((addressList != NULL) && (addressList->_this != NULL)) {
+        struct fanout_chunk *chunk = fanout_chunk_create(buffer, addressList, FANOUT_CHUNK);
+        if (chunk == NULL) {fprintf(stderr, "Out of memory"); success = false; break;}
+        for (int i = 0; i < chunk->count; i++) addressList = addressList->_next;
+
+        // Deal it out; a full deque passes it on to the next worker.
+        shared_buffer_retain(buffer);
+        pthread_mutex_lock(&(fpd->lock));
+        fpd->pending += 1;
+        pthread_mutex_unlock(&(fpd->lock));
+        bool pushed = false;
+        for (int i = 0; (i < fpd->workerCount) && !pushed; i++) {
+            struct fanout_worker *worker = &(fpd->workers[fpd->nextWorker]);
+            fpd->nextWorker = (fpd->nextWorker + 1) % fpd->workerCount;
+            pushed = fanout_deque_push(&(worker->deque), chunk);
+        }
+        if (!pushed) {
+            // Every worker is that far behind; drop like a full socket would.
+            pthread_mutex_lock(&(fpd->lock));
+            fpd->pending -= 1;
+            pthread_mutex_unlock(&(fpd->lock));
+            fpd->dropped += chunk->count;
+            fanout_release(chunk);
+            success = false;
+            continue;
+        }
+        queued += 1;
+    }
+
+    if (queued > 0) {
+        pthread_mutex_lock(&(fpd->lock));
+        pthread_cond_broadcast(&(fpd->wakeup));
+        pthread_mutex_unlock(&(fpd->lock));
+    }
+    fpd->broadcasts += 1;
+    fpd->chunks += queued;
+    return success;
+}
+
+const FanoutPool *FanoutPool_create(const IOBackend **backends, int backendCount, int threads) {
+    /*
+     * Starts threads workers sending through the given backends, which
+     * must be safe to send on from several threads (can_split).
+     */
+    if ((backendCount < 1) || (backendCount > FANOUT_MAX_BACKENDS)) return NULL;
+    if ((threads < 1) || (threads > FANOUT_MAX_THREADS)) return NULL;
+
+    FanoutPool *fp = (FanoutPool *)malloc(sizeof(FanoutPool));
+    memset(fp, 0, sizeof(FanoutPool));
+
+    FanoutData *fpd = (FanoutData *)malloc(sizeof(FanoutData));
+    memset(fpd, 0, sizeof(FanoutData));
+    for (int i = 0; i < backendCount; i++) fpd->backends[i] = backends[i];
+    fpd->backendCount = backendCount;
+    fpd->workerCount = threads;
+    pthread_mutex_init(&(fpd->lock), NULL);
+    pthread_cond_init(&(fpd->wakeup), NULL);
+
+    *fp = {NULL, fanout_cleanup, fanout_submit};
+    fp->self = (void *)fpd;
+
+    // Keep our alarms on the main thread.
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    for (int i = 0; i < threads; i++) {
+        struct fanout_worker *worker = &(fpd->workers[i]);
+        pthread_mutex_init(&(worker->deque.lock), NULL);
+        worker->index = i;
+        worker->fpd = fpd;
+        pthread_create(&(worker->thread), NULL, fanout_worker_main, worker);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return fp;
+}
+
+#endif /* _FANOUT_H_ */
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "utils.h"
+#include "reactor.h"
+#include "shmring.h"
+
+/*
+ * Gateway
+ *
+ * A front end for a server on the same host. Clients talk UDP to the
+ * gateway exactly as they would to a server; the gateway moves their
+ * requests into the server's shared-memory ring and sends whatever the
+ * server puts in the other ring back out to them.
+ */
+
+#define GATEWAY_MAX_CLIENTS 65536
+
+struct gateway_state {
+    int socketFd;
+    int connection;
+    int toServerBell, toGatewayBell;
+    struct shm_region *shm;
+
+    // ring positions
+    uint32_t tail;    // toServer
+    uint32_t head;    // toGateway
+
+    // clients, by the number the server knows them as
+    struct sockaddr_in *clients;
+    int clientCount;
+
+    // counters
+    long long forwarded, delivered, batches, doorbells, dropped;
+};
+
+static struct gateway_state gateway;
+
+int find_client(struct sockaddr_in *address) {
+    /* Looks up a client's number, handing out a new one if needed. */
+    for (int i = 0; i < gateway.clientCount; i++) {
+        if ((gateway.clients[i].sin_port == address->sin_port) &&
+            (gateway.clients[i].sin_addr.s_addr == address->sin_addr.s_addr)) return i;
+    }
+    if (gateway.clientCount >= GATEWAY_MAX_CLIENTS) return -1;
+    memcpy(&(gateway.clients[gateway.clientCount]), address, sizeof(struct sockaddr_in));
+    gateway.clientCount += 1;
+    return gateway.clientCount - 1;
+}
+
+void publish_requests() {
+    /* Hands every request we've queued to the server. */
+    if (shm_ring_publish(&(gateway.shm->toServer), gateway.tail)) {
+        gateway.doorbells += 1;
+        shm_doorbell_ring(gateway.toServerBell);
+    }
+    gateway.batches += 1;
+}
+
+void on_clients_ready(const Reactor *, int, unsigned, void *) {
+    /* Moves every waiting client datagram into the server's ring. */
+    char buffer[BUFFER_SIZE];
+    bool queued = false;
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+        int result = recvfrom(
+            gateway.socketFd, buffer, BUFFER_SIZE, MSG_DONTWAIT,
+            (struct sockaddr *)&address, &addressLength
+        );
+        if (result < 0) {
+            // Only an empty socket ends the drain; errors (a client that
+            // went away, say) are consumed and we keep going.
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+            continue;
+        }
+
+        int client = find_client(&address);
+        struct shm_slot *slot = shm_ring_reserve(&(gateway.shm->toServer), gateway.tail);
+        if ((slot == NULL) && queued) {
+            // Full; let the server at what we have and try once more.
+            publish_requests();
+            queued = false;
+            slot = shm_ring_reserve(&(gateway.shm->toServer), gateway.tail);
+        }
+        if ((client < 0) || (slot == NULL)) {
+            gateway.dropped += 1;
+            continue;
+        }
+
+        memcpy(slot->data, buffer, result);
+        slot->length = result;
+        slot->count = 1;
+        slot->clients[0] = client;
+        gateway.tail += 1;
+        gateway.forwarded += 1;
+        queued = true;
+    }
+    if (queued) publish_requests();
+}
+
+void drain_server() {
+    /* Sends out everything the server has published, then goes to sleep. */
+    do {
+        struct shm_slot *slot;
+        while ((slot = shm_ring_peek(&(gateway.shm->toGateway), gateway.head)) != NULL) {
+            for (int i = 0; i < slot->count; i++) {
+                int client = slot->clients[i];
+                if (client >= gateway.clientCount) continue;
+                sendto(
+                    gateway.socketFd, slot->data, slot->length, MSG_DONTWAIT,
+                    (struct sockaddr *)&(gateway.clients[client]), sizeof(struct sockaddr_in)
+                );
+                gateway.delivered += 1;
+            }
+            gateway.head += 1;
+            shm_ring_release(&(gateway.shm->toGateway), gateway.head);
+        }
+    } while (!shm_ring_sleep(&(gateway.shm->toGateway), gateway.head));
+}
+
+void on_server_ready(const Reactor *, int, unsigned, void *) {
+    shm_doorbell_clear(gateway.toGatewayBell);
+    drain_server();
+}
+
+void on_connection_ready(const Reactor *rc, int, unsigned, void *) {
+    /* The server only ever closes the bell connection. */
+    char byte;
+    if (recv(gateway.connection, &byte, 1, MSG_DONTWAIT) == 0) {
+        printf("Server went away.\n");
+        rc->stop(rc);
+    }
+}
+
+void on_stdin_ready(const Reactor *rc, int, unsigned, void *) {
+    /* Any input terminates the gateway. */
+    rc->stop(rc);
+}
+
+bool attach(const char *path) {
+    /* Maps the server's rings and picks up its doorbells. */
+    gateway.shm = shm_region_map(path, false);
+    if (gateway.shm == NULL) {
+        fprintf(stderr, "Could not map %s\n", path);
+        return false;
+    }
+
+    char bellPath[UNIX_PATH_MAX];
+    shm_bell_path(bellPath, path);
+    struct sockaddr_un bellAddr;
+    memset(&bellAddr, 0, sizeof(bellAddr));
+    bellAddr.sun_family = AF_UNIX;
+    strncpy(bellAddr.sun_path, bellPath, UNIX_PATH_MAX - 1);
+
+    gateway.connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((gateway.connection < 0) || (connect(gateway.connection, (struct sockaddr *)&bellAddr, sizeof(bellAddr)) < 0)) {
+        fprintf(stderr, "Could not reach the server at %s\n", bellPath);
+        return false;
+    }
+    if (!shm_recv_bells(gateway.connection, &(gateway.toServerBell), &(gateway.toGatewayBell))) {
+        fprintf(stderr, "Server turned us away\n");
+        return false;
+    }
+    return true;
+}
+
+bool bind_clients(char *hostname, char *port) {
+    /* Opens the UDP socket clients talk to. */
+    struct hostent *he;
+    struct sockaddr_in gatewayAddr;
+    memset(&gatewayAddr, 0, sizeof(gatewayAddr));
+    gatewayAddr.sin_family = AF_INET;
+    gatewayAddr.sin_port = htons(atoi(port));
+    if ((he = gethostbyname(hostname)) == NULL) {
+        fprintf(stderr, "Error resolving hostname\n");
+        return false;
+    }
+    memcpy(&gatewayAddr.sin_addr, he->h_addr_list[0], he->h_length);
+
+    gateway.socketFd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (gateway.socketFd < 0) {
+        fprintf(stderr, "Could not open socket\n");
+        return false;
+    }
+
+    // We sit between many clients and one server; give bursts room.
+    int bufferSize = 4 * 1024 * 1024;
+    setsockopt(gateway.socketFd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(gateway.socketFd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    if ((bind(gateway.socketFd, (struct sockaddr *)&gatewayAddr, sizeof(gatewayAddr)) < 0)) {
+        fprintf(stderr, "Socket bind failed.\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    // Validate arguments.
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <server ring path> <hostname> <port>\n", argv[0]);
+        exit(1);
+    }
+    memset(&gateway, 0, sizeof(gateway));
+    gateway.clients = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in) * GATEWAY_MAX_CLIENTS);
+    if (gateway.clients == NULL) {fprintf(stderr, "Out of memory"); exit(1);}
+    if (!attach(argv[1])) exit(1);
+    if (!bind_clients(argv[2], argv[3])) exit(1);
+    printf("Gateway attached to %s, serving %s:%s.\n", argv[1], argv[2], argv[3]);
+    printf("Press enter to terminate process.\n");
+    fflush(stdout);
+
+    // Register our event sources.
+    const Reactor *reactor = Reactor_create();
+    if (reactor == NULL) exit(1);
+    reactor->add(reactor, gateway.socketFd, REACTOR_READ | REACTOR_EDGE, on_clients_ready, NULL);
+    reactor->add(reactor, gateway.toGatewayBell, REACTOR_READ, on_server_ready, NULL);
+    reactor->add(reactor, gateway.connection, REACTOR_READ, on_connection_ready, NULL);
+    reactor->add(reactor, STDIN_FILENO, REACTOR_READ, on_stdin_ready, NULL);
+
+    // Arm the doorbell before we wait on it.
+    drain_server();
+    reactor->run(reactor, -1);
+
+    // Report and cleanup.
+    printf("forwarded %lld requests in %lld batches (%lld doorbells, %lld dropped)\n",
+           gateway.forwarded, gateway.batches, gateway.doorbells, gateway.dropped);
+    printf("delivered %lld datagrams to %d clients\n", gateway.delivered, gateway.clientCount);
+    reactor->cleanup(reactor);
+    close(gateway.connection);
+    close(gateway.socketFd);
+    shm_region_unmap(gateway.shm);
+    free(gateway.clients);
+    return 0;
+}
@@ -0,0 +1,236 @@
+#ifndef _IOBACKEND_H_
+#define _IOBACKEND_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "server.h"
+#include "udpoffload.h"
+
+/*
+ * I/O backend ADT
+ *
+ * Owns the server's client-facing socket. The event loop waits for
+ * get_fd() to become readable, drains every waiting datagram with recv(),
+ * queues responses with send() and pushes them out with flush().
+ *
+ * A server can run more than one backend (UDP plus unix, say). send() is
+ * handed every address list and skips addresses that aren't its own.
+ */
+
+typedef struct iobackend IOBackend;
+
+struct iobackend {
+    void *self;
+    void (*cleanup)(const IOBackend *io);
+    const char *(*get_name)(const IOBackend *io);
+    int  (*get_fd)(const IOBackend *io);
+
+    // Returns the datagram length, 0 if nothing is waiting, -1 on error.
+    int  (*recv)(const IOBackend *io, char *buffer, int size, struct sockaddr_in *address);
+
+    // Queues one datagram for every address in the list.
+    bool (*send)(const IOBackend *io, const void *datagram, int size, struct AddressRef *addressList);
+    void (*flush)(const IOBackend *io);
+
+    // Turns on UDP_GRO; recv then splits coalesced bursts back up.
+    bool (*enable_gro)(const IOBackend *io);
+
+    // Lets go of anything kept for an address whose user has gone.
+    void (*forget)(const IOBackend *io, struct sockaddr_in *address);
+
+    // Whether recv and send may run on different threads at once.
+    bool (*can_split)(const IOBackend *io);
+};
+
+/*
+ * Poll backend -- plain recvfrom/sendmmsg, always available.
+ */
+
+#define POLL_BACKEND_BATCH 64
+
+typedef struct pollbackenddata {
+    int socket;
+
+    // coalesced burst we are still handing out
+    bool gro;
+    char *groBuffer;
+    int groLength, groOffset, groSegment;
+    struct sockaddr_in groAddress;
+} PollBackendData;
+
+static void poll_backend_cleanup(const IOBackend *io) {
+    PollBackendData *pbd = (PollBackendData *)(io->self);
+    if (pbd->groBuffer != NULL) free(pbd->groBuffer);
+    free(io->self);
+    free((void *)io);
+}
+
+static const char *poll_backend_get_name(const IOBackend *) {
+    return "poll";
+}
+
+static int poll_backend_get_fd(const IOBackend *io) {
+    PollBackendData *pbd = (PollBackendData *)(io->self);
+    return pbd->socket;
+}
+
+static int poll_backend_next_segment(PollBackendData *pbd, char *buffer, int size, struct sockaddr_in *address) {
+    /* Hands out the next datagram of a coalesced burst, truncated to size like recvfrom does. */
+    int length = pbd->groLength - pbd->groOffset;
+    if (length > pbd->groSegment) length = pbd->groSegment;
+    memcpy(address, &(pbd->groAddress), sizeof(struct sockaddr_in));
+    int copied = (length < size) ? length : size;
+    memcpy(buffer, pbd->groBuffer + pbd->groOffset, copied);
+    pbd->groOffset += length;
+    return copied;
+}
+
+static int poll_backend_recv_gro(PollBackendData *pbd, char *buffer, int size, struct sockaddr_in *address) {
+    /* Receives a datagram that may be a coalesced burst. */
+    if (pbd->groOffset < pbd->groLength)
+        return poll_backend_next_segment(pbd, buffer, size, address);
+
+    struct iovec iov;
+    iov.iov_base = pbd->groBuffer;
+    iov.iov_len = UDP_OFFLOAD_MAX_DATAGRAM;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &(pbd->groAddress);
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int result = recvmsg(pbd->socket, &msg, MSG_DONTWAIT);
+    if (result < 0) {
+        // Nothing left to read is not an error.
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+
+    // A plain datagram is just one segment the size of itself.
+    int segment = udp_gro_segment_size(&msg);
+    pbd->groLength = result;
+    pbd->groOffset = 0;
+    pbd->groSegment = ((segment > 0) && (segment < result)) ? segment : result;
+    if (result == 0) return 0;
+    return poll_backend_next_segment(pbd, buffer, size, address);
+}
+
+static int poll_backend_recv(const IOBackend *io, char *buffer, int size, struct sockaddr_in *address) {
+    /* Receives one waiting datagram without blocking. */
+    PollBackendData *pbd = (PollBackendData *)(io->self);
+    if (pbd->gro) return poll_backend_recv_gro(pbd, buffer, size, address);
+
+    socklen_t addressLength = sizeof(struct sockaddr_in);
+    int result = recvfrom(
+        pbd->socket, buffer, size, MSG_DONTWAIT,
+        (struct sockaddr *)address, &addressLength
+    );
+    if (result < 0) {
+        // Nothing left to read is not an error.
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+    return result;
+}
+
+static bool poll_backend_send_batch(PollBackendData *pbd, struct mmsghdr *messages, int count) {
+    /* Hands a batch to the kernel, skipping over any message that fails. */
+    bool success = true;
+    int offset = 0;
+    while (offset < count) {
+        int result = sendmmsg(pbd->socket, messages + offset, count - offset, MSG_DONTWAIT);
+        if (result <= 0) {
+            // Something went wrong with sending this one.
+            fprintf(stderr, "Response to client failed to send. (%d)\n", result);
+            success = false;
+            result = 1;
+        }
+        offset += result;
+    }
+    return success;
+}
+
+static bool poll_backend_send(const IOBackend *io, const void *datagram, int size, struct AddressRef *addressList) {
+    /* Sends the datagram to every address right away, a batch per syscall. */
+    PollBackendData *pbd = (PollBackendData *)(io->self);
+    struct mmsghdr messages[POLL_BACKEND_BATCH];
+    struct iovec iov = {(void *)datagram, (size_t)size};
+    int count = 0;
+    bool success = true;
+    while ((addressList != NULL) && (addressList->_this != NULL)) {
+        // Local users belong to another backend.
+        if (!is_local_address(addressList->_this)) {
+            memset(&(messages[count]), 0, sizeof(struct mmsghdr));
+            messages[count].msg_hdr.msg_name = addressList->_this;
+            messages[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            messages[count].msg_hdr.msg_iov = &iov;
+            messages[count].msg_hdr.msg_iovlen = 1;
+            count += 1;
+        }
+        if (count == POLL_BACKEND_BATCH) {
+            if (!poll_backend_send_batch(pbd, messages, count)) success = false;
+            count = 0;
+        }
+        addressList = addressList->_next;
+    }
+    if ((count > 0) && !poll_backend_send_batch(pbd, messages, count)) success = false;
+    return success;
+}
+
+static void poll_backend_flush(const IOBackend *) {
+    // Every send already went out.
+    return;
+}
+
+static bool poll_backend_enable_gro(const IOBackend *io) {
+    PollBackendData *pbd = (PollBackendData *)(io->self);
+    if (pbd->gro) return true;
+    if (!udp_enable_gro(pbd->socket)) return false;
+
+    pbd->groBuffer = (char *)malloc(UDP_OFFLOAD_MAX_DATAGRAM);
+    if (pbd->groBuffer == NULL) {fprintf(stderr, "Out of memory"); return false;}
+    pbd->gro = true;
+    return true;
+}
+
+static void poll_backend_forget(const IOBackend *, struct sockaddr_in *) {
+    // Network addresses cost us nothing to remember.
+    return;
+}
+
+static bool poll_backend_can_split(const IOBackend *) {
+    // send keeps no state; recv's GRO leftovers are its own.
+    return true;
+}
+
+const IOBackend *IOBackend_create_poll(int socket) {
+    IOBackend *io = (IOBackend *)malloc(sizeof(IOBackend));
+    memset(io, 0, sizeof(IOBackend));
+
+    PollBackendData *pbd = (PollBackendData *)malloc(sizeof(PollBackendData));
+    memset(pbd, 0, sizeof(PollBackendData));
+    pbd->socket = socket;
+
+    *io = {NULL, poll_backend_cleanup, poll_backend_get_name, poll_backend_get_fd,
+           poll_backend_recv, poll_backend_send, poll_backend_flush, poll_backend_enable_gro,
+           poll_backend_forget, poll_backend_can_split};
+    io->self = (void *)pbd;
+    return io;
+}
+
+#endif /* _IOBACKEND_H_ */
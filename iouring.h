@@ -0,0 +1,518 @@
+#ifndef _IOURING_H_
+#define _IOURING_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// duckchat.h's "packed" macro would mangle the kernel header's attributes.
+#pragma push_macro("packed")
+#undef packed
+#include <linux/io_uring.h>
+#pragma pop_macro("packed")
+
+#include "duckchat.h"
+#include "iobackend.h"
+
+/*
+ * io_uring backend
+ *
+ * Receives with a single multishot RECVMSG that picks buffers out of a
+ * provided-buffer ring, so an idle socket costs no syscalls at all.
+ * Fan-out queues one SENDMSG SQE per recipient and submits the whole
+ * batch with one io_uring_enter in flush().
+ */
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFERS 1024
+#define URING_BUFFER_SIZE (BUFFER_SIZE + 64)
+#define URING_BUFFER_GROUP 0
+#define URING_MAX_SENDS 1024
+#define URING_MAX_PENDING (URING_BUFFERS + 64)
+
+// user_data tags -- a send carries its slot index in the low bits.
+#define URING_TAG_RECV 0xFFFFFFFFULL
+#define URING_TAG_SEND 0x100000000ULL
+
+struct uring_payload {
+    char *data;
+    int size;
+    int refs;
+};
+
+struct uring_send {
+    bool used;
+    struct sockaddr_in address;
+    struct iovec iov;
+    struct msghdr msg;
+    struct uring_payload *payload;
+};
+
+struct uring_completion {
+    long long userData;
+    int res;
+    unsigned int flags;
+};
+
+typedef struct uringbackenddata {
+    int socket;
+    int ringFd;
+
+    // submission ring
+    void *sqRing;
+    size_t sqRingSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, *sqFlags;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned sqLocalTail;
+    int unsubmitted;
+
+    // completion ring
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // provided buffers for the multishot receive
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    char *buffers;
+    struct msghdr recvMsg;
+    bool recvArmed;
+
+    // send slots, live until their completion arrives
+    struct uring_send sends[URING_MAX_SENDS];
+    int freeSends[URING_MAX_SENDS];
+    int freeSendCount;
+    int sendsInFlight;
+
+    // receive completions reaped while waiting on send slots
+    struct uring_completion pending[URING_MAX_PENDING];
+    int pendingHead, pendingCount;
+} UringBackendData;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uring_register(int ringFd, unsigned opcode, void *arg, unsigned args) {
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, args);
+}
+
+static struct io_uring_sqe *uring_get_sqe(UringBackendData *ubd) {
+    /* Grabs the next free SQE, or NULL if the submission ring is full. */
+    unsigned head = __atomic_load_n(ubd->sqHead, __ATOMIC_ACQUIRE);
+    if ((ubd->sqLocalTail - head) >= URING_ENTRIES) return NULL;
+
+    unsigned index = ubd->sqLocalTail & *(ubd->sqMask);
+    struct io_uring_sqe *sqe = &(ubd->sqes[index]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ubd->sqArray[index] = index;
+    ubd->sqLocalTail += 1;
+    ubd->unsubmitted += 1;
+    return sqe;
+}
+
+static bool uring_submit(UringBackendData *ubd, unsigned minComplete) {
+    /* Publishes queued SQEs and optionally waits for completions. */
+    __atomic_store_n(ubd->sqTail, ubd->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned flags = (minComplete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    if ((ubd->unsubmitted == 0) && (minComplete == 0)) return true;
+    int result;
+    do {
+        result = uring_enter(ubd->ringFd, ubd->unsubmitted, minComplete, flags);
+    } while ((result < 0) && (errno == EINTR));
+    if (result < 0) {
+        fprintf(stderr, "io_uring submit failure. (%d)\n", errno);
+        return false;
+    }
+    ubd->unsubmitted = 0;
+    return true;
+}
+
+static void uring_recycle_buffer(UringBackendData *ubd, unsigned short bid) {
+    /* Hands a receive buffer back to the kernel. */
+    // Index the ring directly; C++ shifts the header's flexible bufs[] array.
+    unsigned short tail = ubd->bufRing->tail;
+    struct io_uring_buf *buf = ((struct io_uring_buf *)(ubd->bufRing)) + (tail & (URING_BUFFERS - 1));
+    buf->addr = (unsigned long long)(ubd->buffers + ((size_t)bid * URING_BUFFER_SIZE));
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&(ubd->bufRing->tail), (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static bool uring_arm_recv(UringBackendData *ubd) {
+    /* (Re)arms the multishot receive. */
+    struct io_uring_sqe *sqe = uring_get_sqe(ubd);
+    if (sqe == NULL) {
+        // Make room by pushing out the queued sends.
+        uring_submit(ubd, 0);
+        sqe = uring_get_sqe(ubd);
+        if (sqe == NULL) return false;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ubd->socket;
+    sqe->addr = (unsigned long long)&(ubd->recvMsg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_TAG_RECV;
+    ubd->recvArmed = true;
+    uring_submit(ubd, 0);
+    return true;
+}
+
+static bool uring_pop_cqe(UringBackendData *ubd, struct uring_completion *completion) {
+    /* Pops one completion off the CQ ring. */
+    unsigned head = *(ubd->cqHead);
+    unsigned tail = __atomic_load_n(ubd->cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        // Completions that overflowed the ring only come back on enter.
+        unsigned flags = __atomic_load_n(ubd->sqFlags, __ATOMIC_ACQUIRE);
+        if (!(flags & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN))) return false;
+        uring_enter(ubd->ringFd, 0, 0, IORING_ENTER_GETEVENTS);
+        tail = __atomic_load_n(ubd->cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail) return false;
+    }
+
+    struct io_uring_cqe *cqe = &(ubd->cqes[head & *(ubd->cqMask)]);
+    completion->userData = (long long)cqe->user_data;
+    completion->res = cqe->res;
+    completion->flags = cqe->flags;
+    __atomic_store_n(ubd->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void uring_release_send(UringBackendData *ubd, int slot) {
+    /* Frees a send slot and its payload once nobody else needs it. */
+    struct uring_send *send = &(ubd->sends[slot]);
+    if (!send->used) return;
+    send->used = false;
+    ubd->sendsInFlight -= 1;
+    ubd->freeSends[ubd->freeSendCount] = slot;
+    ubd->freeSendCount += 1;
+
+    struct uring_payload *payload = send->payload;
+    send->payload = NULL;
+    payload->refs -= 1;
+    if (payload->refs <= 0) {
+        free(payload->data);
+        free(payload);
+    }
+}
+
+static bool uring_handle_send_cqe(UringBackendData *ubd, struct uring_completion *completion) {
+    /* Consumes the completion if it belongs to a send. */
+    if (completion->userData == (long long)URING_TAG_RECV) return false;
+    if (completion->res < 0)
+        fprintf(stderr, "Response to client failed to send. (%d)\n", completion->res);
+    uring_release_send(ubd, (int)(completion->userData - URING_TAG_SEND));
+    return true;
+}
+
+static void uring_reap_sends(UringBackendData *ubd) {
+    /* Drains the CQ ring, setting receive completions aside for later. */
+    struct uring_completion completion;
+    while (uring_pop_cqe(ubd, &completion)) {
+        if (uring_handle_send_cqe(ubd, &completion)) continue;
+        if (ubd->pendingCount >= URING_MAX_PENDING) {
+            // No room to hold it -- drop the datagram, but keep the buffer.
+            if (completion.flags & IORING_CQE_F_BUFFER)
+                uring_recycle_buffer(ubd, completion.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (!(completion.flags & IORING_CQE_F_MORE)) ubd->recvArmed = false;
+            continue;
+        }
+        int index = (ubd->pendingHead + ubd->pendingCount) % URING_MAX_PENDING;
+        ubd->pending[index] = completion;
+        ubd->pendingCount += 1;
+    }
+}
+
+static int uring_find_send_slot(UringBackendData *ubd) {
+    /* Finds a free send slot, waiting on completions if all are busy. */
+    while (ubd->freeSendCount == 0) {
+        uring_submit(ubd, 1);
+        uring_reap_sends(ubd);
+    }
+    ubd->freeSendCount -= 1;
+    return ubd->freeSends[ubd->freeSendCount];
+}
+
+static void uring_backend_cleanup(const IOBackend *io) {
+    UringBackendData *ubd = (UringBackendData *)(io->self);
+
+    // In-flight sends still point at our payloads; wait them out first.
+    while (ubd->sendsInFlight > 0) {
+        if (!uring_submit(ubd, 1)) break;
+        uring_reap_sends(ubd);
+    }
+
+    // Closing the ring cancels the receive.
+    close(ubd->ringFd);
+    for (int i = 0; i < URING_MAX_SENDS; i++)
+        uring_release_send(ubd, i);
+
+    munmap(ubd->sqRing, ubd->sqRingSize);
+    if (ubd->cqRing != ubd->sqRing) munmap(ubd->cqRing, ubd->cqRingSize);
+    munmap(ubd->sqes, ubd->sqesSize);
+    munmap(ubd->bufRing, ubd->bufRingSize);
+    free(ubd->buffers);
+    free(ubd);
+    free((void *)io);
+}
+
+static const char *uring_backend_get_name(const IOBackend *) {
+    return "uring";
+}
+
+static int uring_backend_get_fd(const IOBackend *io) {
+    // The ring fd polls readable whenever completions are waiting.
+    UringBackendData *ubd = (UringBackendData *)(io->self);
+    return ubd->ringFd;
+}
+
+static int uring_backend_recv(const IOBackend *io, char *buffer, int size, struct sockaddr_in *address) {
+    /* Hands back the next received datagram, if any. */
+    UringBackendData *ubd = (UringBackendData *)(io->self);
+    struct uring_completion completion;
+
+    while (1) {
+        // Serve completions we set aside first.
+        if (ubd->pendingCount > 0) {
+            completion = ubd->pending[ubd->pendingHead];
+            ubd->pendingHead = (ubd->pendingHead + 1) % URING_MAX_PENDING;
+            ubd->pendingCount -= 1;
+        } else if (!uring_pop_cqe(ubd, &completion)) {
+            // Nothing waiting -- make sure the receive is still armed.
+            if (!(ubd->recvArmed)) uring_arm_recv(ubd);
+            return 0;
+        } else if (uring_handle_send_cqe(ubd, &completion)) {
+            continue;
+        }
+
+        // A multishot receive stops on errors or when the buffers run out.
+        if (!(completion.flags & IORING_CQE_F_MORE)) ubd->recvArmed = false;
+        if (!(completion.flags & IORING_CQE_F_BUFFER)) {
+            if (completion.res == -ENOBUFS) continue;
+            if (completion.res < 0) return -1;
+            continue;
+        }
+
+        // Pull the datagram out of its provided buffer.
+        unsigned short bid = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+        char *raw = ubd->buffers + ((size_t)bid * URING_BUFFER_SIZE);
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)raw;
+        char *name = raw + sizeof(struct io_uring_recvmsg_out);
+        char *payload = name + ubd->recvMsg.msg_namelen + ubd->recvMsg.msg_controllen;
+
+        int length = (int)(out->payloadlen);
+        if (length > size) length = size;
+        memset(address, 0, sizeof(struct sockaddr_in));
+        memcpy(address, name, (out->namelen < sizeof(struct sockaddr_in)) ? out->namelen : sizeof(struct sockaddr_in));
+        memcpy(buffer, payload, length);
+
+        uring_recycle_buffer(ubd, bid);
+        return length;
+    }
+}
+
+static bool uring_backend_send(const IOBackend *io, const void *datagram, int size, struct AddressRef *addressList) {
+    /* Queues a SENDMSG per recipient, all sharing one copy of the payload. */
+    UringBackendData *ubd = (UringBackendData *)(io->self);
+    if ((addressList == NULL) || (addressList->_this == NULL)) return true;
+
+    struct uring_payload *payload = (struct uring_payload *)malloc(sizeof(struct uring_payload));
+    if (payload == NULL) {fprintf(stderr, "Out of memory"); return false;}
+    payload->data = (char *)malloc(size);
+    if (payload->data == NULL) {fprintf(stderr, "Out of memory"); free(payload); return false;}
+    memcpy(payload->data, datagram, size);
+    payload->size = size;
+    payload->refs = 1;  // held until every SQE is queued
+
+    while ((addressList != NULL) && (addressList->_this != NULL)) {
+        // Local users belong to another backend.
+        if (is_local_address(addressList->_this)) {
+            addressList = addressList->_next;
+            continue;
+        }
+
+        // Find room for this send.
+        int slot = uring_find_send_slot(ubd);
+        struct io_uring_sqe *sqe = uring_get_sqe(ubd);
+        if (sqe == NULL) {
+            uring_submit(ubd, 0);
+            sqe = uring_get_sqe(ubd);
+        }
+        if (sqe == NULL) {
+            fprintf(stderr, "io_uring submission ring stuck.\n");
+            ubd->freeSends[ubd->freeSendCount] = slot;
+            ubd->freeSendCount += 1;
+            break;
+        }
+
+        // Fill out the slot; it must outlive the SQE.
+        struct uring_send *send = &(ubd->sends[slot]);
+        send->used = true;
+        memcpy(&(send->address), addressList->_this, sizeof(struct sockaddr_in));
+        send->iov.iov_base = payload->data;
+        send->iov.iov_len = payload->size;
+        memset(&(send->msg), 0, sizeof(struct msghdr));
+        send->msg.msg_name = &(send->address);
+        send->msg.msg_namelen = sizeof(struct sockaddr_in);
+        send->msg.msg_iov = &(send->iov);
+        send->msg.msg_iovlen = 1;
+        send->payload = payload;
+        payload->refs += 1;
+        ubd->sendsInFlight += 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = ubd->socket;
+        sqe->addr = (unsigned long long)&(send->msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->user_data = URING_TAG_SEND + slot;
+
+        addressList = addressList->_next;
+    }
+
+    // Drop our own hold on the payload.
+    payload->refs -= 1;
+    if (payload->refs <= 0) {
+        free(payload->data);
+        free(payload);
+    }
+    return true;
+}
+
+static void uring_backend_flush(const IOBackend *io) {
+    /* Submits every queued send with a single syscall. */
+    UringBackendData *ubd = (UringBackendData *)(io->self);
+    uring_submit(ubd, 0);
+    uring_reap_sends(ubd);
+    if (!(ubd->recvArmed)) uring_arm_recv(ubd);
+}
+
+static bool uring_backend_enable_gro(const IOBackend *) {
+    // Provided buffers are sized for one datagram, not a coalesced burst.
+    return false;
+}
+
+static void uring_backend_forget(const IOBackend *, struct sockaddr_in *) {
+    // Network addresses cost us nothing to remember.
+    return;
+}
+
+static bool uring_backend_can_split(const IOBackend *) {
+    // One ring carries both directions.
+    return false;
+}
+
+const IOBackend *IOBackend_create_uring(int socket) {
+    /* Creates the io_uring backend, or returns NULL if the kernel can't. */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    int ringFd = uring_setup(URING_ENTRIES, &params);
+    if (ringFd < 0) {
+        fprintf(stderr, "io_uring unavailable. (%d)\n", errno);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring is too old for this backend.\n");
+        close(ringFd);
+        return NULL;
+    }
+
+    UringBackendData *ubd = (UringBackendData *)malloc(sizeof(UringBackendData));
+    memset(ubd, 0, sizeof(UringBackendData));
+    ubd->socket = socket;
+    ubd->ringFd = ringFd;
+
+    // Map the rings.
+    ubd->sqRingSize = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    ubd->cqRingSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    if (ubd->cqRingSize > ubd->sqRingSize) ubd->sqRingSize = ubd->cqRingSize;
+    ubd->cqRingSize = ubd->sqRingSize;
+    ubd->sqRing = mmap(NULL, ubd->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    ubd->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ubd->sqes = (struct io_uring_sqe *)mmap(NULL, ubd->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if ((ubd->sqRing == MAP_FAILED) || (ubd->sqes == MAP_FAILED)) {
+        fprintf(stderr, "io_uring ring mapping failed.\n");
+        close(ringFd);
+        free(ubd);
+        return NULL;
+    }
+    ubd->cqRing = ubd->sqRing;
+
+    char *sq = (char *)(ubd->sqRing);
+    ubd->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ubd->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ubd->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ubd->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ubd->sqFlags = (unsigned *)(sq + params.sq_off.flags);
+    ubd->sqLocalTail = *(ubd->sqTail);
+    ubd->cqHead = (unsigned *)(sq + params.cq_off.head);
+    ubd->cqTail = (unsigned *)(sq + params.cq_off.tail);
+    ubd->cqMask = (unsigned *)(sq + params.cq_off.ring_mask);
+    ubd->cqes = (struct io_uring_cqe *)(sq + params.cq_off.cqes);
+
+    // Register the provided-buffer ring and fill it.
+    ubd->bufRingSize = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ubd->bufRing = (struct io_uring_buf_ring *)mmap(NULL, ubd->bufRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    ubd->buffers = (char *)malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(ubd->bufRing);
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if ((ubd->bufRing == MAP_FAILED) || (ubd->buffers == NULL) ||
+        (uring_register(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)) {
+        fprintf(stderr, "io_uring buffer ring registration failed. (%d)\n", errno);
+        close(ringFd);
+        munmap(ubd->sqRing, ubd->sqRingSize);
+        munmap(ubd->sqes, ubd->sqesSize);
+        if (ubd->bufRing != MAP_FAILED) munmap(ubd->bufRing, ubd->bufRingSize);
+        free(ubd->buffers);
+        free(ubd);
+        return NULL;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++)
+        uring_recycle_buffer(ubd, (unsigned short)i);
+    for (int i = 0; i < URING_MAX_SENDS; i++)
+        ubd->freeSends[i] = (URING_MAX_SENDS - 1) - i;
+    ubd->freeSendCount = URING_MAX_SENDS;
+
+    // The receive template only needs room for the peer address.
+    ubd->recvMsg.msg_namelen = sizeof(struct sockaddr_in);
+
+    IOBackend *io = (IOBackend *)malloc(sizeof(IOBackend));
+    memset(io, 0, sizeof(IOBackend));
+    *io = {NULL, uring_backend_cleanup, uring_backend_get_name, uring_backend_get_fd,
+           uring_backend_recv, uring_backend_send, uring_backend_flush, uring_backend_enable_gro,
+           uring_backend_forget, uring_backend_can_split};
+    io->self = (void *)ubd;
+
+    // Start receiving.
+    if (!uring_arm_recv(ubd)) {
+        io->cleanup(io);
+        return NULL;
+    }
+    return io;
+}
+
+#endif /* _IOURING_H_ */
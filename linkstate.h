@@ -0,0 +1,367 @@
+#ifndef _LINKSTATE_H_
+#define _LINKSTATE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+
+/*
+ * Link-state ADT
+ *
+ * Every server floods the list of its neighbors (an advertisement) to the
+ * whole mesh, and each keeps the latest advertisement from everyone. A
+ * link counts once both ends list each other. From that, every server in
+ * a connected piece of the mesh computes the same shortest-path tree,
+ * rooted at its lowest address, with ties going to the lowest address.
+ * Each end advertises a cost for the link from its own measurements; paths
+ * use the higher of the two, so everyone agrees on it.
+ *
+ * Says travel only along that tree. Each one crosses each link at most
+ * once, whatever the mesh's cycles, and needs no origin in the datagram.
+ * A Say arriving over a link that isn't on our tree fails the reverse-path
+ * check and is dropped.
+ *
+ * The same advertisements give shortest paths from us to everyone, for
+ * routing toward a channel's home server (rendezvous hashing).
+ */
+
+#define LINKSTATE_MAX_NODES 256
+#define LINKSTATE_MAX_LINKS 100
+#define LINKSTATE_LIFETIME (3 * TOPOLOGY_RENEW)    // seconds an advertisement lasts unrefreshed
+
+typedef struct linkstate LinkState;
+
+struct linkstate {
+    void *self;
+    void (*cleanup)(const LinkState *ls);
+
+    // Stores an advertisement. Returns true if it was news, to be flooded on.
+    bool (*update)(const LinkState *ls, struct sockaddr_in *origin, unsigned int seq, struct server_link *links, int count);
+
+    // Forgets advertisements nobody has refreshed. Returns true if any were.
+    bool (*expire)(const LinkState *ls);
+
+    // Whether the link between us and a neighbor is on the distribution tree.
+    bool (*on_tree)(const LinkState *ls, struct sockaddr_in *self, struct sockaddr_in *neighbor);
+
+    // Whether the tree covers both ends of the link but not the link itself.
+    // Neither is true for a neighbor we know nothing about; it gets flooded.
+    bool (*off_tree)(const LinkState *ls, struct sockaddr_in *self, struct sockaddr_in *neighbor);
+
+    // Prints the last tree computed.
+    void (*report)(const LinkState *ls);
+
+    // The neighbor on our shortest path to a server; false for ourselves or the unreachable.
+    bool (*next_hop)(const LinkState *ls, struct sockaddr_in *self, struct sockaddr_in *destination, struct sockaddr_in *hop);
+
+    // The reachable server (maybe us) that key hashes highest with; false if we know nothing.
+    bool (*home)(const LinkState *ls, struct sockaddr_in *self, unsigned long long key, struct sockaddr_in *home);
+
+    // Whether anyone's links changed since we last asked.
+    bool (*changed)(const LinkState *ls);
+
+    // The index-th advertisement we hold, ours included; false past the last.
+    bool (*advertisement)(const LinkState *ls, int index, struct sockaddr_in *origin, unsigned int *seq, struct server_link *links, int *count);
+};
+
+struct linkstate_node {
+    struct sockaddr_in address;
+    unsigned int seq;
+    double expiresAt;
+    int linkCount;
+    struct server_link links[LINKSTATE_MAX_LINKS];
+
+    // from the last tree computation
+    int parent;    // -1 for the root, or if unreachable
+    int distance;    // summed link costs from the root
+
+    // from the last computation of paths from us
+    int hop;    // our neighbor on the way, -1 for us or the unreachable
+};
+
+typedef struct linkstatedata {
+    struct linkstate_node *nodes[LINKSTATE_MAX_NODES];
+    int nodeCount;
+
+    // the tree is recomputed when anything changed, or for someone else
+    bool dirty;
+    struct sockaddr_in treeFor;
+
+    // links changed since changed() was last called
+    bool changed;
+} LinkStateData;
+
+static double linkstate_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int linkstate_compare(struct sockaddr_in *a, struct sockaddr_in *b) {
+    /* Orders addresses, so every server breaks ties the same way. */
+    unsigned int x = ntohl(a->sin_addr.s_addr), y = ntohl(b->sin_addr.s_addr);
+    if (x != y) return (x < y) ? -1 : 1;
+    unsigned short p = ntohs(a->sin_port), q = ntohs(b->sin_port);
+    if (p != q) return (p < q) ? -1 : 1;
+    return 0;
+}
+
+static int linkstate_find(LinkStateData *lsd, struct sockaddr_in *address) {
+    for (int i = 0; i < lsd->nodeCount; i++)
+        if (linkstate_compare(&(lsd->nodes[i]->address), address) == 0) return i;
+    return -1;
+}
+
+static int linkstate_lists(struct linkstate_node *node, struct sockaddr_in *address) {
+    /* The cost node advertises for its link to address, or -1 if it lists none. */
+    for (int i = 0; i < node->linkCount; i++)
+        if (linkstate_compare(&(node->links[i].address), address) == 0)
+            return (node->links[i].cost > 0) ? (int)(node->links[i].cost) : 1;
+    return -1;
+}
+
+static int linkstate_cost(LinkStateData *lsd, int a, int b) {
+    /* A link counts once both ends advertise it, at the higher of their costs; -1 if it doesn't. */
+    int there = linkstate_lists(lsd->nodes[a], &(lsd->nodes[b]->address));
+    int back = linkstate_lists(lsd->nodes[b], &(lsd->nodes[a]->address));
+    if ((there < 0) || (back < 0)) return -1;
+    return (there > back) ? there : back;
+}
+
+static void linkstate_paths(LinkStateData *lsd, int root, int *parent, int *distance) {
+    /*
+     * Cheapest paths from root (Dijkstra). Among equally cheap paths, a
+     * node's parent is the lowest address.
+     */
+    int count = lsd->nodeCount;
+    bool done[LINKSTATE_MAX_NODES];
+    for (int i = 0; i < count; i++) {
+        parent[i] = distance[i] = -1;
+        done[i] = false;
+    }
+    distance[root] = 0;
+    while (1) {
+        int u = -1;
+        for (int i = 0; i < count; i++) {
+            if (done[i] || (distance[i] < 0)) continue;
+            if ((u < 0) || (distance[i] < distance[u])) u = i;
+        }
+        if (u < 0) break;
+        done[u] = true;
+
+        for (int v = 0; v < count; v++) {
+            if (done[v]) continue;
+            int cost = linkstate_cost(lsd, u, v);
+            if (cost < 0) continue;
+            int through = distance[u] + cost;
+            bool shorter = (distance[v] < 0) || (through < distance[v]);
+            bool tie = (through == distance[v]) &&
+                       (linkstate_compare(&(lsd->nodes[u]->address), &(lsd->nodes[parent[v]]->address)) < 0);
+            if (shorter || tie) {
+                distance[v] = through;
+                parent[v] = u;
+            }
+        }
+    }
+}
+
+static void linkstate_compute(LinkStateData *lsd, struct sockaddr_in *self) {
+    /*
+     * Finds our paths to everyone, then the tree from the lowest address
+     * among those we can reach.
+     */
+    int count = lsd->nodeCount;
+    int me = linkstate_find(lsd, self);
+    int parent[LINKSTATE_MAX_NODES], distance[LINKSTATE_MAX_NODES];
+    for (int i = 0; i < count; i++) {
+        lsd->nodes[i]->parent = lsd->nodes[i]->distance = -1;
+        lsd->nodes[i]->hop = -1;
+    }
+    lsd->dirty = false;
+    memcpy(&(lsd->treeFor), self, sizeof(struct sockaddr_in));
+    if (me < 0) return;
+
+    // Our paths, and the lowest address they reach.
+    linkstate_paths(lsd, me, parent, distance);
+    int root = me;
+    for (int i = 0; i < count; i++) {
+        if (distance[i] < 0) continue;
+        if (linkstate_compare(&(lsd->nodes[i]->address), &(lsd->nodes[root]->address)) < 0) root = i;
+        int hop = i;
+        while ((parent[hop] >= 0) && (parent[hop] != me)) hop = parent[hop];
+        if (hop != me) lsd->nodes[i]->hop = hop;
+    }
+
+    // The tree everyone in our piece of the mesh agrees on.
+    linkstate_paths(lsd, root, parent, distance);
+    for (int i = 0; i < count; i++) {
+        lsd->nodes[i]->parent = parent[i];
+        lsd->nodes[i]->distance = distance[i];
+    }
+}
+
+static void linkstate_cleanup(const LinkState *ls) {
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    for (int i = 0; i < lsd->nodeCount; i++) free(lsd->nodes[i]);
+    free(ls->self);
+    free((void *)ls);
+}
+
+static bool linkstate_update(const LinkState *ls, struct sockaddr_in *origin, unsigned int seq, struct server_link *links, int count) {
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    if ((count < 0) || (count > LINKSTATE_MAX_LINKS)) return false;
+
+    int index = linkstate_find(lsd, origin);
+    if (index < 0) {
+        if (lsd->nodeCount >= LINKSTATE_MAX_NODES) return false;
+        struct linkstate_node *node = (struct linkstate_node *)malloc(sizeof(struct linkstate_node));
+        if (node == NULL) {fprintf(stderr, "Out of memory"); return false;}
+        memset(node, 0, sizeof(struct linkstate_node));
+        memcpy(&(node->address), origin, sizeof(struct sockaddr_in));
+        index = lsd->nodeCount;
+        lsd->nodes[index] = node;
+        lsd->nodeCount += 1;
+        lsd->dirty = lsd->changed = true;
+    } else if ((int)(seq - lsd->nodes[index]->seq) <= 0) {
+        // Old news (sequence numbers may wrap).
+        return false;
+    }
+
+    // A refresh with the same links is news to flood, but changes no paths.
+    struct linkstate_node *node = lsd->nodes[index];
+    if ((node->linkCount != count) || (memcmp(node->links, links, sizeof(struct server_link) * count) != 0))
+        lsd->dirty = lsd->changed = true;
+    node->seq = seq;
+    node->expiresAt = linkstate_now() + LINKSTATE_LIFETIME;
+    node->linkCount = count;
+    memcpy(node->links, links, sizeof(struct server_link) * count);
+    return true;
+}
+
+static bool linkstate_expire(const LinkState *ls) {
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    double now = linkstate_now();
+    bool expired = false;
+    for (int i = 0; i < lsd->nodeCount; i++) {
+        if (lsd->nodes[i]->expiresAt > now) continue;
+        free(lsd->nodes[i]);
+        lsd->nodes[i] = lsd->nodes[lsd->nodeCount - 1];
+        lsd->nodeCount -= 1;
+        i -= 1;
+        expired = true;
+    }
+    if (expired) lsd->dirty = lsd->changed = true;
+    return expired;
+}
+
+static int linkstate_tree_link(LinkStateData *lsd, struct sockaddr_in *self, struct sockaddr_in *neighbor) {
+    /* 1 if the link is on the tree, 0 if the tree has both ends but not it, -1 if we can't say. */
+    if (lsd->dirty || (linkstate_compare(&(lsd->treeFor), self) != 0)) linkstate_compute(lsd, self);
+
+    int me = linkstate_find(lsd, self), them = linkstate_find(lsd, neighbor);
+    if ((me < 0) || (them < 0)) return -1;
+    if ((lsd->nodes[me]->distance < 0) || (lsd->nodes[them]->distance < 0)) return -1;
+    return ((lsd->nodes[me]->parent == them) || (lsd->nodes[them]->parent == me)) ? 1 : 0;
+}
+
+static bool linkstate_on_tree(const LinkState *ls, struct sockaddr_in *self, struct sockaddr_in *neighbor) {
+    return linkstate_tree_link((LinkStateData *)(ls->self), self, neighbor) == 1;
+}
+
+static bool linkstate_off_tree(const LinkState *ls, struct sockaddr_in *self, struct sockaddr_in *neighbor) {
+    return linkstate_tree_link((LinkStateData *)(ls->self), self, neighbor) == 0;
+}
+
+static void linkstate_report(const LinkState *ls) {
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    if (lsd->dirty) linkstate_compute(lsd, &(lsd->treeFor));
+
+    int me = linkstate_find(lsd, &(lsd->treeFor));
+    if ((me < 0) || (lsd->nodes[me]->distance < 0)) return;
+    int reachable = 0, children = 0;
+    for (int i = 0; i < lsd->nodeCount; i++) {
+        if (lsd->nodes[i]->distance >= 0) reachable += 1;
+        if (lsd->nodes[i]->parent == me) children += 1;
+    }
+    printf("Link state: %d of %d servers reachable, at cost %d from the root, %d children\n",
+           reachable, lsd->nodeCount, lsd->nodes[me]->distance, children);
+}
+
+static bool linkstate_next_hop(const LinkState *ls, struct sockaddr_in *self, struct sockaddr_in *destination, struct sockaddr_in *hop) {
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    if (lsd->dirty || (linkstate_compare(&(lsd->treeFor), self) != 0)) linkstate_compute(lsd, self);
+
+    int index = linkstate_find(lsd, destination);
+    if ((index < 0) || (lsd->nodes[index]->hop < 0)) return false;
+    memcpy(hop, &(lsd->nodes[lsd->nodes[index]->hop]->address), sizeof(struct sockaddr_in));
+    return true;
+}
+
+static unsigned long long linkstate_weight(unsigned long long key, struct sockaddr_in *address) {
+    /* A server's rendezvous weight for a key (splitmix64 of the pair). */
+    unsigned long long z = key ^ (((unsigned long long)ntohl(address->sin_addr.s_addr) << 16) | ntohs(address->sin_port));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static bool linkstate_home(const LinkState *ls, struct sockaddr_in *self, unsigned long long key, struct sockaddr_in *home) {
+    /* Highest random weight over everyone reachable, so few keys move when the mesh does. */
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    if (lsd->dirty || (linkstate_compare(&(lsd->treeFor), self) != 0)) linkstate_compute(lsd, self);
+
+    int me = linkstate_find(lsd, self);
+    if ((me < 0) || (lsd->nodes[me]->distance < 0)) return false;
+    int best = -1;
+    unsigned long long bestWeight = 0;
+    for (int i = 0; i < lsd->nodeCount; i++) {
+        if ((lsd->nodes[i]->hop < 0) && (i != me)) continue;
+        unsigned long long weight = linkstate_weight(key, &(lsd->nodes[i]->address));
+        if ((best < 0) || (weight > bestWeight)) {
+            best = i;
+            bestWeight = weight;
+        }
+    }
+    memcpy(home, &(lsd->nodes[best]->address), sizeof(struct sockaddr_in));
+    return true;
+}
+
+static bool linkstate_changed(const LinkState *ls) {
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    bool changed = lsd->changed;
+    lsd->changed = false;
+    return changed;
+}
+
+static bool linkstate_advertisement(const LinkState *ls, int index, struct sockaddr_in *origin, unsigned int *seq, struct server_link *links, int *count) {
+    LinkStateData *lsd = (LinkStateData *)(ls->self);
+    if ((index < 0) || (index >= lsd->nodeCount)) return false;
+    struct linkstate_node *node = lsd->nodes[index];
+    memcpy(origin, &(node->address), sizeof(struct sockaddr_in));
+    *seq = node->seq;
+    *count = node->linkCount;
+    memcpy(links, node->links, sizeof(struct server_link) * node->linkCount);
+    return true;
+}
+
+const LinkState *LinkState_create() {
+    LinkState *ls = (LinkState *)malloc(sizeof(LinkState));
+    memset(ls, 0, sizeof(LinkState));
+
+    LinkStateData *lsd = (LinkStateData *)malloc(sizeof(LinkStateData));
+    memset(lsd, 0, sizeof(LinkStateData));
+    lsd->dirty = true;
+
+    *ls = {NULL, linkstate_cleanup, linkstate_update, linkstate_expire, linkstate_on_tree, linkstate_off_tree, linkstate_report,
+           linkstate_next_hop, linkstate_home, linkstate_changed, linkstate_advertisement};
+    ls->self = (void *)lsd;
+    return ls;
+}
+
+#endif /* _LINKSTATE_H_ */
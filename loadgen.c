@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "utils.h"
+
+/*
+ * Load Generator
+ *
+ * Logs in a batch of fake users, has them Say into a channel (Common by
+ * default) at a fixed rate and counts the TXT_SAY fan-out that comes back.
+ * Every Say carries its send time, so we also get delivery latency.
+ *
+ * For fan-out tests, --members=N logs in N silent users in Common first
+ * and --broadcast=rate has one more of them Say into Common meanwhile.
+ */
+
+#define LOADGEN_MAX_CLIENTS 1024
+#define LOADGEN_BATCH 64
+#define LOADGEN_MAX_SAMPLES (1 << 20)
+#define LOADGEN_MEMBER_BATCH 128
+#define LOADGEN_MEMBER_PORTS 30000    // per loopback address, below the ephemeral range
+
+struct load_client {
+    int socketFd;
+    long long received;
+};
+
+static struct load_client clients[LOADGEN_MAX_CLIENTS];
+static struct sockaddr_in serverAddr;
+
+// latency samples, in seconds
+static double *samples;
+static int sampleCount = 0;
+
+// options
+static const char *channelName = "Common";
+static int memberCount = 0;
+static double broadcastRate = 0;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+bool resolve_server(char *hostname, char *port) {
+    // Figure out what our server address is.
+    struct hostent *he;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(atoi(port));
+    if ((he = gethostbyname(hostname)) == NULL) {
+        fprintf(stderr, "Error resolving hostname\n");
+        return false;
+    }
+    memcpy(&serverAddr.sin_addr, he->h_addr_list[0], he->h_length);
+    return true;
+}
+
+void send_request(struct load_client *client, void *datagram, int size) {
+    sendto(
+        client->socketFd, datagram, size, MSG_DONTWAIT,
+        (const struct sockaddr *)(&serverAddr), sizeof(struct sockaddr_in)
+    );
+}
+
+void send_login(struct load_client *client, const char *username) {
+    request_login login;
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    strncpy(login.req_username, username, USERNAME_MAX - 1);
+    send_request(client, &login, sizeof(login));
+}
+
+void send_channel_request(struct load_client *client, request_t type, const char *channel) {
+    /* Sends a join or leave. */
+    request_join request;
+    memset(&request, 0, sizeof(request));
+    request.req_type = type;
+    strncpy(request.req_channel, channel, CHANNEL_MAX - 1);
+    send_request(client, &request, sizeof(request));
+}
+
+void send_say(struct load_client *client, const char *channel) {
+    /* Says the current time into the channel. */
+    request_say say;
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    strncpy(say.req_channel, channel, CHANNEL_MAX - 1);
+    snprintf(say.req_text, SAY_MAX, "%.9f", now_seconds());
+    send_request(client, &say, sizeof(say));
+}
+
+void drain_client(struct load_client *client, char *buffer) {
+    /* Counts every Say from our clients waiting for this one, timing each. */
+    while (recv(client->socketFd, buffer, BUFFER_SIZE, MSG_DONTWAIT) > 0) {
+        text_say *say = (text_say *)buffer;
+        if (say->txt_type != TXT_SAY) continue;
+        if (strncmp(say->txt_username, "load", 4) != 0) continue;
+        client->received += 1;
+        if (sampleCount < LOADGEN_MAX_SAMPLES)
+            samples[sampleCount++] = now_seconds() - atof(say->txt_text);
+    }
+}
+
+bool wait_for_reply(struct load_client *client, char *buffer) {
+    /* Round-trips a List, so we know the server got everything before it. */
+    request_list list = {req_type: REQ_LIST};
+    send_request(client, &list, sizeof(list));
+    double deadline = now_seconds() + 5;
+    while (now_seconds() < deadline) {
+        struct pollfd pfd = {client->socketFd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        int result = recv(client->socketFd, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+        if ((result > 0) && (((struct text *)buffer)->txt_type == TXT_LIST)) return true;
+    }
+    return false;
+}
+
+bool log_in_members(struct load_client *broadcaster, char *buffer) {
+    /*
+     * Logs in memberCount silent users, each from its own address. Their
+     * sockets are closed right away; the server keeps them until they
+     * time out and its sends to them are simply dropped.
+     */
+    for (int i = 0; i < memberCount; i++) {
+        struct load_client member = {socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP), 0};
+        if (member.socketFd < 0) {
+            fprintf(stderr, "Could not open socket\n");
+            return false;
+        }
+        struct sockaddr_in memberAddr;
+        memset(&memberAddr, 0, sizeof(memberAddr));
+        memberAddr.sin_family = AF_INET;
+        memberAddr.sin_addr.s_addr = htonl((127 << 24) | (2 << 8) | (1 + i / LOADGEN_MEMBER_PORTS));
+        memberAddr.sin_port = htons(2000 + (i % LOADGEN_MEMBER_PORTS));
+        if (bind(member.socketFd, (struct sockaddr *)&memberAddr, sizeof(memberAddr)) < 0) {
+            fprintf(stderr, "Could not bind member %d\n", i);
+            close(member.socketFd);
+            return false;
+        }
+
+        char username[USERNAME_MAX];
+        snprintf(username, USERNAME_MAX, "member%d", i);
+        send_login(&member, username);
+        close(member.socketFd);
+
+        // Don't outrun the server's socket buffer.
+        if (((i + 1) % LOADGEN_MEMBER_BATCH) == 0) {
+            if (!wait_for_reply(broadcaster, buffer)) {
+                fprintf(stderr, "Server stopped answering after %d members\n", i + 1);
+                return false;
+            }
+        }
+    }
+    return wait_for_reply(broadcaster, buffer);
+}
+
+int compare_samples(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int parse_options(int argc, char *argv[]) {
+    /*
+     * Pulls --name=value options out of argv.
+     * Returns the number of positional arguments left behind.
+     */
+    int positional = 0;
+    for (int i = 0; i < argc; i++) {
+        char *arg = argv[i];
+        if ((i == 0) || (strncmp(arg, "--", 2) != 0)) {
+            // Not an option, keep it in place.
+            argv[positional] = arg;
+            positional += 1;
+        } else if (strncmp(arg, "--channel=", 10) == 0) {
+            channelName = arg + 10;
+        } else if (strncmp(arg, "--members=", 10) == 0) {
+            memberCount = atoi(arg + 10);
+        } else if (strncmp(arg, "--broadcast=", 12) == 0) {
+            broadcastRate = atof(arg + 12);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            exit(1);
+        }
+    }
+    return positional;
+}
+
+int main(int argc, char *argv[]) {
+    // Validate arguments.
+    argc = parse_options(argc, argv);
+    if (argc != 6) {
+        fprintf(stderr, "Usage: %s [--channel=name] [--members=N] [--broadcast=says per second] <hostname> <port> <clients> <says per second> <seconds>\n", argv[0]);
+        exit(1);
+    }
+    if (!resolve_server(argv[1], argv[2])) exit(1);
+    int clientCount = atoi(argv[3]);
+    double rate = atof(argv[4]);
+    double duration = atof(argv[5]);
+    if ((clientCount < 1) || (clientCount > LOADGEN_MAX_CLIENTS)) {
+        fprintf(stderr, "Client count must be between 1 and %d\n", LOADGEN_MAX_CLIENTS);
+        exit(1);
+    }
+    samples = (double *)malloc(sizeof(double) * LOADGEN_MAX_SAMPLES);
+    if (samples == NULL) {fprintf(stderr, "Out of memory"); exit(1);}
+    char buffer[BUFFER_SIZE];
+
+    // The broadcaster is a Common member that talks.
+    struct load_client broadcaster = {socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP), 0};
+    if ((memberCount > 0) || (broadcastRate > 0)) {
+        send_login(&broadcaster, "bcast");
+        if (!log_in_members(&broadcaster, buffer)) exit(1);
+        printf("members  %d silent in Common\n", memberCount);
+    }
+
+    // Log everybody in. The server drops them into Common for us.
+    bool ownChannel = strcmp(channelName, "Common") != 0;
+    for (int i = 0; i < clientCount; i++) {
+        clients[i].socketFd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        clients[i].received = 0;
+        if (clients[i].socketFd < 0) {
+            fprintf(stderr, "Could not open socket\n");
+            exit(1);
+        }
+        int bufferSize = 4 * 1024 * 1024;
+        setsockopt(clients[i].socketFd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+        char username[USERNAME_MAX];
+        snprintf(username, USERNAME_MAX, "load%d", i);
+        send_login(&(clients[i]), username);
+        if (ownChannel) {
+            // Keep to our own channel.
+            send_channel_request(&(clients[i]), REQ_JOIN, channelName);
+            send_channel_request(&(clients[i]), REQ_LEAVE, "Common");
+        }
+    }
+    usleep(200000);
+
+    // Fire Says at the requested rate, draining replies as we go.
+    long long sent = 0, broadcasts = 0;
+    int next = 0;
+    double start = now_seconds();
+    double elapsed = 0;
+    while (elapsed < duration) {
+        long long due = (long long)(elapsed * rate);
+        for (int i = 0; (i < LOADGEN_BATCH) && (sent < due); i++) {
+            send_say(&(clients[next]), channelName);
+            next = (next + 1) % clientCount;
+            sent += 1;
+        }
+        if (broadcasts < (long long)(elapsed * broadcastRate)) {
+            send_say(&broadcaster, "Common");
+            broadcasts += 1;
+        }
+        for (int i = 0; i < clientCount; i++)
+            drain_client(&(clients[i]), buffer);
+        while (recv(broadcaster.socketFd, buffer, BUFFER_SIZE, MSG_DONTWAIT) > 0);
+        elapsed = now_seconds() - start;
+    }
+
+    // Give stragglers a moment, then log out.
+    usleep(200000);
+    long long received = 0;
+    for (int i = 0; i < clientCount; i++) {
+        drain_client(&(clients[i]), buffer);
+        received += clients[i].received;
+
+        request_logout logout = {req_type: REQ_LOGOUT};
+        send_request(&(clients[i]), &logout, sizeof(logout));
+        close(clients[i].socketFd);
+    }
+    request_logout logout = {req_type: REQ_LOGOUT};
+    send_request(&broadcaster, &logout, sizeof(logout));
+    close(broadcaster.socketFd);
+
+    // Report.
+    printf("clients %d  duration %.2fs  channel %s\n", clientCount, elapsed, channelName);
+    printf("sent     %lld says (%.0f/s)\n", sent, sent / elapsed);
+    if (broadcasts > 0)
+        printf("broadcast %lld says to %d members (%.1f/s)\n", broadcasts, memberCount + 1, broadcasts / elapsed);
+    printf("received %lld datagrams (%.0f/s)\n", received, received / elapsed);
+    printf("expected %lld datagrams (%.1f%% delivered)\n",
+           sent * clientCount, (100.0 * received) / (sent * clientCount));
+    if (sampleCount > 0) {
+        qsort(samples, sampleCount, sizeof(double), compare_samples);
+        printf("latency  p50 %.3fms  p99 %.3fms  max %.3fms\n",
+               samples[sampleCount / 2] * 1e3, samples[(sampleCount * 99) / 100] * 1e3,
+               samples[sampleCount - 1] * 1e3);
+    }
+    free(samples);
+    return 0;
+}
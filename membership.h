@@ -0,0 +1,376 @@
+#ifndef _MEMBERSHIP_H_
+#define _MEMBERSHIP_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+
+/*
+ * Membership ADT
+ *
+ * Who's in the mesh, as gossip (SWIM) has it. Servers probe each other and
+ * trade what they've heard; this keeps the table and settles the rumours,
+ * and topology does the sending. A member that misses a probe is suspect
+ * until it refutes that with a higher incarnation, or is dead once it's
+ * had MEMBERSHIP_SUSPECT_TIMEOUT to.
+ *
+ * Neighbors come from the table too. Each member picks the
+ * MEMBERSHIP_DEGREE others it hashes lowest with, and two members are
+ * linked if either picked the other. The hash is the same both ways
+ * round, so everyone with the same table builds the same random graph:
+ * connected, a few hops across, and about twice MEMBERSHIP_DEGREE links a
+ * member however large the mesh grows. A join or a death moves only the
+ * handful of links that involved it.
+ */
+
+#define MEMBERSHIP_MAX_MEMBERS 256
+#define MEMBERSHIP_DEGREE 3
+#define MEMBERSHIP_RETRANSMIT 3            // times each update is gossiped, per doubling of the members
+#define MEMBERSHIP_SUSPECT_TIMEOUT 4.0     // seconds a suspect has to refute it
+#define MEMBERSHIP_DEAD_HOLD 30.0          // seconds the dead are remembered, so stale gossip can't revive them
+
+typedef struct membership Membership;
+
+struct membership {
+    void *self;
+    void (*cleanup)(const Membership *ms);
+
+    // Takes in something gossip says about a member, or about us. Returns true if it was news.
+    bool (*apply)(const Membership *ms, struct gossip_update *update);
+
+    // A probe of the member went unanswered.
+    void (*suspect)(const Membership *ms, struct sockaddr_in *address);
+
+    // Declares suspects dead once they've had their chance, and forgets old deaths.
+    void (*expire)(const Membership *ms);
+
+    // Whether the member is alive or suspect.
+    bool (*knows)(const Membership *ms, struct sockaddr_in *address);
+
+    // The next member to probe, each once a round in a fresh random order; false if there's nobody.
+    bool (*next_probe)(const Membership *ms, struct sockaddr_in *target);
+
+    // Up to count live members, neither us nor exclude, at random. Returns how many.
+    int (*pick)(const Membership *ms, struct sockaddr_in *exclude, struct sockaddr_in *picked, int count);
+
+    // Our own update and then the freshest news, up to max. Returns how many.
+    int (*piggyback)(const Membership *ms, struct gossip_update *updates, int max);
+
+    // Every member we know of from offset on, up to max, for a server that just joined.
+    int (*list)(const Membership *ms, int offset, struct gossip_update *updates, int max);
+
+    // The members we're linked to in the overlay, up to max. Returns how many.
+    int (*neighbors)(const Membership *ms, struct sockaddr_in *peers, int max);
+
+    // Whether anyone joined, died or came back since we last asked.
+    bool (*changed)(const Membership *ms);
+
+    void (*report)(const Membership *ms);
+};
+
+struct membership_member {
+    struct sockaddr_in address;
+    unsigned int incarnation;
+    int state;
+    double since;    // when it took this state (monotonic seconds)
+    int gossip;      // times left to pass on its latest update
+};
+
+typedef struct membershipdata {
+    struct membership_member members[MEMBERSHIP_MAX_MEMBERS];
+    int count;
+
+    struct sockaddr_in address;
+    unsigned int incarnation;
+
+    int probeNext;
+    uint64_t random;
+
+    // the overlay is recomputed only once the live members change
+    bool dirty, changed;
+    struct sockaddr_in peers[MEMBERSHIP_MAX_MEMBERS];
+    int peerCount;
+
+    long long refuted, deaths;
+} MembershipData;
+
+static double membership_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static uint64_t membership_mix(uint64_t z) {
+    /* splitmix64's finalizer. */
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int membership_random(MembershipData *msd, int below) {
+    return (int)(membership_mix(msd->random += 0x9e3779b97f4a7c15ULL) % (uint64_t)below);
+}
+
+static bool membership_same(struct sockaddr_in *a, struct sockaddr_in *b) {
+    return (a->sin_addr.s_addr == b->sin_addr.s_addr) && (a->sin_port == b->sin_port);
+}
+
+static int membership_find(MembershipData *msd, struct sockaddr_in *address) {
+    for (int i = 0; i < msd->count; i++)
+        if (membership_same(&(msd->members[i].address), address)) return i;
+    return -1;
+}
+
+static int membership_budget(MembershipData *msd) {
+    /* How many times an update is passed on: MEMBERSHIP_RETRANSMIT per doubling of the members. */
+    int doublings = 1;
+    for (int n = msd->count + 1; n > 1; n /= 2) doublings += 1;
+    return MEMBERSHIP_RETRANSMIT * doublings;
+}
+
+static void membership_set(MembershipData *msd, struct membership_member *member, unsigned int incarnation, int state) {
+    /* Records a member's new state and gossips it; only deaths and revivals move the overlay. */
+    if ((state == GOSSIP_DEAD) != (member->state == GOSSIP_DEAD)) msd->dirty = msd->changed = true;
+    if ((state == GOSSIP_DEAD) && (member->state != GOSSIP_DEAD)) msd->deaths += 1;
+    member->incarnation = incarnation;
+    member->state = state;
+    member->since = membership_now();
+    member->gossip = membership_budget(msd);
+}
+
+static void membership_cleanup(const Membership *ms) {
+    free(ms->self);
+    free((void *)ms);
+}
+
+static bool membership_apply(const Membership *ms, struct gossip_update *update) {
+    /*
+     * SWIM's precedence: a higher incarnation wins; at the same one,
+     * suspect beats alive and dead beats both. Only a member's own, higher
+     * incarnation brings it back from the dead.
+     */
+    MembershipData *msd = (MembershipData *)(ms->self);
+    if ((update->state < GOSSIP_ALIVE) || (update->state > GOSSIP_DEAD)) return false;
+
+    // About us: say we're alive, louder.
+    if (membership_same(&(update->address), &(msd->address))) {
+        if ((update->state == GOSSIP_ALIVE) || ((int)(update->incarnation - msd->incarnation) < 0)) return false;
+        msd->incarnation = update->incarnation + 1;
+        msd->refuted += 1;
+        return true;
+    }
+
+    int index = membership_find(msd, &(update->address));
+    if (index < 0) {
+        if ((update->state == GOSSIP_DEAD) || (msd->count >= MEMBERSHIP_MAX_MEMBERS)) return false;
+        struct membership_member *member = &(msd->members[msd->count++]);
+        memset(member, 0, sizeof(struct membership_member));
+        memcpy(&(member->address), &(update->address), sizeof(struct sockaddr_in));
+        member->state = GOSSIP_DEAD;    // so joining counts as a change
+        membership_set(msd, member, update->incarnation, update->state);
+        return true;
+    }
+
+    struct membership_member *member = &(msd->members[index]);
+    int newer = (int)(update->incarnation - member->incarnation);
+    bool news;
+    if (member->state == GOSSIP_DEAD) news = (update->state != GOSSIP_DEAD) && (newer > 0);
+    else if (update->state == GOSSIP_DEAD) news = (newer >= 0);
+    else if (update->state == GOSSIP_SUSPECT) news = (newer > 0) || ((newer == 0) && (member->state == GOSSIP_ALIVE));
+    else news = (newer > 0);
+    if (news) membership_set(msd, member, update->incarnation, update->state);
+    return news;
+}
+
+static void membership_suspect(const Membership *ms, struct sockaddr_in *address) {
+    MembershipData *msd = (MembershipData *)(ms->self);
+    int index = membership_find(msd, address);
+    if ((index < 0) || (msd->members[index].state != GOSSIP_ALIVE)) return;
+    membership_set(msd, &(msd->members[index]), msd->members[index].incarnation, GOSSIP_SUSPECT);
+}
+
+static void membership_expire(const Membership *ms) {
+    MembershipData *msd = (MembershipData *)(ms->self);
+    double now = membership_now();
+    for (int i = 0; i < msd->count; i++) {
+        struct membership_member *member = &(msd->members[i]);
+        if ((member->state == GOSSIP_SUSPECT) && (now >= member->since + MEMBERSHIP_SUSPECT_TIMEOUT))
+            membership_set(msd, member, member->incarnation, GOSSIP_DEAD);
+        else if ((member->state == GOSSIP_DEAD) && (now >= member->since + MEMBERSHIP_DEAD_HOLD)) {
+            msd->members[i] = msd->members[msd->count - 1];
+            msd->count -= 1;
+            i -= 1;
+        }
+    }
+}
+
+static bool membership_knows(const Membership *ms, struct sockaddr_in *address) {
+    MembershipData *msd = (MembershipData *)(ms->self);
+    int index = membership_find(msd, address);
+    return (index >= 0) && (msd->members[index].state != GOSSIP_DEAD);
+}
+
+static bool membership_next_probe(const Membership *ms, struct sockaddr_in *target) {
+    /* Round-robin over the table, shuffled each time round, so every member is probed within a round or so. */
+    MembershipData *msd = (MembershipData *)(ms->self);
+    for (int tries = 0; tries <= msd->count; tries++) {
+        if (msd->probeNext >= msd->count) {
+            msd->probeNext = 0;
+            for (int i = msd->count - 1; i > 0; i--) {
+                int j = membership_random(msd, i + 1);
+                struct membership_member swap = msd->members[i];
+                msd->members[i] = msd->members[j];
+                msd->members[j] = swap;
+            }
+        }
+        if (msd->count == 0) return false;
+        struct membership_member *member = &(msd->members[msd->probeNext++]);
+        if (member->state == GOSSIP_DEAD) continue;
+        memcpy(target, &(member->address), sizeof(struct sockaddr_in));
+        return true;
+    }
+    return false;
+}
+
+static int membership_pick(const Membership *ms, struct sockaddr_in *exclude, struct sockaddr_in *picked, int count) {
+    /* Reservoir sampling over the live members. */
+    MembershipData *msd = (MembershipData *)(ms->self);
+    int seen = 0;
+    for (int i = 0; i < msd->count; i++) {
+        struct membership_member *member = &(msd->members[i]);
+        if ((member->state != GOSSIP_ALIVE) || membership_same(&(member->address), exclude)) continue;
+        int slot = (seen < count) ? seen : membership_random(msd, seen + 1);
+        if (slot < count) memcpy(&(picked[slot]), &(member->address), sizeof(struct sockaddr_in));
+        seen += 1;
+    }
+    return (seen < count) ? seen : count;
+}
+
+static int membership_piggyback(const Membership *ms, struct gossip_update *updates, int max) {
+    /* The updates with the most passes left are the newest, and the least heard. */
+    MembershipData *msd = (MembershipData *)(ms->self);
+    if (max <= 0) return 0;
+    memcpy(&(updates[0].address), &(msd->address), sizeof(struct sockaddr_in));
+    updates[0].incarnation = msd->incarnation;
+    updates[0].state = GOSSIP_ALIVE;
+
+    int count = 1;
+    bool taken[MEMBERSHIP_MAX_MEMBERS];
+    memset(taken, 0, sizeof(taken));
+    while (count < max) {
+        int best = -1;
+        for (int i = 0; i < msd->count; i++) {
+            if (taken[i] || (msd->members[i].gossip <= 0)) continue;
+            if ((best < 0) || (msd->members[i].gossip > msd->members[best].gossip)) best = i;
+        }
+        if (best < 0) break;
+        taken[best] = true;
+        msd->members[best].gossip -= 1;
+        memcpy(&(updates[count].address), &(msd->members[best].address), sizeof(struct sockaddr_in));
+        updates[count].incarnation = msd->members[best].incarnation;
+        updates[count].state = msd->members[best].state;
+        count += 1;
+    }
+    return count;
+}
+
+static int membership_list(const Membership *ms, int offset, struct gossip_update *updates, int max) {
+    MembershipData *msd = (MembershipData *)(ms->self);
+    int count = 0;
+    for (int i = offset; (i < msd->count) && (count < max); i++, count++) {
+        memcpy(&(updates[count].address), &(msd->members[i].address), sizeof(struct sockaddr_in));
+        updates[count].incarnation = msd->members[i].incarnation;
+        updates[count].state = msd->members[i].state;
+    }
+    return count;
+}
+
+static uint64_t membership_pair(struct sockaddr_in *a, struct sockaddr_in *b) {
+    /* A random-looking weight for the pair, the same whichever way round. */
+    uint64_t x = ((uint64_t)ntohl(a->sin_addr.s_addr) << 16) | ntohs(a->sin_port);
+    uint64_t y = ((uint64_t)ntohl(b->sin_addr.s_addr) << 16) | ntohs(b->sin_port);
+    if (x > y) {uint64_t swap = x; x = y; y = swap;}
+    return membership_mix(membership_mix(x) ^ y);
+}
+
+static bool membership_picks(struct sockaddr_in **live, int count, int from, int to) {
+    /* Whether to is among the MEMBERSHIP_DEGREE members from hashes lowest with. */
+    uint64_t weight = membership_pair(live[from], live[to]);
+    int lower = 0;
+    for (int i = 0; i < count; i++) {
+        if ((i == from) || (i == to)) continue;
+        if ((membership_pair(live[from], live[i]) < weight) && (++lower >= MEMBERSHIP_DEGREE)) return false;
+    }
+    return true;
+}
+
+static int membership_neighbors(const Membership *ms, struct sockaddr_in *peers, int max) {
+    MembershipData *msd = (MembershipData *)(ms->self);
+    if (msd->dirty) {
+        // Us first, then everyone not dead.
+        struct sockaddr_in *live[MEMBERSHIP_MAX_MEMBERS + 1];
+        int count = 0;
+        live[count++] = &(msd->address);
+        for (int i = 0; i < msd->count; i++)
+            if (msd->members[i].state != GOSSIP_DEAD) live[count++] = &(msd->members[i].address);
+
+        msd->peerCount = 0;
+        for (int i = 1; i < count; i++)
+            if (membership_picks(live, count, 0, i) || membership_picks(live, count, i, 0))
+                memcpy(&(msd->peers[msd->peerCount++]), live[i], sizeof(struct sockaddr_in));
+        msd->dirty = false;
+    }
+    int count = (msd->peerCount < max) ? msd->peerCount : max;
+    memcpy(peers, msd->peers, sizeof(struct sockaddr_in) * count);
+    return count;
+}
+
+static bool membership_changed(const Membership *ms) {
+    MembershipData *msd = (MembershipData *)(ms->self);
+    bool changed = msd->changed;
+    msd->changed = false;
+    return changed;
+}
+
+static void membership_report(const Membership *ms) {
+    MembershipData *msd = (MembershipData *)(ms->self);
+    int alive = 0, suspect = 0, dead = 0;
+    for (int i = 0; i < msd->count; i++) {
+        if (msd->members[i].state == GOSSIP_ALIVE) alive += 1;
+        else if (msd->members[i].state == GOSSIP_SUSPECT) suspect += 1;
+        else dead += 1;
+    }
+    struct sockaddr_in peers[MEMBERSHIP_MAX_MEMBERS];
+    int degree = membership_neighbors(ms, peers, MEMBERSHIP_MAX_MEMBERS);
+    printf("Membership: %d others alive, %d suspect, %d dead; %d overlay links; incarnation %u, %lld refuted, %lld deaths\n",
+           alive, suspect, dead, degree, msd->incarnation, msd->refuted, msd->deaths);
+}
+
+const Membership *Membership_create(struct sockaddr_in *address, uint64_t seed) {
+    Membership *ms = (Membership *)malloc(sizeof(Membership));
+    memset(ms, 0, sizeof(Membership));
+
+    MembershipData *msd = (MembershipData *)malloc(sizeof(MembershipData));
+    memset(msd, 0, sizeof(MembershipData));
+    memcpy(&(msd->address), address, sizeof(struct sockaddr_in));
+
+    // Seconds since the epoch, so a restarted server outranks what's said about its last life.
+    msd->incarnation = (unsigned int)time(NULL);
+    msd->random = seed;
+    msd->dirty = true;
+
+    *ms = {NULL, membership_cleanup, membership_apply, membership_suspect, membership_expire, membership_knows,
+           membership_next_probe, membership_pick, membership_piggyback, membership_list,
+           membership_neighbors, membership_changed, membership_report};
+    ms->self = (void *)msd;
+    return ms;
+}
+
+#endif /* _MEMBERSHIP_H_ */
@@ -0,0 +1,405 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "server.h"
+#include "iobackend.h"
+#include "reactor.h"
+#include "busypoll.h"
+#include "spscqueue.h"
+#include "sharedbuffer.h"
+
+/*
+ * Pipeline backend -- the other backends, split across threads.
+ *
+ *   ingress thread   receives from every backend into the ingress queue
+ *   state thread     (whoever calls recv/send) runs the handlers
+ *   egress threads   send what the state thread queued
+ *
+ * The state thread keeps users, channels and topology to itself, so none
+ * of them need locks; only the queues between stages are shared, and
+ * those are lock-free. Recipients are spread over egress threads by
+ * address, so everything one user gets still goes out in order.
+ *
+ * Only backends that can_split may be wrapped.
+ */
+
+#define PIPELINE_QUEUE_SIZE 4096
+#define PIPELINE_MAX_BACKENDS 4
+#define PIPELINE_MAX_EGRESS 16
+
+struct pipeline_datagram {
+    struct sockaddr_in address;
+    int length;
+    char data[BUFFER_SIZE];
+};
+
+struct pipeline_job {
+    struct shared_buffer *buffer;    // one reference per job
+    struct AddressRef *addressList;
+};
+
+// Pushed to an egress thread to make it quit.
+static struct pipeline_job pipelineStop;
+
+struct pipeline_egress {
+    struct spsc_queue *queue;
+    struct AddressRef *pending;    // recipients of the send being split up
+    pthread_t thread;
+    struct pipelinedata *pld;
+};
+
+typedef struct pipelinedata {
+    const IOBackend *backends[PIPELINE_MAX_BACKENDS];
+    int backendCount;
+    const BusyPoll *busyPoll;
+
+    // ingress
+    struct spsc_queue *ingress;    // received datagrams, ingress -> state
+    struct spsc_queue *spares;     // emptied datagrams, state -> ingress
+    struct pipeline_datagram *held;    // popped by the state thread, not yet returned
+    int stopBell;
+    bool stopping;
+    pthread_t ingressThread;
+
+    // egress
+    struct pipeline_egress egress[PIPELINE_MAX_EGRESS];
+    int egressCount;
+
+    // counters
+    long long received, jobs, stalls;
+} PipelineData;
+
+/*
+ * Ingress stage
+ */
+
+static bool pipeline_push(PipelineData *pld, struct spsc_queue *queue, void *item) {
+    /* Pushes, waiting for the consumer while the queue is full. */
+    while (!spsc_queue_push(queue, item)) {
+        if (__atomic_load_n(&(pld->stopping), __ATOMIC_RELAXED)) return false;
+        spsc_queue_publish(queue);
+        __atomic_add_fetch(&(pld->stalls), 1, __ATOMIC_RELAXED);
+        sched_yield();
+    }
+    return true;
+}
+
+static void pipeline_on_backend_ready(const Reactor *, int fd, unsigned, void *context) {
+    /* Moves everything waiting on one backend into the ingress queue. */
+    PipelineData *pld = (PipelineData *)context;
+    const IOBackend *io = NULL;
+    for (int i = 0; i < pld->backendCount; i++)
+        if (pld->backends[i]->get_fd(pld->backends[i]) == fd) io = pld->backends[i];
+    if (io == NULL) return;
+
+    while (1) {
+        struct pipeline_datagram *datagram = (struct pipeline_datagram *)spsc_queue_pop(pld->spares);
+        if (datagram == NULL) datagram = (struct pipeline_datagram *)malloc(sizeof(struct pipeline_datagram));
+        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+
+        memset(datagram->data, 0, BUFFER_SIZE);
+        memset(&(datagram->address), 0, sizeof(struct sockaddr_in));
+        int result = io->recv(io, datagram->data, BUFFER_SIZE, &(datagram->address));
+        if (result == 0) {
+            free(datagram);
+            break;
+        }
+        if (result < 0) {
+            // The error is consumed; keep draining, we're edge-triggered.
+            printf("An error occured while receiving a message.\n");
+            free(datagram);
+            continue;
+        }
+        datagram->length = result;
+        if (!pipeline_push(pld, pld->ingress, datagram)) {
+            free(datagram);
+            break;
+        }
+        pld->received += 1;
+    }
+    spsc_queue_publish(pld->ingress);
+}
+
+static void pipeline_on_stop(const Reactor *rc, int, unsigned, void *) {
+    rc->stop(rc);
+}
+
+static void *pipeline_ingress_main(void *context) {
+    PipelineData *pld = (PipelineData *)context;
+    const Reactor *reactor = Reactor_create();
+    if (reactor == NULL) return NULL;
+    for (int i = 0; i < pld->backendCount; i++)
+        reactor->add(reactor, pld->backends[i]->get_fd(pld->backends[i]), REACTOR_READ | REACTOR_EDGE,
+                     pipeline_on_backend_ready, pld);
+    reactor->add(reactor, pld->stopBell, REACTOR_READ, pipeline_on_stop, NULL);
+
+    // Spinning pays off here, right on top of the sockets.
+    if (pld->busyPoll != NULL) pld->busyPoll->attach(pld->busyPoll, reactor);
+    reactor->run(reactor, -1);
+    reactor->cleanup(reactor);
+    return NULL;
+}
+
+/*
+ * Egress stage
+ */
+
+static void pipeline_free_addresses(struct AddressRef *addressRef) {
+    while (addressRef != NULL) {
+        struct AddressRef *nextRef = addressRef->_next;
+        free(addressRef->_this);
+        free(addressRef);
+        addressRef = nextRef;
+    }
+}
+
+static void pipeline_on_jobs_ready(const Reactor *rc, int, unsigned, void *context) {
+    /* Sends every queued job, flushes, then waits for more. */
+    struct pipeline_egress *egress = (struct pipeline_egress *)context;
+    PipelineData *pld = egress->pld;
+    do {
+        struct pipeline_job *job;
+        while ((job = (struct pipeline_job *)spsc_queue_pop(egress->queue)) != NULL) {
+            if (job == &pipelineStop) {
+                rc->stop(rc);
+                return;
+            }
+            for (int i = 0; i < pld->backendCount; i++)
+                pld->backends[i]->send(pld->backends[i], job->buffer->data, job->buffer->size, job->addressList);
+            shared_buffer_release(job->buffer);
+            pipeline_free_addresses(job->addressList);
+            free(job);
+        }
+        for (int i = 0; i < pld->backendCount; i++)
+            pld->backends[i]->flush(pld->backends[i]);
+    } while (!spsc_queue_sleep(egress->queue));
+}
+
+static void *pipeline_egress_main(void *context) {
+    struct pipeline_egress *egress = (struct pipeline_egress *)context;
+    const Reactor *reactor = Reactor_create();
+    if (reactor == NULL) return NULL;
+    reactor->add(reactor, egress->queue->bell, REACTOR_READ, pipeline_on_jobs_ready, egress);
+    reactor->run(reactor, -1);
+    reactor->cleanup(reactor);
+    return NULL;
+}
+
+/*
+ * State thread side
+ */
+
+static void pipeline_cleanup(const IOBackend *io) {
+    /* Stops and joins every stage, then cleans up the wrapped backends. */
+    PipelineData *pld = (PipelineData *)(io->self);
+    __atomic_store_n(&(pld->stopping), true, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    ssize_t result = write(pld->stopBell, &one, sizeof(one));
+    (void)result;
+    pthread_join(pld->ingressThread, NULL);
+
+    for (int i = 0; i < pld->egressCount; i++) {
+        struct pipeline_egress *egress = &(pld->egress[i]);
+        while (!spsc_queue_push(egress->queue, &pipelineStop)) {
+            spsc_queue_publish(egress->queue);
+            sched_yield();
+        }
+        spsc_queue_publish(egress->queue);
+        pthread_join(egress->thread, NULL);
+        spsc_queue_destroy(egress->queue);
+    }
+
+    // Anything still queued never got handled.
+    void *item;
+    while ((item = spsc_queue_pop(pld->ingress)) != NULL) free(item);
+    while ((item = spsc_queue_pop(pld->spares)) != NULL) free(item);
+    if (pld->held != NULL) free(pld->held);
+    spsc_queue_destroy(pld->ingress);
+    spsc_queue_destroy(pld->spares);
+    close(pld->stopBell);
+
+    printf("Pipeline: %lld datagrams in, %lld send jobs out, %lld stalls on a full queue\n",
+           pld->received, pld->jobs, pld->stalls);
+    for (int i = 0; i < pld->backendCount; i++)
+        pld->backends[i]->cleanup(pld->backends[i]);
+    free(io->self);
+    free((void *)io);
+}
+
+static const char *pipeline_get_name(const IOBackend *) {
+    return "pipeline";
+}
+
+static int pipeline_get_fd(const IOBackend *io) {
+    PipelineData *pld = (PipelineData *)(io->self);
+    return pld->ingress->bell;
+}
+
+static int pipeline_recv(const IOBackend *io, char *buffer, int size, struct sockaddr_in *address) {
+    /* Takes one datagram the ingress thread received. */
+    PipelineData *pld = (PipelineData *)(io->self);
+
+    // Hand the last one back for reuse.
+    if (pld->held != NULL) {
+        if (!spsc_queue_push(pld->spares, pld->held)) free(pld->held);
+        pld->held = NULL;
+    }
+
+    struct pipeline_datagram *datagram;
+    while ((datagram = (struct pipeline_datagram *)spsc_queue_pop(pld->ingress)) == NULL) {
+        // Caught up; make sure the ingress thread wakes us for more.
+        spsc_queue_publish(pld->spares);
+        if (spsc_queue_sleep(pld->ingress)) return 0;
+    }
+
+    int length = (datagram->length < size) ? datagram->length : size;
+    memcpy(buffer, datagram->data, length);
+    memcpy(address, &(datagram->address), sizeof(struct sockaddr_in));
+    pld->held = datagram;
+    return length;
+}
+
+static bool pipeline_send(const IOBackend *io, const void *datagram, int size, struct AddressRef *addressList) {
+    /* Splits the recipients over the egress threads and queues a job for each. */
+    PipelineData *pld = (PipelineData *)(io->self);
+    if ((addressList == NULL) || (addressList->_this == NULL)) return true;
+
+    // The datagram is only ours for this call; every job shares one copy.
+    struct shared_buffer *buffer = shared_buffer_copy(datagram, size);
+    if (buffer == NULL) return false;
+
+    // Everything one address gets goes through the same thread.
+    while ((addressList != NULL) && (addressList->_this != NULL)) {
+        struct sockaddr_in *address = addressList->_this;
+        addressList = addressList->_next;
+        int index = (ntohl(address->sin_addr.s_addr) ^ ntohs(address->sin_port)) % pld->egressCount;
+
+        struct AddressRef *addressRef = (struct AddressRef *)malloc(sizeof(struct AddressRef));
+        struct sockaddr_in *copy = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
+        if ((addressRef == NULL) || (copy == NULL)) {fprintf(stderr, "Out of memory"); break;}
+        memcpy(copy, address, sizeof(struct sockaddr_in));
+        addressRef->_this = copy;
+        addressRef->_next = pld->egress[index].pending;
+        pld->egress[index].pending = addressRef;
+    }
+
+    bool success = true;
+    for (int i = 0; i < pld->egressCount; i++) {
+        struct pipeline_egress *egress = &(pld->egress[i]);
+        if (egress->pending == NULL) continue;
+
+        struct pipeline_job *job = (struct pipeline_job *)malloc(sizeof(struct pipeline_job));
+        if (job == NULL) {fprintf(stderr, "Out of memory"); success = false; break;}
+        job->buffer = shared_buffer_retain(buffer);
+        job->addressList = egress->pending;
+        egress->pending = NULL;
+        pld->jobs += 1;
+        if (!pipeline_push(pld, egress->queue, job)) {
+            shared_buffer_release(job->buffer);
+            pipeline_free_addresses(job->addressList);
+            free(job);
+            success = false;
+        }
+    }
+
+    // Drop anything a failure left behind, then our own hold on the buffer.
+    for (int i = 0; i < pld->egressCount; i++) {
+        pipeline_free_addresses(pld->egress[i].pending);
+        pld->egress[i].pending = NULL;
+    }
+    shared_buffer_release(buffer);
+    return success;
+}
+
+static void pipeline_flush(const IOBackend *io) {
+    /* Wakes the egress threads for everything queued since the last flush. */
+    PipelineData *pld = (PipelineData *)(io->self);
+    for (int i = 0; i < pld->egressCount; i++)
+        spsc_queue_publish(pld->egress[i].queue);
+    spsc_queue_publish(pld->spares);
+}
+
+static bool pipeline_enable_gro(const IOBackend *io) {
+    /* Passes GRO on to every backend; true if any took it. */
+    PipelineData *pld = (PipelineData *)(io->self);
+    bool enabled = false;
+    for (int i = 0; i < pld->backendCount; i++)
+        if (pld->backends[i]->enable_gro(pld->backends[i])) enabled = true;
+    return enabled;
+}
+
+static void pipeline_forget(const IOBackend *io, struct sockaddr_in *address) {
+    /* Passes it on; the state thread is the only one forgetting. */
+    PipelineData *pld = (PipelineData *)(io->self);
+    for (int i = 0; i < pld->backendCount; i++)
+        pld->backends[i]->forget(pld->backends[i], address);
+}
+
+static bool pipeline_can_split(const IOBackend *) {
+    // Already split.
+    return false;
+}
+
+const IOBackend *IOBackend_create_pipeline(const IOBackend **backends, int backendCount, int egressCount, const BusyPoll *busyPoll) {
+    /*
+     * Starts the ingress and egress threads over the given backends, which
+     * the pipeline then owns. Returns NULL if a backend can't be split.
+     */
+    if ((backendCount > PIPELINE_MAX_BACKENDS) || (egressCount < 1) || (egressCount > PIPELINE_MAX_EGRESS)) return NULL;
+    for (int i = 0; i < backendCount; i++) {
+        if (!(backends[i]->can_split(backends[i]))) {
+            fprintf(stderr, "The %s backend can't be pipelined.\n", backends[i]->get_name(backends[i]));
+            return NULL;
+        }
+    }
+
+    IOBackend *io = (IOBackend *)malloc(sizeof(IOBackend));
+    memset(io, 0, sizeof(IOBackend));
+
+    PipelineData *pld = (PipelineData *)malloc(sizeof(PipelineData));
+    memset(pld, 0, sizeof(PipelineData));
+    for (int i = 0; i < backendCount; i++) pld->backends[i] = backends[i];
+    pld->backendCount = backendCount;
+    pld->busyPoll = busyPoll;
+    pld->egressCount = egressCount;
+    pld->ingress = spsc_queue_create(PIPELINE_QUEUE_SIZE);
+    pld->spares = spsc_queue_create(PIPELINE_QUEUE_SIZE);
+    pld->stopBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((pld->ingress == NULL) || (pld->spares == NULL) || (pld->stopBell < 0)) exit(1);
+    for (int i = 0; i < egressCount; i++) {
+        pld->egress[i].queue = spsc_queue_create(PIPELINE_QUEUE_SIZE);
+        pld->egress[i].pld = pld;
+        if (pld->egress[i].queue == NULL) exit(1);
+    }
+
+    *io = {NULL, pipeline_cleanup, pipeline_get_name, pipeline_get_fd,
+           pipeline_recv, pipeline_send, pipeline_flush, pipeline_enable_gro,
+           pipeline_forget, pipeline_can_split};
+    io->self = (void *)pld;
+
+    // Keep our alarms on the state thread.
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    pthread_create(&(pld->ingressThread), NULL, pipeline_ingress_main, pld);
+    for (int i = 0; i < egressCount; i++)
+        pthread_create(&(pld->egress[i].thread), NULL, pipeline_egress_main, &(pld->egress[i]));
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return io;
+}
+
+#endif /* _PIPELINE_H_ */
@@ -0,0 +1,196 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "duckchat.h"
+#include "server.h"
+
+/*
+ * Rate limiter ADT
+ *
+ * Every user has a token bucket, kept in their struct User, refilling at
+ * the configured rate and holding RATE_LIMIT_BURST seconds of it. Each
+ * request costs what it costs us to serve: a WHO walks every user and a
+ * LIST every channel, a say fans out, a join or leave may reach the mesh.
+ * Logins, logouts and keep alives are free, so nobody is timed out for
+ * being throttled. A request its user can't pay for is throttled.
+ *
+ * Everything admitted also comes out of a shared bucket refilling at the
+ * server's capacity. As it drains we shed in order: below half full, WHOs
+ * and LISTs go; once it's empty, so do says from heavy senders, those
+ * asking for more than an even share of capacity between everyone who
+ * asked for anything over the last RATE_LIMIT_WINDOW. Users keeping under
+ * their share still get their says through an overload.
+ *
+ * Throttled or shed users get a TXT_ERROR saying why, at most once every
+ * RATE_LIMIT_NOTICE seconds, so the notices can't become a flood too.
+ */
+
+#define RATE_LIMIT_DEFAULT_RATE 20          // tokens per second per user
+#define RATE_LIMIT_DEFAULT_CAPACITY 5000    // tokens per second over everyone
+#define RATE_LIMIT_BURST 2.0                // seconds of refill a bucket holds
+#define RATE_LIMIT_NOTICE 1.0               // seconds between notices to a user
+#define RATE_LIMIT_WINDOW 1.0               // seconds over which demand is counted
+
+// Costs, in tokens.
+#define RATE_LIMIT_SAY_COST 1
+#define RATE_LIMIT_CHANNEL_COST 2           // joins and leaves
+#define RATE_LIMIT_LIST_COST 4
+#define RATE_LIMIT_WHO_COST 8
+
+// What admit() decides.
+#define RATE_ADMIT 0
+#define RATE_THROTTLE 1    // over the user's own rate
+#define RATE_SHED 2        // dropped while we're overloaded
+
+typedef struct ratelimiter RateLimiter;
+
+struct ratelimiter {
+    void *self;
+    void (*cleanup)(const RateLimiter *rl);
+
+    // Charges user for a request of this type, or says why it can't go ahead.
+    int  (*admit)(const RateLimiter *rl, struct User *user, request_t type);
+
+    // Whether it's been long enough to tell user about it again; if so, the clock restarts.
+    bool (*should_notify)(const RateLimiter *rl, struct User *user);
+
+    // Prints and resets what was throttled and shed since the last report.
+    void (*report)(const RateLimiter *rl);
+};
+
+typedef struct ratelimiterdata {
+    double rate, capacity;
+
+    // the shared bucket
+    double tokens, tokensAt;
+
+    // the current demand window, and how many users asked for anything in it and the one before
+    long window;
+    int active, lastActive;
+
+    // since the last report
+    long long admitted, throttled, shedQueries, shedSays;
+} RateLimiterData;
+
+static double rate_limit_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int rate_limit_cost(request_t type) {
+    /* What a request costs to serve. */
+    switch (type) {
+        case REQ_SAY: return RATE_LIMIT_SAY_COST;
+        case REQ_JOIN:
+        case REQ_LEAVE: return RATE_LIMIT_CHANNEL_COST;
+        case REQ_LIST: return RATE_LIMIT_LIST_COST;
+        case REQ_WHO: return RATE_LIMIT_WHO_COST;
+        default: return 0;
+    }
+}
+
+static void rate_limit_cleanup(const RateLimiter *rl) {
+    free(rl->self);
+    free((void *)rl);
+}
+
+static int rate_limit_admit(const RateLimiter *rl, struct User *user, request_t type) {
+    RateLimiterData *rld = (RateLimiterData *)(rl->self);
+    int cost = rate_limit_cost(type);
+    if (cost == 0) return RATE_ADMIT;
+
+    // Top both buckets up; a new user starts with a full one.
+    double now = rate_limit_now();
+    double userBurst = rld->rate * RATE_LIMIT_BURST;
+    if (user->tokensAt == 0) user->tokens = userBurst;
+    else user->tokens += (now - user->tokensAt) * rld->rate;
+    if (user->tokens > userBurst) user->tokens = userBurst;
+    user->tokensAt = now;
+
+    double burst = rld->capacity * RATE_LIMIT_BURST;
+    rld->tokens += (now - rld->tokensAt) * rld->capacity;
+    if (rld->tokens > burst) rld->tokens = burst;
+    rld->tokensAt = now;
+
+    // Count what they ask for, admitted or not, toward their demand.
+    long window = (long)(now / RATE_LIMIT_WINDOW);
+    if (window != rld->window) {
+        rld->lastActive = (window == rld->window + 1) ? rld->active : 0;
+        rld->active = 0;
+        rld->window = window;
+    }
+    if (user->window != window) {
+        user->lastSpent = (user->window == window - 1) ? user->spent : 0;
+        user->spent = 0;
+        user->window = window;
+        rld->active += 1;
+    }
+    user->spent += cost;
+
+    if (user->tokens < cost) {
+        rld->throttled += 1;
+        return RATE_THROTTLE;
+    }
+
+    // The more overloaded we are, the more goes.
+    if (((type == REQ_WHO) || (type == REQ_LIST)) && (rld->tokens < (burst / 2))) {
+        rld->shedQueries += 1;
+        return RATE_SHED;
+    }
+    int active = (rld->active > rld->lastActive) ? rld->active : rld->lastActive;
+    double share = (rld->capacity * RATE_LIMIT_WINDOW) / ((active > 0) ? active : 1);
+    double demand = (user->spent > user->lastSpent) ? user->spent : user->lastSpent;
+    if ((type == REQ_SAY) && (rld->tokens <= 0) && (demand > share)) {
+        rld->shedSays += 1;
+        return RATE_SHED;
+    }
+
+    // Admitted work always counts against capacity, down to a burst's worth of debt.
+    user->tokens -= cost;
+    rld->tokens -= cost;
+    if (rld->tokens < -burst) rld->tokens = -burst;
+    rld->admitted += 1;
+    return RATE_ADMIT;
+}
+
+static bool rate_limit_should_notify(const RateLimiter *, struct User *user) {
+    double now = rate_limit_now();
+    if ((user->noticeAt != 0) && (now - user->noticeAt < RATE_LIMIT_NOTICE)) return false;
+    user->noticeAt = now;
+    return true;
+}
+
+static void rate_limit_report(const RateLimiter *rl) {
+    RateLimiterData *rld = (RateLimiterData *)(rl->self);
+    printf("Rate limit: %lld admitted, %lld throttled, %lld lists/whos and %lld says shed, capacity %.0f%% left\n",
+           rld->admitted, rld->throttled, rld->shedQueries, rld->shedSays,
+           100 * rld->tokens / (rld->capacity * RATE_LIMIT_BURST));
+    rld->admitted = rld->throttled = rld->shedQueries = rld->shedSays = 0;
+    fflush(stdout);
+}
+
+const RateLimiter *RateLimiter_create(double rate, double capacity) {
+    /* Limits each user to rate tokens a second, and all of them to capacity. */
+    RateLimiter *rl = (RateLimiter *)malloc(sizeof(RateLimiter));
+    memset(rl, 0, sizeof(RateLimiter));
+
+    RateLimiterData *rld = (RateLimiterData *)malloc(sizeof(RateLimiterData));
+    memset(rld, 0, sizeof(RateLimiterData));
+    rld->rate = rate;
+    rld->capacity = capacity;
+    rld->tokens = capacity * RATE_LIMIT_BURST;
+    rld->tokensAt = rate_limit_now();
+
+    *rl = {NULL, rate_limit_cleanup, rate_limit_admit, rate_limit_should_notify, rate_limit_report};
+    rl->self = (void *)rld;
+    return rl;
+}
+
+#endif /* _RATELIMIT_H_ */
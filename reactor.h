@@ -0,0 +1,257 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include <sys/epoll.h>
+
+/*
+ * reactor ADT
+ *
+ * Hands readiness on registered file descriptors to callbacks. Each
+ * registration costs one epoll_ctl up front and nothing per wakeup, so
+ * the loops can grow event sources without being rewritten.
+ *
+ * Edge-triggered sources only fire when new data shows up -- their
+ * callbacks have to drain the fd until it would block.
+ */
+
+#define REACTOR_READ  0x1
+#define REACTOR_WRITE 0x2
+#define REACTOR_EDGE  0x4
+
+#define REACTOR_MAX_EVENTS 64
+
+typedef struct reactor Reactor;
+typedef void (*reactor_callback)(const Reactor *rc, int fd, unsigned ready, void *context);
+
+// Picks the timeout of the next wait from how many sources the last one fired.
+typedef int (*reactor_pacer)(const Reactor *rc, int fired, void *context);
+
+struct reactor {
+    void *self;
+    void (*cleanup)(const Reactor *rc);
+    bool (*add)(const Reactor *rc, int fd, unsigned events, reactor_callback callback, void *context);
+    bool (*modify)(const Reactor *rc, int fd, unsigned events);
+    bool (*remove)(const Reactor *rc, int fd);
+
+    // loop management
+    int  (*poll_once)(const Reactor *rc, int timeout);
+    void (*run)(const Reactor *rc, int timeout);
+    void (*stop)(const Reactor *rc);
+    void (*set_pacer)(const Reactor *rc, reactor_pacer pacer, void *context);
+
+    // The epoll fd itself, readable whenever a source is; lets a reactor nest in another.
+    int  (*get_fd)(const Reactor *rc);
+};
+
+struct reactor_handler {
+    int fd;
+    unsigned events;
+    reactor_callback callback;
+    void *context;
+    bool removed;
+    struct reactor_handler *_next;
+};
+
+typedef struct reactordata {
+    int epollFd;
+    bool running;
+    struct reactor_handler *handlers;
+
+    // optional wait policy for run()
+    reactor_pacer pacer;
+    void *pacerContext;
+} ReactorData;
+
+static unsigned reactor_to_epoll(unsigned events) {
+    unsigned epollEvents = 0;
+    if (events & REACTOR_READ) epollEvents |= EPOLLIN;
+    if (events & REACTOR_WRITE) epollEvents |= EPOLLOUT;
+    if (events & REACTOR_EDGE) epollEvents |= EPOLLET;
+    return epollEvents;
+}
+
+static struct reactor_handler *reactor_find_handler(ReactorData *rcd, int fd) {
+    /* Finds the live handler registered for a fd. */
+    struct reactor_handler *handler = rcd->handlers;
+    while (handler != NULL) {
+        if ((handler->fd == fd) && !(handler->removed)) return handler;
+        handler = handler->_next;
+    }
+    return NULL;
+}
+
+static void reactor_sweep(ReactorData *rcd) {
+    /* Frees handlers that were removed, now that no event can point at them. */
+    struct reactor_handler *handler = rcd->handlers;
+    struct reactor_handler *lastHandler = NULL;
+    while (handler != NULL) {
+        struct reactor_handler *nextHandler = handler->_next;
+        if (handler->removed) {
+            if (lastHandler == NULL) rcd->handlers = nextHandler;
+            else lastHandler->_next = nextHandler;
+            free(handler);
+        } else {
+            lastHandler = handler;
+        }
+        handler = nextHandler;
+    }
+}
+
+static void reactor_cleanup(const Reactor *rc) {
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    struct reactor_handler *handler = rcd->handlers;
+    while (handler != NULL) {
+        struct reactor_handler *nextHandler = handler->_next;
+        free(handler);
+        handler = nextHandler;
+    }
+    close(rcd->epollFd);
+    free(rcd);
+    free((void *)rc);
+}
+
+static bool reactor_add(const Reactor *rc, int fd, unsigned events, reactor_callback callback, void *context) {
+    /* Registers a callback for a fd. */
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    if (reactor_find_handler(rcd, fd) != NULL) return false;
+
+    struct reactor_handler *handler = (struct reactor_handler *)malloc(sizeof(struct reactor_handler));
+    if (handler == NULL) {fprintf(stderr, "Out of memory"); return false;}
+    handler->fd = fd;
+    handler->events = events;
+    handler->callback = callback;
+    handler->context = context;
+    handler->removed = false;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = reactor_to_epoll(events);
+    event.data.ptr = (void *)handler;
+    if (epoll_ctl(rcd->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        fprintf(stderr, "Reactor could not watch fd %d. (%d)\n", fd, errno);
+        free(handler);
+        return false;
+    }
+
+    handler->_next = rcd->handlers;
+    rcd->handlers = handler;
+    return true;
+}
+
+static bool reactor_modify(const Reactor *rc, int fd, unsigned events) {
+    /* Changes which events a registered fd is watched for. */
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    struct reactor_handler *handler = reactor_find_handler(rcd, fd);
+    if (handler == NULL) return false;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = reactor_to_epoll(events);
+    event.data.ptr = (void *)handler;
+    if (epoll_ctl(rcd->epollFd, EPOLL_CTL_MOD, fd, &event) < 0) return false;
+    handler->events = events;
+    return true;
+}
+
+static bool reactor_remove(const Reactor *rc, int fd) {
+    /* Unregisters a fd. Safe to call from inside a callback. */
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    struct reactor_handler *handler = reactor_find_handler(rcd, fd);
+    if (handler == NULL) return false;
+
+    epoll_ctl(rcd->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    handler->removed = true;
+    return true;
+}
+
+static int reactor_poll_once(const Reactor *rc, int timeout) {
+    /*
+     * Waits up to timeout milliseconds and runs the callbacks that are ready.
+     * Returns how many fired.
+     */
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int count = epoll_wait(rcd->epollFd, events, REACTOR_MAX_EVENTS, timeout);
+    if (count < 0) {
+        // Signals (our alarms) interrupt the wait; that's fine.
+        if (errno != EINTR) fprintf(stderr, "Reactor wait failure. (%d)\n", errno);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct reactor_handler *handler = (struct reactor_handler *)(events[i].data.ptr);
+        if (handler->removed) continue;
+
+        unsigned ready = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ready |= REACTOR_READ;
+        if (events[i].events & EPOLLOUT) ready |= REACTOR_WRITE;
+        handler->callback(rc, handler->fd, ready, handler->context);
+    }
+
+    reactor_sweep(rcd);
+    return count;
+}
+
+static void reactor_run(const Reactor *rc, int timeout) {
+    /*
+     * Runs callbacks until one of them calls stop. Without a pacer every
+     * wait uses timeout; with one, timeout only applies to the first.
+     */
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    rcd->running = true;
+    while (rcd->running) {
+        int fired = rc->poll_once(rc, timeout);
+        if (rcd->pacer != NULL) timeout = rcd->pacer(rc, fired, rcd->pacerContext);
+    }
+}
+
+static void reactor_stop(const Reactor *rc) {
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    rcd->running = false;
+}
+
+static void reactor_set_pacer(const Reactor *rc, reactor_pacer pacer, void *context) {
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    rcd->pacer = pacer;
+    rcd->pacerContext = context;
+}
+
+static int reactor_get_fd(const Reactor *rc) {
+    ReactorData *rcd = (ReactorData *)(rc->self);
+    return rcd->epollFd;
+}
+
+const Reactor *Reactor_create() {
+    /* Creates an epoll-backed reactor, or NULL if epoll is unavailable. */
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        fprintf(stderr, "Could not create epoll instance. (%d)\n", errno);
+        return NULL;
+    }
+
+    Reactor *rc = (Reactor *)malloc(sizeof(Reactor));
+    memset(rc, 0, sizeof(Reactor));
+
+    ReactorData *rcd = (ReactorData *)malloc(sizeof(ReactorData));
+    memset(rcd, 0, sizeof(ReactorData));
+    rcd->epollFd = epollFd;
+    rcd->running = false;
+    rcd->handlers = NULL;
+    rcd->pacer = NULL;
+    rcd->pacerContext = NULL;
+
+    *rc = {NULL, reactor_cleanup, reactor_add, reactor_modify, reactor_remove,
+           reactor_poll_once, reactor_run, reactor_stop, reactor_set_pacer,
+           reactor_get_fd};
+    rc->self = (void *)rcd;
+    return rc;
+}
+
+#endif /* _REACTOR_H_ */
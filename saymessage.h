@@ -0,0 +1,88 @@
+#ifndef _SAYMESSAGE_H_
+#define _SAYMESSAGE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "sharedbuffer.h"
+
+/*
+ * Say message
+ *
+ * One Say, encoded once into both of its wire forms: the TXT_SAY our own
+ * users get and the S2S_SAY our neighbors get. Local fan-out, S2S
+ * forwarding and anything else that wants the Say (a log, a history)
+ * retain these buffers rather than building their own copies.
+ */
+
+typedef struct saymessage {
+    struct shared_buffer *local;    // text_say
+    struct shared_buffer *relay;    // request_server_say, NULL if it came from a neighbor
+} SayMessage;
+
+static text_say *say_message_local(SayMessage *message) {
+    return (text_say *)(message->local->data);
+}
+
+static request_server_say *say_message_relay(SayMessage *message) {
+    return (request_server_say *)(message->relay->data);
+}
+
+bool say_message_encode(SayMessage *message, struct sockaddr_in *serverAddr, const char *username, const char *channelName, const char *text) {
+    /*
+     * Encodes a Say from one of our users. The relay gets its id when
+     * topology sends it.
+     */
+    message->local = shared_buffer_create(sizeof(text_say));
+    message->relay = shared_buffer_create(sizeof(request_server_say));
+    if ((message->local == NULL) || (message->relay == NULL)) {
+        shared_buffer_release(message->local);
+        shared_buffer_release(message->relay);
+        return false;
+    }
+
+    text_say *local = say_message_local(message);
+    local->txt_type = TXT_SAY;
+    memcpy(local->txt_channel, channelName, CHANNEL_MAX);
+    memcpy(local->txt_username, username, USERNAME_MAX);
+    memcpy(local->txt_text, text, SAY_MAX);
+
+    // The relay carries the same fields, straight from the local form.
+    request_server_say *relay = say_message_relay(message);
+    relay->req_type = S2S_SAY;
+    memcpy(&(relay->address), serverAddr, sizeof(struct sockaddr_in));
+    memcpy(relay->txt_username, local->txt_username, USERNAME_MAX);
+    memcpy(relay->txt_channel, local->txt_channel, CHANNEL_MAX);
+    memcpy(relay->txt_text, local->txt_text, SAY_MAX);
+    return true;
+}
+
+bool say_message_from_relay(SayMessage *message, request_server_say *datagram) {
+    /*
+     * Encodes the local form of a Say a neighbor sent us. Topology
+     * forwards the received bytes themselves, so there's no relay here.
+     */
+    message->relay = NULL;
+    message->local = shared_buffer_create(sizeof(text_say));
+    if (message->local == NULL) return false;
+
+    text_say *local = say_message_local(message);
+    local->txt_type = TXT_SAY;
+    memcpy(local->txt_channel, datagram->txt_channel, CHANNEL_MAX);
+    memcpy(local->txt_username, datagram->txt_username, USERNAME_MAX);
+    memcpy(local->txt_text, datagram->txt_text, SAY_MAX);
+    return true;
+}
+
+void say_message_release(SayMessage *message) {
+    shared_buffer_release(message->local);
+    shared_buffer_release(message->relay);
+    message->local = message->relay = NULL;
+}
+
+#endif /* _SAYMESSAGE_H_ */
@@ -0,0 +1,319 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "server.h"
+#include "channelList.h"
+#include "sharedbuffer.h"
+
+/*
+ * Outbound scheduler ADT
+ *
+ * Deficit round-robin over fan-outs. Every queued datagram belongs to a
+ * flow (its channel; direct replies share the "" flow). Each turn a flow
+ * earns a quantum of recipients and sends that many, so a two-person
+ * channel's Say goes out after at most one quantum of a huge broadcast
+ * rather than after all of it.
+ *
+ * get_fd() stays readable while anything is queued; the event loop calls
+ * run() on it, which sends a bounded budget and returns, so reading new
+ * datagrams interleaves with long fan-outs.
+ *
+ * Queued datagrams hold a reference to their buffer, not a copy.
+ *
+ * For each flow we track how long datagrams waited from being queued to
+ * their last recipient being sent. Flows are found by channel hash, and
+ * one that has emptied is freed once report() has printed it.
+ */
+
+#define SCHEDULER_DEFAULT_QUANTUM 64
+#define SCHEDULER_BUDGET 1024    // recipients per run()
+#define SCHEDULER_FLOW_BUCKETS 256
+
+// Sends one datagram to every address in the list, right now.
+typedef void (*scheduler_sender)(struct shared_buffer *buffer, struct AddressRef *addressList);
+
+typedef struct scheduler Scheduler;
+
+struct scheduler {
+    void *self;
+    void (*cleanup)(const Scheduler *s);
+    int  (*get_fd)(const Scheduler *s);
+
+    // Queues the datagram for every address in the list, in flow's queue.
+    bool (*enqueue)(const Scheduler *s, const char *flow, struct shared_buffer *buffer, struct AddressRef *addressList);
+
+    // Sends up to budget recipients. Returns true if anything is still queued.
+    bool (*run)(const Scheduler *s, int budget);
+
+    // Prints and resets the per-flow queueing delays.
+    void (*report)(const Scheduler *s);
+};
+
+struct scheduler_message {
+    struct scheduler_message *next;
+    double queuedAt;
+    struct shared_buffer *buffer;
+    int count, sent;
+    struct AddressRef *refs;    // count of them, linked in order
+    struct sockaddr_in *addresses;
+};
+
+struct scheduler_flow {
+    char name[CHANNEL_MAX];
+    unsigned long long hash;
+    struct scheduler_message *head, *tail;
+    int deficit;
+    bool active;
+    struct scheduler_flow *next;          // every flow
+    struct scheduler_flow *hashNext;      // same bucket of the index
+    struct scheduler_flow *nextActive;    // round-robin ring of flows with work
+
+    // since the last report
+    long long messages;
+    double totalDelay, maxDelay;
+};
+
+typedef struct schedulerdata {
+    scheduler_sender send;
+    int quantum;
+    int bell;
+    bool ringing;
+
+    struct scheduler_flow *flows;
+    struct scheduler_flow *index[SCHEDULER_FLOW_BUCKETS];    // by channel hash
+    struct scheduler_flow *activeHead, *activeTail;
+    long long queued;    // recipients not yet sent
+} SchedulerData;
+
+static double scheduler_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void scheduler_set_bell(SchedulerData *sd, bool ringing) {
+    /* Keeps the bell readable exactly while something is queued. */
+    if (sd->ringing == ringing) return;
+    uint64_t value = 1;
+    ssize_t result = ringing ? write(sd->bell, &value, sizeof(value)) : read(sd->bell, &value, sizeof(value));
+    (void)result;
+    sd->ringing = ringing;
+}
+
+static struct scheduler_flow *scheduler_find_flow(SchedulerData *sd, const char *name) {
+    /* Looks up a flow, creating it if needed. */
+    unsigned long long hash = channel_list_hash(name);
+    struct scheduler_flow **bucket = &(sd->index[hash % SCHEDULER_FLOW_BUCKETS]);
+    struct scheduler_flow *flow = *bucket;
+    while (flow != NULL) {
+        if ((flow->hash == hash) && (strncmp(flow->name, name, CHANNEL_MAX) == 0)) return flow;
+        flow = flow->hashNext;
+    }
+    flow = (struct scheduler_flow *)malloc(sizeof(struct scheduler_flow));
+    if (flow == NULL) return NULL;
+    memset(flow, 0, sizeof(struct scheduler_flow));
+    strncpy(flow->name, name, CHANNEL_MAX - 1);
+    flow->hash = hash;
+    flow->hashNext = *bucket;
+    *bucket = flow;
+    flow->next = sd->flows;
+    sd->flows = flow;
+    return flow;
+}
+
+static void scheduler_free_flow(SchedulerData *sd, struct scheduler_flow *flow) {
+    /* Takes an empty flow out of the index and frees it; the caller unlinks it from flows. */
+    struct scheduler_flow **link = &(sd->index[flow->hash % SCHEDULER_FLOW_BUCKETS]);
+    while (*link != flow) link = &((*link)->hashNext);
+    *link = flow->hashNext;
+    free(flow);
+}
+
+static void scheduler_activate(SchedulerData *sd, struct scheduler_flow *flow) {
+    /* Puts a flow at the back of the round-robin. */
+    if (flow->active) return;
+    flow->active = true;
+    flow->deficit = 0;
+    flow->nextActive = NULL;
+    if (sd->activeTail == NULL) sd->activeHead = flow;
+    else sd->activeTail->nextActive = flow;
+    sd->activeTail = flow;
+}
+
+static void scheduler_cleanup(const Scheduler *s) {
+    SchedulerData *sd = (SchedulerData *)(s->self);
+
+    // Whatever is still queued goes out now.
+    while (s->run(s, SCHEDULER_BUDGET));
+    s->report(s);
+
+    struct scheduler_flow *flow = sd->flows;
+    while (flow != NULL) {
+        struct scheduler_flow *nextFlow = flow->next;
+        free(flow);
+        flow = nextFlow;
+    }
+    close(sd->bell);
+    free(s->self);
+    free((void *)s);
+}
+
+static int scheduler_get_fd(const Scheduler *s) {
+    SchedulerData *sd = (SchedulerData *)(s->self);
+    return sd->bell;
+}
+
+static bool scheduler_enqueue(const Scheduler *s, const char *name, struct shared_buffer *buffer, struct AddressRef *addressList) {
+    /* Queues the datagram and a copy of its addresses in the flow's queue. */
+    SchedulerData *sd = (SchedulerData *)(s->self);
+    int count = 0;
+    for (struct AddressRef *addressRef = addressList; (addressRef != NULL) && (addressRef->_this != NULL); addressRef = addressRef->_next)
+        count += 1;
+    if (count == 0) return true;
+
+    struct scheduler_flow *flow = scheduler_find_flow(sd, (name != NULL) ? name : "");
+    size_t length = sizeof(struct scheduler_message) + (sizeof(struct AddressRef) + sizeof(struct sockaddr_in)) * count;
+    struct scheduler_message *message = (struct scheduler_message *)malloc(length);
+    if ((flow == NULL) || (message == NULL)) {
+        fprintf(stderr, "Out of memory");
+        if (message != NULL) free(message);
+        return false;
+    }
+
+    // One allocation: the message, its refs, then its addresses.
+    message->next = NULL;
+    message->queuedAt = scheduler_now();
+    message->count = count;
+    message->sent = 0;
+    message->refs = (struct AddressRef *)(message + 1);
+    message->addresses = (struct sockaddr_in *)(message->refs + count);
+    message->buffer = shared_buffer_retain(buffer);
+    for (int i = 0; i < count; i++) {
+        memcpy(&(message->addresses[i]), addressList->_this, sizeof(struct sockaddr_in));
+        message->refs[i]._this = &(message->addresses[i]);
+        message->refs[i]._next = (i + 1 < count) ? &(message->refs[i + 1]) : NULL;
+        addressList = addressList->_next;
+    }
+
+    if (flow->tail == NULL) flow->head = message;
+    else flow->tail->next = message;
+    flow->tail = message;
+    sd->queued += count;
+    scheduler_activate(sd, flow);
+    scheduler_set_bell(sd, true);
+    return true;
+}
+
+static int scheduler_send_slice(SchedulerData *sd, struct scheduler_flow *flow, int limit) {
+    /* Sends up to limit recipients of the flow's head message. Returns how many. */
+    struct scheduler_message *message = flow->head;
+    int slice = message->count - message->sent;
+    if (slice > limit) slice = limit;
+
+    // Cut the ref chain after the slice, send, then mend it.
+    struct AddressRef *last = &(message->refs[message->sent + slice - 1]);
+    struct AddressRef *rest = last->_next;
+    last->_next = NULL;
+    sd->send(message->buffer, &(message->refs[message->sent]));
+    last->_next = rest;
+    message->sent += slice;
+    sd->queued -= slice;
+
+    if (message->sent == message->count) {
+        // Done; account for how long it waited.
+        double delay = scheduler_now() - message->queuedAt;
+        flow->messages += 1;
+        flow->totalDelay += delay;
+        if (delay > flow->maxDelay) flow->maxDelay = delay;
+        flow->head = message->next;
+        if (flow->head == NULL) flow->tail = NULL;
+        shared_buffer_release(message->buffer);
+        free(message);
+    }
+    return slice;
+}
+
+static bool scheduler_run(const Scheduler *s, int budget) {
+    /* Deficit round-robin across the active flows until budget runs out. */
+    SchedulerData *sd = (SchedulerData *)(s->self);
+    while ((budget > 0) && (sd->activeHead != NULL)) {
+        // Take the flow at the front of the round-robin.
+        struct scheduler_flow *flow = sd->activeHead;
+        sd->activeHead = flow->nextActive;
+        if (sd->activeHead == NULL) sd->activeTail = NULL;
+        flow->active = false;
+
+        // Spend its deficit, but no more than our budget.
+        flow->deficit += sd->quantum;
+        while ((flow->head != NULL) && (flow->deficit > 0) && (budget > 0)) {
+            int limit = (flow->deficit < budget) ? flow->deficit : budget;
+            int sent = scheduler_send_slice(sd, flow, limit);
+            flow->deficit -= sent;
+            budget -= sent;
+        }
+
+        // Back of the line if it has more, otherwise it starts fresh next time.
+        if (flow->head != NULL) {
+            int deficit = flow->deficit;
+            scheduler_activate(sd, flow);
+            flow->deficit = deficit;
+        }
+    }
+    scheduler_set_bell(sd, sd->activeHead != NULL);
+    return sd->activeHead != NULL;
+}
+
+static void scheduler_report(const Scheduler *s) {
+    /* Prints every flow that sent something since the last report, then frees the empty ones. */
+    SchedulerData *sd = (SchedulerData *)(s->self);
+    struct scheduler_flow **link = &(sd->flows);
+    while (*link != NULL) {
+        struct scheduler_flow *flow = *link;
+        if (flow->messages > 0) {
+            printf("Channel %s: %lld datagrams queued %.3fms on average, %.3fms at most\n",
+                   (flow->name[0] != '\0') ? flow->name : "(direct)", flow->messages,
+                   (flow->totalDelay * 1e3) / flow->messages, flow->maxDelay * 1e3);
+            flow->messages = 0;
+            flow->totalDelay = flow->maxDelay = 0;
+        }
+
+        // Channels come and go; only keep flows with something queued.
+        if ((flow->head == NULL) && !(flow->active)) {
+            *link = flow->next;
+            scheduler_free_flow(sd, flow);
+        } else link = &(flow->next);
+    }
+    if (sd->queued > 0) printf("%lld recipients still queued\n", sd->queued);
+    fflush(stdout);
+}
+
+const Scheduler *Scheduler_create(int quantum, scheduler_sender send) {
+    /* Creates a scheduler handing quantum recipients per turn to send. */
+    Scheduler *s = (Scheduler *)malloc(sizeof(Scheduler));
+    memset(s, 0, sizeof(Scheduler));
+
+    SchedulerData *sd = (SchedulerData *)malloc(sizeof(SchedulerData));
+    memset(sd, 0, sizeof(SchedulerData));
+    sd->send = send;
+    sd->quantum = (quantum > 0) ? quantum : SCHEDULER_DEFAULT_QUANTUM;
+    sd->bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sd->bell < 0) exit(1);
+
+    *s = {NULL, scheduler_cleanup, scheduler_get_fd, scheduler_enqueue, scheduler_run, scheduler_report};
+    s->self = (void *)sd;
+    return s;
+}
+
+#endif /* _SCHEDULER_H_ */
@@ -5,7 +5,8 @@
 #include <signal.h>
 
 #include <sys/socket.h>
-#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <cerrno>
@@ -15,9 +16,32 @@
 #include "server.h"
 #include "utils.h"
 #include "topology.h"
+#include "iobackend.h"
+#include "iouring.h"
+#include "unixbackend.h"
+#include "shmbackend.h"
+#include "pipeline.h"
+#include "fanout.h"
+#include "scheduler.h"
+#include "saymessage.h"
+#include "reactor.h"
+#include "busypoll.h"
+#include "controlplane.h"
+#include "ratelimit.h"
 
 static const Topology *topology = NULL;
 static struct sockaddr_in *serverAddress = NULL;
+static bool gossip = false;    // the servers named are seeds, and gossip finds our neighbors
+static const BusyPoll *busyPoll = NULL;
+
+// Whether backends[0] is a pipeline running the I/O on other threads.
+static bool pipelined = false;
+
+// Every backend users can reach us through. Each one only sends to
+// addresses of its own family, so fan-out just goes through all of them.
+#define MAX_BACKENDS 3
+static const IOBackend *backends[MAX_BACKENDS];
+static int backendCount = 0;
 
 /*
  * Establishing Connection
@@ -31,8 +55,83 @@ int create_socket() {
     );
 }
 
-void perform_heartbeat(int) {
-    /* Performs the user heartbeat check. */
+int create_unix_socket(const char *path) {
+    /* Opens a unix datagram socket bound to path, or returns -1. */
+    if (strlen(path) >= UNIX_PATH_MAX) {
+        fprintf(stderr, "Unix socket path is too long\n");
+        return -1;
+    }
+    int unixSocket = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (unixSocket < 0) return -1;
+
+    struct sockaddr_un unixAddr;
+    memset(&unixAddr, 0, sizeof(unixAddr));
+    unixAddr.sun_family = AF_UNIX;
+    strcpy(unixAddr.sun_path, path);
+
+    // A stale socket file from an earlier run would make bind fail.
+    unlink(path);
+    if (bind(unixSocket, (struct sockaddr *)&unixAddr, sizeof(unixAddr)) < 0) {
+        printf("%d %s\n", errno, strerror(errno));
+        close(unixSocket);
+        return -1;
+    }
+    return unixSocket;
+}
+
+// Broadcasts to at least fanoutThreshold addresses go to the pool, which
+// sends through every backend that can_split; the rest are sent inline.
+static const FanoutPool *fanoutPool = NULL;
+static int fanoutThreshold = 0;
+
+bool address_list_reaches(struct AddressRef *addressList, int threshold) {
+    /* Whether the list holds at least threshold addresses. */
+    int count = 0;
+    while ((addressList != NULL) && (addressList->_this != NULL) && (count < threshold)) {
+        count += 1;
+        addressList = addressList->_next;
+    }
+    return count >= threshold;
+}
+
+void deliver_datagram(struct shared_buffer *buffer, struct AddressRef *addressList) {
+    /* Sends a datagram to every address, whichever backend it lives on. */
+    bool pooled = (fanoutPool != NULL) && address_list_reaches(addressList, fanoutThreshold);
+    if (pooled && !fanoutPool->submit(fanoutPool, buffer, addressList))
+        fprintf(stderr, "Fan-out pool dropped part of a broadcast.\n");
+    for (int i = 0; i < backendCount; i++) {
+        if (pooled && backends[i]->can_split(backends[i])) continue;
+        backends[i]->send(backends[i], buffer->data, buffer->size, addressList);
+    }
+}
+
+// With --drr, fan-outs wait their turn here instead of going out inline.
+static const Scheduler *scheduler = NULL;
+
+// With --rate-limit, users pay for their requests, and we shed load past our capacity.
+static const RateLimiter *rateLimiter = NULL;
+
+void send_datagram(const char *flow, struct shared_buffer *buffer, struct AddressRef *addressList) {
+    /* Queues a datagram for every address, in flow's turn if we schedule. */
+    bool pooled = (fanoutPool != NULL) && address_list_reaches(addressList, fanoutThreshold);
+    if ((scheduler == NULL) || pooled) deliver_datagram(buffer, addressList);
+    else scheduler->enqueue(scheduler, flow, buffer, addressList);
+}
+
+void flush_backends() {
+    for (int i = 0; i < backendCount; i++)
+        backends[i]->flush(backends[i]);
+}
+
+void forget_address(struct sockaddr_in *address) {
+    /* Lets the backends drop what they keep for a user who has gone for good. */
+    if (!is_local_address(address)) return;
+    for (int i = 0; i < backendCount; i++)
+        backends[i]->forget(backends[i], address);
+}
+
+void expire_users() {
+    /* Removes every user who has gone quiet for longer than SERVER_KEEPALIVE. */
     struct AddressRef *addressList = create_address_list(NULL);
     struct UserRef *userRef = userList;
 
@@ -45,562 +144,853 @@ void perform_heartbeat(int) {
     }
 
     // Remove ALL OF THEM that have expired.
-    while (addressList != NULL) {
-        if (addressList->_this == NULL) break;
+    struct AddressRef *addressRef = addressList;
+    while (addressRef != NULL) {
+        if (addressRef->_this == NULL) break;
         printf("Removing a user (failed to respond to heartbeat)\n");
-        remove_user(*(addressList->_this));
-        addressList = addressList->_next;
+        remove_user(*(addressRef->_this));
+        forget_address(addressRef->_this);
+        addressRef = addressRef->_next;
     }
     fflush(stdout);
 
     // Cleanup.
     free_address_list(addressList);
+}
 
-    // Prepare the next keepalive call.
-    alarm(SERVER_KEEPALIVE);
+void release_channel(struct Channel *channel) {
+    // Our last user left; let the mesh know now, and keep the channel only if we're on the way for others.
+    if (topology->s2s_channel_empty(topology, serverAddress, channel->channelName))
+        cleanup_channel(channel);
 }
 
-void topology_renew(int) {
-    // Renew the topology.
+void topology_renew() {
+    // Renew whichever servers are due; each has its own jittered schedule.
     topology->renew(topology, serverAddress, channelList);
 
-    // Prepare the next topology renew call.
-    alarm(TOPOLOGY_RENEW);
+    // Report once per renewal period.
+    static int ticks = 0;
+    ticks += 1;
+    if ((ticks * TOPOLOGY_TICK) >= TOPOLOGY_RENEW) {
+        ticks = 0;
+        topology->report(topology);
+        if (busyPoll != NULL) busyPoll->report(busyPoll);
+        if (scheduler != NULL) scheduler->report(scheduler);
+        if (rateLimiter != NULL) rateLimiter->report(rateLimiter);
+    }
 }
 
-void event_loop(const int openSocket, struct sockaddr_in *serverAddr) {
-    // Notify
-    printf("Initializing event loop...\n");
-    printf("Press enter to terminate process.\n");
-    fflush(stdout);
+void handle_datagram(char *buffer, struct sockaddr_in *address, struct sockaddr_in *serverAddr) {
+    // What request type are we dealing with?
+    request_t *requestType = (request_t *)malloc(sizeof(request_t));
+    if (requestType == NULL) {fprintf(stderr, "Out of memory"); return;}
+    memcpy((void *)requestType, (const void *)buffer, sizeof(request_t));
+
+    // Set keepalive.
+    User *user = get_user(*address);
+    if (user != NULL)
+        heartbeat_user(user);
+
+    // Prepare a datagram callback.
+    void *response = NULL;
+    int response_size = 0;
+    struct shared_buffer *sharedResponse = NULL;    // already encoded, e.g. a Say
+    bool send = false;
+    struct AddressRef *addressList = create_address_list(NULL);
 
-    // Get some consts defined.
-    const int fds_cnt = 2;          // file descriptors
-    const int poll_timeout = 0;    // poll timeout
+    // Nice shorthand
+    #define error_datagram(msg) response = make_error_datagram(msg); response_size = get_error_datagram_size(); send = true; add_address_to_list(addressList, address)
 
-    // Various setup
-    char *buffer = (char *)malloc(sizeof(char) * (BUFFER_SIZE + 1));
-    struct sockaddr_in *address = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-    int result;
+    // Over their own rate, or shed while we're overloaded; now and then they hear why.
+    int verdict = ((rateLimiter != NULL) && (user != NULL)) ? rateLimiter->admit(rateLimiter, user, *requestType) : RATE_ADMIT;
+    if ((verdict != RATE_ADMIT) && rateLimiter->should_notify(rateLimiter, user)) {
+        char notice[SAY_MAX];
+        memset(notice, 0, SAY_MAX);
+        strcpy(notice, (verdict == RATE_THROTTLE) ? "You are sending too fast; slow down." : "The server is busy; try again shortly.");
+        error_datagram(notice);
+    }
 
-    // Set up two file descriptors to poll for:
-    // our socket value and standard input.
-    struct pollfd fds[fds_cnt] = {
-        {fd: openSocket, events: POLLIN, revents: 0},
-        {fd: STDIN_FILENO, events: POLLIN, revents: 0}
-    };
+    // Handle the request types differently; anything refused is ignored.
+    switch ((verdict == RATE_ADMIT) ? *requestType : REQ_BAD) {
+        //            //
+        // USER LOGIN //
+        //            //
+        case REQ_LOGIN: {
+            // Decipher the request.
+            request_login *datagram = (request_login *)malloc(sizeof(request_login));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_login));
+
+            // Add the user.
+            User *existing_user = get_user(*address);
+            if (existing_user != NULL) {
+                // they have an address still linked -- log them out and cleanup first
+                print_addresses(serverAddr, address);
+                printf("recv Request Logout %s\n", existing_user->username);
+                remove_user(*address);
+            }
+            bool result = create_user(*address, datagram->req_username);
+            if (result) {
+                User *user = get_user(*address);
+                if (user == NULL) {
+                    printf("User logged on, but user creation FAILED!\n");
+                    error_datagram("Login failure.");
+                } else {
+                    // printf("User logged on. Username: %s\n", user->username);
+                    print_addresses(serverAddr, address);
+                    printf("recv Request Login %s\n", user->username);
+
+                    // In our implementation, we force add the client to Common.
+                    bool isNew = ((get_initial_channel()->userCount) == 0);
+                    add_user_to_channel(user, get_initial_channel());
+                    print_addresses(serverAddr, address);
+                    printf("recv Request Join %s Common\n", user->username);
+
+                    // Send call to topology -- only if this channel is "new".
+                    if (isNew)
+                        topology->s2s_join_send(topology, serverAddr, address, get_initial_channel()->channelName);
+                }
+            } else {
+                printf("User logged on, but user creation failed!");
+                error_datagram("Login failure.");
+            }
 
-    // Prepare keep-alive.
-    signal(SIGALRM, topology_renew);
-    alarm(TOPOLOGY_RENEW);
-
-    // Start the poll loop.
-    while (1) {
-        // Clear out our buffer and address.
-        memset(buffer, 0, BUFFER_SIZE);
-        memset(address, 0, sizeof(struct sockaddr_in));
-
-        // Perform polling.
-        poll(fds, fds_cnt, poll_timeout);
-
-        // Determine what has updated.
-        if (fds[0].revents & POLLIN) {
-            // We have received a message from a client.
-            socklen_t addressLength = sizeof(address);
-            result = recvfrom(
-                openSocket, buffer, BUFFER_SIZE, 0,
-                (struct sockaddr *)address, &addressLength
-            );
-            if (result < 0) {
-                printf("An error occured while receiving a message.\n");
+            // Cleanup.
+            free(datagram);
+            } break;
+
+        //             //
+        // USER LOGOUT //
+        //             //
+        case REQ_LOGOUT: {
+            // Decipher the request.
+            request_logout *datagram = (request_logout *)malloc(sizeof(request_logout));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_logout));
+
+            User *user = get_user(*address);
+            if (user != NULL) {
+                print_addresses(serverAddr, address);
+                printf("recv Request Logout %s\n", user->username);
+            }
+
+            // Clean up the user. Only here and on expiry are they gone for
+            // good; a login over an existing one keeps the address.
+            if (remove_user(*address)) forget_address(address);
+
+            // Cleanup.
+            free(datagram);
+            } break;
+
+        //                   //
+        // USER JOIN CHANNEL //
+        //                   //
+        case REQ_JOIN: {
+            // Decipher the request.
+            request_join *datagram = (request_join *)malloc(sizeof(request_join));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_join));
+
+            // Get the user.
+            User *user = get_user(*address);
+            if (user != NULL) {
+                // Get the channel.
+                struct Channel *channel = get_channel(datagram->req_channel, true);
+
+                // Make sure they aren't in this channel.
+                if (is_user_in_channel(user, channel)) {
+                    // The user is already in here, do nothing.
+                    printf("User %s tried to join a channel they were already in.\n", user->username);
+                    error_datagram("You are already in this channel.");
+                } else {
+                    // Add them to the channel.
+                    bool isNew = ((channel->userCount) == 0);
+                    add_user_to_channel(user, channel);
+                    print_addresses(serverAddr, address);
+                    printf("recv Request Join %s %s\n", user->username, channel->channelName);
+                    // printf("User %s joined channel %s.\n", user->username, channel->channelName);
+
+                    char *callback = (char *)malloc(sizeof(char) * SAY_MAX);
+                    sprintf(callback, "Joined channel [%s].", channel->channelName);
+                    error_datagram(callback);
+                    free(callback);
+
+                    // Send call to topology.
+                    if (isNew)
+                        topology->s2s_join_send(topology, serverAddr, address, datagram->req_channel);
+                }
             } else {
-                // What request type are we dealing with?
-                request_t *requestType = (request_t *)malloc(sizeof(request_t));
-                if (requestType == NULL) {fprintf(stderr, "Out of memory"); break;}
-                memcpy((void *)requestType, (const void *)buffer, sizeof(request_t));
+                printf("User tried to join a channel, but the User did not exist.\n");
+                error_datagram("You are not logged in. Please restart the client.");
+            }
+            fflush(stdout);
+
+            // Cleanup.
+            free(datagram);
+            } break;
+        
+        //                    //
+        // USER LEAVE CHANNEL //
+        //                    //
+        case REQ_LEAVE: {
+            // Decipher the request.
+            request_leave *datagram = (request_leave *)malloc(sizeof(request_leave));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_leave));
+
+            // Get the user.
+            User *user = get_user(*address);
+            if (user != NULL) {
+                // Get the channel.
+                struct Channel *channel = get_channel(datagram->req_channel, false);
+
+                // Make sure they are in this channel.
+                if (channel == NULL) {
+                    printf("User %s tried to leave a channel that does not exist.\n", user->username);
+                    error_datagram("You cannot leave a channel that doesn't exist.");
+                } else if (!is_user_in_channel(user, channel)) {
+                    // The user is not here, do nothing.
+                    printf("User %s tried to leave a channel they were not already in.\n", user->username);
+                    error_datagram("You cannot leave a channel you are not in.");
+                } else {
+                    // Don't let them leave common.
+                    // if (channel == get_initial_channel()) {
+                    //     printf("User %s tried to leave Common. Prevented.\n", user->username);
+                    //     error_datagram("You cannot leave Common!");
+                    // } else {
+                        // Remove them from the channel.
+                        print_addresses(serverAddr, address);
+                        printf("recv Request Leave %s\n", channel->channelName);
+                        //printf("User %s left channel %s.\n", user->username, channel->channelName);
 
-                // Set keepalive.
-                User *user = get_user(*address);
-                if (user != NULL)
-                    heartbeat_user(user);
-
-                // Prepare a datagram callback.
-                void *response = NULL;
-                int response_size = 0;
-                bool send = false;
-                struct AddressRef *addressList = create_address_list(NULL);
-
-                // Nice shorthand
-                #define error_datagram(msg) response = make_error_datagram(msg); response_size = get_error_datagram_size(); send = true; add_address_to_list(addressList, address)
-
-                // Handle the request types differently.
-                switch (*requestType) {
-                    //            //
-                    // USER LOGIN //
-                    //            //
-                    case REQ_LOGIN: {
-                        // Decipher the request.
-                        request_login *datagram = (request_login *)malloc(sizeof(request_login));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_login));
-
-                        // Add the user.
-                        User *existing_user = get_user(*address);
-                        if (existing_user != NULL) {
-                            // they have an address still linked -- log them out and cleanup first
-                            print_addresses(serverAddr, address);
-                            printf("recv Request Logout %s\n", existing_user->username);
-                            remove_user(*address);
-                        }
-                        bool result = create_user(*address, datagram->req_username);
-                        if (result) {
-                            User *user = get_user(*address);
-                            if (user == NULL) {
-                                printf("User logged on, but user creation FAILED!\n");
-                                error_datagram("Login failure.");
-                            } else {
-                                // printf("User logged on. Username: %s\n", user->username);
-                                print_addresses(serverAddr, address);
-                                printf("recv Request Login %s\n", user->username);
-
-                                // In our implementation, we force add the client to Common.
-                                bool isNew = ((get_initial_channel()->userCount) == 0);
-                                add_user_to_channel(user, get_initial_channel());
-                                print_addresses(serverAddr, address);
-                                printf("recv Request Join %s Common\n", user->username);
-
-                                // Send call to topology -- only if this channel is "new".
-                                if (isNew)
-                                    topology->s2s_join_send(topology, serverAddr, address, get_initial_channel()->channelName);
-                            }
-                        } else {
-                            printf("User logged on, but user creation failed!");
-                            error_datagram("Login failure.");
-                        }
+                        char *callback = (char *)malloc(sizeof(char) * SAY_MAX);
+                        sprintf(callback, "Left channel [%s].", channel->channelName);
+                        error_datagram(callback);
+                        free(callback);
 
-                        // Cleanup.
-                        free(datagram);
-                        } break;
-
-                    //             //
-                    // USER LOGOUT //
-                    //             //
-                    case REQ_LOGOUT: {
-                        // Decipher the request.
-                        request_logout *datagram = (request_logout *)malloc(sizeof(request_logout));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_logout));
-
-                        User *user = get_user(*address);
-                        if (user != NULL) {
-                            print_addresses(serverAddr, address);
-                            printf("recv Request Logout %s\n", user->username);
-                        }
+                        remove_user_from_channel(user, channel);
+                    // }
+                }
+            } else {
+                printf("User tried to leave a channel, but the User did not exist.\n");
+                error_datagram("You are not logged in. Please restart the client.");
+            }
+            fflush(stdout);
+
+            // Cleanup.
+            free(datagram);
+            } break;
+
+        //                   //
+        // USER SAYS MESSAGE //
+        //                   //
+        case REQ_SAY: {
+            // Find the user.
+            User *user = get_user(*address);
+            if (user == NULL) {
+                printf("Say request received, but user not found.\n");
+                error_datagram("You are not logged in. Please restart the client.");
+                break;
+            }
 
-                        // Clean up the user.
-                        remove_user(*address);
+            // Decipher the request.
+            request_say *datagram = (request_say *)malloc(sizeof(request_say));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_say));
 
-                        // Cleanup.
-                        free(datagram);
-                        } break;
-
-                    //                   //
-                    // USER JOIN CHANNEL //
-                    //                   //
-                    case REQ_JOIN: {
-                        // Decipher the request.
-                        request_join *datagram = (request_join *)malloc(sizeof(request_join));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_join));
-
-                        // Get the user.
-                        User *user = get_user(*address);
-                        if (user != NULL) {
-                            // Get the channel.
-                            struct Channel *channel = get_channel(datagram->req_channel, true);
-
-                            // Make sure they aren't in this channel.
-                            if (is_user_in_channel(user, channel)) {
-                                // The user is already in here, do nothing.
-                                printf("User %s tried to join a channel they were already in.\n", user->username);
-                                error_datagram("You are already in this channel.");
-                            } else {
-                                // Add them to the channel.
-                                bool isNew = ((channel->userCount) == 0);
-                                add_user_to_channel(user, channel);
-                                print_addresses(serverAddr, address);
-                                printf("recv Request Join %s %s\n", user->username, channel->channelName);
-                                // printf("User %s joined channel %s.\n", user->username, channel->channelName);
-
-                                char *callback = (char *)malloc(sizeof(char) * SAY_MAX);
-                                sprintf(callback, "Joined channel [%s].", channel->channelName);
-                                error_datagram(callback);
-                                free(callback);
-
-                                // Send call to topology.
-                                if (isNew)
-                                    topology->s2s_join_send(topology, serverAddr, address, datagram->req_channel);
-                            }
-                        } else {
-                            printf("User tried to join a channel, but the User did not exist.\n");
-                            error_datagram("You are not logged in. Please restart the client.");
-                        }
-                        fflush(stdout);
+            // Format and say the message server-side.
+            scrub_channel_name(datagram->req_channel);
+            scrub_chat_msg(datagram->req_text);
 
-                        // Cleanup.
-                        free(datagram);
-                        } break;
-                    
-                    //                    //
-                    // USER LEAVE CHANNEL //
-                    //                    //
-                    case REQ_LEAVE: {
-                        // Decipher the request.
-                        request_leave *datagram = (request_leave *)malloc(sizeof(request_leave));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_leave));
-
-                        // Get the user.
-                        User *user = get_user(*address);
-                        if (user != NULL) {
-                            // Get the channel.
-                            struct Channel *channel = get_channel(datagram->req_channel, false);
-
-                            // Make sure they are in this channel.
-                            if (channel == NULL) {
-                                printf("User %s tried to leave a channel that does not exist.\n", user->username);
-                                error_datagram("You cannot leave a channel that doesn't exist.");
-                            } else if (!is_user_in_channel(user, channel)) {
-                                // The user is not here, do nothing.
-                                printf("User %s tried to leave a channel they were not already in.\n", user->username);
-                                error_datagram("You cannot leave a channel you are not in.");
-                            } else {
-                                // Don't let them leave common.
-                                // if (channel == get_initial_channel()) {
-                                //     printf("User %s tried to leave Common. Prevented.\n", user->username);
-                                //     error_datagram("You cannot leave Common!");
-                                // } else {
-                                    // Remove them from the channel.
-                                    print_addresses(serverAddr, address);
-                                    printf("recv Request Leave %s\n", channel->channelName);
-                                    //printf("User %s left channel %s.\n", user->username, channel->channelName);
-
-                                    char *callback = (char *)malloc(sizeof(char) * SAY_MAX);
-                                    sprintf(callback, "Left channel [%s].", channel->channelName);
-                                    error_datagram(callback);
-                                    free(callback);
-
-                                    remove_user_from_channel(user, channel);
-                                // }
-                            }
-                        } else {
-                            printf("User tried to leave a channel, but the User did not exist.\n");
-                            error_datagram("You are not logged in. Please restart the client.");
-                        }
-                        fflush(stdout);
+            print_addresses(serverAddr, address);
+            printf("recv Request Say %s \"%s\"\n", datagram->req_channel, datagram->req_text);
+            // printf("[%s][%s]: %s\n", datagram->req_channel, user->username, datagram->req_text);
 
-                        // Cleanup.
-                        free(datagram);
-                        } break;
-
-                    //                   //
-                    // USER SAYS MESSAGE //
-                    //                   //
-                    case REQ_SAY: {
-                        // Find the user.
-                        User *user = get_user(*address);
-                        if (user == NULL) {
-                            printf("Say request received, but user not found.\n");
-                            error_datagram("You are not logged in. Please restart the client.");
-                            break;
-                        }
+            // Encode it once, for our users and our neighbors both.
+            SayMessage message;
+            if (!say_message_encode(&message, serverAddr, user->username, datagram->req_channel, datagram->req_text)) {
+                free(datagram);
+                break;
+            }
 
-                        // Decipher the request.
-                        request_say *datagram = (request_say *)malloc(sizeof(request_say));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_say));
+            // This will be sent out to all channels.
+            struct Channel *channel = get_channel(datagram->req_channel, false);
+            if (channel != NULL) {
+                sharedResponse = shared_buffer_retain(message.local);
+                send = true;
+                struct UserRef *channelUsers = get_users_in_channel(channel);
+                if (channelUsers != NULL) {
+                    struct UserRef *startList = channelUsers;
+                    struct AddressRef *tailRef = addressList;
+                    // Iterate over all users and add them to the list.
+                    while (channelUsers != NULL) {
+                        // Add their address.
+                        tailRef = append_address_to_list(tailRef, channelUsers->_this->address);
+                        // Next one
+                        channelUsers = channelUsers->_next;
+                    }
+                    // Cleanup.
+                    free_user_ref(startList);
+                }
+            } else {
+                printf("User %s tried to send a message into a non-existent channel.\n", user->username);
+                error_datagram("Channel does not exist.");
+            }
+            fflush(stdout);
+
+            // Send call to topology.
+            topology->s2s_say_originate(topology, serverAddr, say_message_relay(&message));
+
+            // Cleanup.
+            say_message_release(&message);
+            free(datagram);
+            } break;
+
+        //                            //
+        // USER REQUESTS CHANNEL LIST //
+        //                            //
+        case REQ_LIST: {
+            // Find the user.
+            User *user = get_user(*address);
+            if (user == NULL) {
+                printf("List request received, but user not found.\n");
+                error_datagram("You are not logged in. Please restart the client.");
+                break;
+            }
+            // printf("User %s requested channel listing.\n", user->username);
+            print_addresses(serverAddr, address);
+            printf("recv Request List %s\n", user->username);
+
+            // Make our datagram.
+            response = make_channel_list_datagram();
+            response_size = get_channel_list_datagram_size(response);
+            send = true;
+            add_address_to_list(addressList, address);
+            } break;
+
+        //                         //
+        // USER REQUESTS USER LIST //
+        //                         //
+        case REQ_WHO: {
+            // Find the user.
+            User *user = get_user(*address);
+            if (user == NULL) {
+                printf("Say request received, but user not found.\n");
+                error_datagram("You are not logged in. Please restart the client.");
+                break;
+            }
 
-                        // Format and say the message server-side.
-                        scrub_channel_name(datagram->req_channel);
-                        scrub_chat_msg(datagram->req_text);
+            // Decipher the request.
+            request_who *datagram = (request_who *)malloc(sizeof(request_who));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_who));
+
+            print_addresses(serverAddr, address);
+            printf("recv Request Who %s %s\n", user->username, datagram->req_channel);
+
+            // Get the channel.
+            struct Channel *channel = get_channel(datagram->req_channel, false);
+            if (channel != NULL) {
+                // Get the users in the channel.
+                struct UserRef *channelUsers = get_users_in_channel(channel);
+                if (channelUsers != NULL) {
+                    // It exists! We can make our response.
+                    response = make_who_datagram(channelUsers, channel);
+                    response_size = get_who_datagram_size(response);
+                    send = true;
+                    add_address_to_list(addressList, address);
+
+                    // Cleanup.
+                    free_user_ref(channelUsers);
+                }
+            } else {
+                printf("User %s tried to get user list info from a nonexistent channel.\n", user->username);
+                
+                char *callback = (char *)malloc(sizeof(char) * SAY_MAX);
+                sprintf(callback, "Channel [%s] does not exist.", datagram->req_channel);
+                error_datagram(callback);
+                free(callback);
+            }
 
-                        print_addresses(serverAddr, address);
-                        printf("recv Request Say %s \"%s\"\n", datagram->req_channel, datagram->req_text);
-                        // printf("[%s][%s]: %s\n", datagram->req_channel, user->username, datagram->req_text);
-
-                        // Make our datagram.
-                        text_say *say_response = (text_say *)malloc(sizeof(text_say));
-                        if (say_response == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memset(say_response, '\0', sizeof(text_say));
-
-                        // Popualte the datagram.
-                        say_response->txt_type = TXT_SAY;
-                        memcpy(say_response->txt_channel, datagram->req_channel, CHANNEL_MAX);
-                        memcpy(say_response->txt_username, user->username, USERNAME_MAX);
-                        memcpy(say_response->txt_text, datagram->req_text, SAY_MAX);
-
-                        // Package it up
-                        response = (void *)say_response;
-                        response_size = sizeof(request_say);
-                        send = true;
-
-                        // This will be sent out to all channels.
-                        struct Channel *channel = get_channel(datagram->req_channel, false);
-                        if (channel != NULL) {
-                            struct UserRef *channelUsers = get_users_in_channel(channel);
-                            if (channelUsers != NULL) {
-                                struct UserRef *startList = channelUsers;
-                                // Iterate over all users and add them to the list.
-                                while (channelUsers != NULL) {
-                                    // Add their address.
-                                    add_address_to_list(addressList, channelUsers->_this->address);
-                                    // Next one
-                                    channelUsers = channelUsers->_next;
-                                }
-                                // Cleanup.
-                                free_user_ref(startList);
-                            }
-                        } else {
-                            printf("User %s tried to send a message into a non-existent channel.\n", user->username);
-                            error_datagram("Channel does not exist.");
+            // Cleanup.
+            free(datagram);
+            } break;
+
+        //                       //
+        // KEEP ALIVE MANAGEMENT //
+        //                       //
+        case REQ_KEEP_ALIVE: break;  // Receiving this call forces a keepalive anyways
+
+        //          //
+        // S2S JOIN //
+        //          //
+        case S2S_JOIN: {
+            // Decipher the request.
+            request_server_join *datagram = (request_server_join *)malloc(sizeof(request_server_join));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_server_join));
+
+            // Defer action to topology.
+            topology->s2s_join_recv(topology, serverAddr, &(datagram->address), datagram->req_channel);
+
+            // Cleanup.
+            free(datagram);
+            break;
+        }
+        //           //
+        // S2S LEAVE //
+        //           //
+        case S2S_LEAVE: {
+            // Decipher the request.
+            request_server_leave *datagram = (request_server_leave *)malloc(sizeof(request_server_leave));
+            if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
+            memcpy((void *)datagram, (const void *)buffer, sizeof(request_server_leave));
+
+            // Defer action to topology.
+            topology->s2s_leave_recv(topology, serverAddr, &(datagram->address), datagram->req_channel);
+
+            // Cleanup.
+            free(datagram);
+            break;
+        }
+        //                        //
+        // S2S JOIN / LEAVE BATCH //
+        //                        //
+        case S2S_JOIN_BATCH:
+        case S2S_LEAVE_BATCH: {
+            // The buffer was cleared before the receive, so channels past the end read as empty.
+            topology->s2s_channels_recv(topology, serverAddr, (request_server_channels *)buffer);
+            break;
+        }
+        //                     //
+        // S2S DIGEST / RESYNC //
+        //                     //
+        case S2S_DIGEST:
+        case S2S_RESYNC: {
+            topology->s2s_digest_recv(topology, serverAddr, (request_server_digest *)buffer, channelList);
+            break;
+        }
+        //         //
+        // S2S LSA //
+        //         //
+        case S2S_LSA: {
+            topology->s2s_lsa_recv(topology, serverAddr, (request_server_lsa *)buffer);
+            break;
+        }
+        //                    //
+        // S2S RELIABLE / ACK //
+        //                    //
+        case S2S_RELIABLE: {
+            // As for batches, a short payload reads as empty channels.
+            topology->s2s_reliable_recv(topology, serverAddr, (request_server_reliable *)buffer);
+            break;
+        }
+        case S2S_ACK: {
+            topology->s2s_ack_recv(topology, serverAddr, (request_server_ack *)buffer);
+            break;
+        }
+        //           //
+        // S2S HELLO //
+        //           //
+        case S2S_HELLO: {
+            topology->s2s_hello_recv(topology, serverAddr, (request_server_hello *)buffer);
+            break;
+        }
+        //            //
+        // S2S GOSSIP //
+        //            //
+        case S2S_PING:
+        case S2S_PING_REQ:
+        case S2S_PING_ACK:
+        case S2S_MEMBERS: {
+            // As for batches, updates past the end read as empty.
+            topology->s2s_gossip_recv(topology, serverAddr, (request_server_gossip *)buffer);
+            break;
+        }
+        //         //
+        // S2S SAY //
+        //         //
+        case S2S_SAY: {
+            // Work on the received bytes in place; topology forwards them as is.
+            request_server_say *datagram = (request_server_say *)buffer;
+
+            // Defer action to topology.
+            bool success = topology->s2s_say_recv(topology, serverAddr, datagram);
+
+            // If this message was new, send it out to all users.
+            if (success) {
+                // This will be sent out to all channels.
+                struct Channel *channel = get_channel(datagram->txt_channel, false);
+                if (channel != NULL) {
+                    // Our users' form of it; the relay was forwarded as received.
+                    SayMessage message;
+                    if (!say_message_from_relay(&message, datagram)) break;
+                    sharedResponse = message.local;
+                    send = true;
+
+                    struct UserRef *channelUsers = get_users_in_channel(channel);
+                    if (channelUsers != NULL) {
+                        struct UserRef *startList = channelUsers;
+                        struct AddressRef *tailRef = addressList;
+                        // Iterate over all users and add them to the list.
+                        while (channelUsers != NULL) {
+                            // Add their address.
+                            tailRef = append_address_to_list(tailRef, channelUsers->_this->address);
+                            // Next one
+                            channelUsers = channelUsers->_next;
                         }
-                        fflush(stdout);
+                        // Cleanup.
+                        free_user_ref(startList);
+                    }
+                } else {
+                    printf("User %s tried to send a message into a non-existent channel.\n", datagram->txt_username);
+                    error_datagram("Channel does not exist.");
+                }
+                fflush(stdout);
+            }
 
-                        // Send call to topology.
-                        topology->s2s_say_send(topology, serverAddr, NULL,
-                                               user->username, datagram->req_channel,
-                                               datagram->req_text, 0);
+            break;
+        }
+        //                       //
+        // COOL AND AWESOME HACK //
+        //                       //
+        case REQ_BAD:
+            // Ignore this request :P
+            break;
+
+        //                 //
+        // UNKNOWN REQUEST //
+        //                 //
+        default:
+            printf("Received undefined request, ignoring\n");
+            break;
+    }
+    // See if we're sending something back to clients.
+    if (send) {
+        // Queue the response for all users in the address list. Says
+        // queue by channel; everything else is a direct reply.
+        if (sharedResponse == NULL) sharedResponse = shared_buffer_copy(response, response_size);
+        if (sharedResponse != NULL) {
+            text_say *say_response = (text_say *)(sharedResponse->data);
+            const char *flow = (say_response->txt_type == TXT_SAY) ? say_response->txt_channel : NULL;
+            send_datagram(flow, sharedResponse, addressList);
+        }
+    }
 
-                        // Cleanup.
-                        free(datagram);
-                        } break;
-
-                    //                            //
-                    // USER REQUESTS CHANNEL LIST //
-                    //                            //
-                    case REQ_LIST: {
-                        // Find the user.
-                        User *user = get_user(*address);
-                        if (user == NULL) {
-                            printf("List request received, but user not found.\n");
-                            error_datagram("You are not logged in. Please restart the client.");
-                            break;
-                        }
-                        // printf("User %s requested channel listing.\n", user->username);
-                        print_addresses(serverAddr, address);
-                        printf("recv Request List %s\n", user->username);
-
-                        // Make our datagram.
-                        response = make_channel_list_datagram();
-                        response_size = get_channel_list_datagram_size(response);
-                        send = true;
-                        add_address_to_list(addressList, address);
-                        } break;
-
-                    //                         //
-                    // USER REQUESTS USER LIST //
-                    //                         //
-                    case REQ_WHO: {
-                        // Find the user.
-                        User *user = get_user(*address);
-                        if (user == NULL) {
-                            printf("Say request received, but user not found.\n");
-                            error_datagram("You are not logged in. Please restart the client.");
-                            break;
-                        }
+    // Cleanup.
+    free_address_list(addressList);
+    free(requestType);
+    shared_buffer_release(sharedResponse);
+    if (response != NULL) free(response);
+}
 
-                        // Decipher the request.
-                        request_who *datagram = (request_who *)malloc(sizeof(request_who));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_who));
+/*
+ * Event Sources
+ */
 
-                        print_addresses(serverAddr, address);
-                        printf("recv Request Who %s %s\n", user->username, datagram->req_channel);
-
-                        // Get the channel.
-                        struct Channel *channel = get_channel(datagram->req_channel, false);
-                        if (channel != NULL) {
-                            // Get the users in the channel.
-                            struct UserRef *channelUsers = get_users_in_channel(channel);
-                            if (channelUsers != NULL) {
-                                // It exists! We can make our response.
-                                response = make_who_datagram(channelUsers, channel);
-                                response_size = get_who_datagram_size(response);
-                                send = true;
-                                add_address_to_list(addressList, address);
-
-                                // Cleanup.
-                                free_user_ref(channelUsers);
-                            }
-                        } else {
-                            printf("User %s tried to get user list info from a nonexistent channel.\n", user->username);
-                            
-                            char *callback = (char *)malloc(sizeof(char) * SAY_MAX);
-                            sprintf(callback, "Channel [%s] does not exist.", datagram->req_channel);
-                            error_datagram(callback);
-                            free(callback);
-                        }
+// Everything the reactor callbacks need to service a wakeup.
+struct loop_state {
+    const IOBackend *io;
+    struct sockaddr_in *serverAddr;
+    char *buffer;
+    struct sockaddr_in *address;
+};
+
+// With --control-plane, control traffic arrives on its own socket, read through this.
+static const IOBackend *controlBackend = NULL;
+
+bool receive_datagram(const IOBackend *io, struct loop_state *state) {
+    /* Handles the next datagram io has waiting; false once it has none. */
+    // Clear out our buffer and address.
+    memset(state->buffer, 0, BUFFER_SIZE);
+    memset(state->address, 0, sizeof(struct sockaddr_in));
+
+    int result = io->recv(io, state->buffer, BUFFER_SIZE, state->address);
+    if (result == 0) return false;
+    if (result < 0) {
+        // The error is consumed; keep draining, we're edge-triggered.
+        printf("An error occured while receiving a message.\n");
+        return true;
+    }
+    handle_datagram(state->buffer, state->address, state->serverAddr);
+    return true;
+}
 
-                        // Cleanup.
-                        free(datagram);
-                        } break;
-
-                    //                       //
-                    // KEEP ALIVE MANAGEMENT //
-                    //                       //
-                    case REQ_KEEP_ALIVE: break;  // Receiving this call forces a keepalive anyways
-
-                    //          //
-                    // S2S JOIN //
-                    //          //
-                    case S2S_JOIN: {
-                        // Decipher the request.
-                        request_server_join *datagram = (request_server_join *)malloc(sizeof(request_server_join));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_server_join));
-
-                        // Defer action to topology.
-                        topology->s2s_join_recv(topology, serverAddr, &(datagram->address), datagram->req_channel);
+void on_backend_ready(const Reactor *, int, unsigned, void *context) {
+    /* Drains every datagram the backend has waiting, then flushes. */
+    struct loop_state *state = (struct loop_state *)context;
+    const IOBackend *io = state->io;
 
-                        // Cleanup.
-                        free(datagram);
-                        break;
-                    }
-                    //           //
-                    // S2S LEAVE //
-                    //           //
-                    case S2S_LEAVE: {
-                        // Decipher the request.
-                        request_server_leave *datagram = (request_server_leave *)malloc(sizeof(request_server_leave));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_server_leave));
-
-                        // Defer action to topology.
-                        topology->s2s_leave_recv(topology, serverAddr, &(datagram->address), datagram->req_channel);
+    for (int handled = 0; ; handled++) {
+        // Control traffic jumps the queue, however deep the data backlog is.
+        if ((controlBackend != NULL) && ((handled % CONTROL_PLANE_INTERVAL) == 0))
+            while (receive_datagram(controlBackend, state));
+        if (!receive_datagram(io, state)) break;
+    }
 
-                        // Cleanup.
-                        free(datagram);
-                        break;
-                    }
-                    //         //
-                    // S2S SAY //
-                    //         //
-                    case S2S_SAY: {
-                        // Decipher the request.
-                        request_server_say *datagram = (request_server_say *)malloc(sizeof(request_server_say));
-                        if (datagram == NULL) {fprintf(stderr, "Out of memory"); break;}
-                        memcpy((void *)datagram, (const void *)buffer, sizeof(request_server_say));
-
-                        // Defer action to topology.
-                        bool success = topology->s2s_say_recv(topology, serverAddr, &(datagram->address),
-                                               datagram->id, datagram->txt_username, 
-                                               datagram->txt_channel, datagram->txt_text);
-
-                        // If this message was new, send it out to all users.
-                        if (success) {
-                            // Make our datagram.
-                            text_say *say_response = (text_say *)malloc(sizeof(text_say));
-                            if (say_response == NULL) {fprintf(stderr, "Out of memory"); break;}
-                            memset(say_response, '\0', sizeof(text_say));
-    
-                            // Popualte the datagram.
-                            say_response->txt_type = TXT_SAY;
-                            memcpy(say_response->txt_channel, datagram->txt_channel, CHANNEL_MAX);
-                            memcpy(say_response->txt_username, datagram->txt_username, USERNAME_MAX);
-                            memcpy(say_response->txt_text, datagram->txt_text, SAY_MAX);
-    
-                            // Package it up
-                            response = (void *)say_response;
-                            response_size = sizeof(request_say);
-                            send = true;
-    
-                            // This will be sent out to all channels.
-                            struct Channel *channel = get_channel(datagram->txt_channel, false);
-                            if (channel != NULL) {
-                                struct UserRef *channelUsers = get_users_in_channel(channel);
-                                if (channelUsers != NULL) {
-                                    struct UserRef *startList = channelUsers;
-                                    // Iterate over all users and add them to the list.
-                                    while (channelUsers != NULL) {
-                                        // Add their address.
-                                        add_address_to_list(addressList, channelUsers->_this->address);
-                                        // Next one
-                                        channelUsers = channelUsers->_next;
-                                    }
-                                    // Cleanup.
-                                    free_user_ref(startList);
-                                }
-                            } else {
-                                printf("User %s tried to send a message into a non-existent channel.\n", datagram->txt_username);
-                                error_datagram("Channel does not exist.");
-                            }
-                            fflush(stdout);
-                        }
+    // Push out everything this batch queued.
+    flush_backends();
+    topology->flush(topology);
+}
 
-                        // Cleanup.
-                        free(datagram);
-                        break;
-                    }
-                    //                       //
-                    // COOL AND AWESOME HACK //
-                    //                       //
-                    case REQ_BAD:
-                        // Ignore this request :P
-                        break;
-
-                    //                 //
-                    // UNKNOWN REQUEST //
-                    //                 //
-                    default:
-                        printf("Received undefined request, ignoring\n");
-                        break;
-                }
-                // See if we're sending something back to clients.
-                if (send) {
-                    // Send a response back to all users in the address list.
-                    while (addressList->_this != NULL) {
-                        // Send the datagram to this address.
-                        struct sockaddr_in *address = addressList->_this;
-                        int result = sendto(
-                            openSocket, response, response_size, MSG_DONTWAIT,
-                            (struct sockaddr *)address, sizeof(struct sockaddr_in)
-                        );
-                        if (result == -1) {
-                            // Something went wrong with sending this.
-                            fprintf(stderr, "Response to client failed to send. (%d)\n", result);
-                        }
+void on_renew_timer(const Reactor *, int fd, unsigned, void *) {
+    /*
+     * Renews the topology and expires quiet users from the event loop.
+     * This used to run in a SIGALRM handler, which could free routing
+     * entries out from under the datagram it interrupted.
+     */
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    topology_renew();
+    expire_users();
+    flush_backends();
+}
 
-                        // Move to the next address.
-                        if (addressList->_next == NULL) break;
-                        addressList = addressList->_next;
-                    }
-                }
+void on_topology_timer(const Reactor *, int, unsigned, void *) {
+    /* Heartbeats are due, or some server is late acking a join or leave. */
+    topology->run_timers(topology, serverAddress, channelList);
+    flush_backends();
+}
 
-                // Cleanup.
-                free_address_list(addressList);
-                free(requestType);
-                if (response != NULL) free(response);
-            }
-        }
-        if (fds[1].revents & POLLIN) {
-            // If we get user input, break the loop if we have no topology.
-            if (topology->get_size(topology) == 0) break;
-        }
+void on_egress_ready(const Reactor *, int, unsigned, void *) {
+    /* A neighbor's socket has room again for the says queued behind it. */
+    topology->egress_ready(topology);
+    flush_backends();
+}
+
+void on_stop_signal(const Reactor *rc, int fd, unsigned, void *) {
+    /* SIGTERM or SIGINT: leave the loop, so we can say goodbye to our neighbors. */
+    struct signalfd_siginfo info;
+    if (read(fd, &info, sizeof(info)) != sizeof(info)) return;
+    printf("Caught signal %u, shutting down.\n", info.ssi_signo);
+    rc->stop(rc);
+}
+
+void on_scheduler_ready(const Reactor *, int, unsigned, void *) {
+    /* Sends the next round of queued fan-outs, then goes back to reading. */
+    scheduler->run(scheduler, SCHEDULER_BUDGET);
+    flush_backends();
+}
+
+bool admin_command(char *command) {
+    /*
+     * Carries out one line of input if it's a command: "add <host> <port>"
+     * or "remove <host> <port>" changes our neighbors, "neighbors" reports on them.
+     */
+    char verb[16], hostname[256], port[16];
+    int fields = sscanf(command, "%15s %255s %15s", verb, hostname, port);
+    if ((fields == 1) && (strcmp(verb, "neighbors") == 0)) {
+        topology->report(topology);
+        return true;
+    }
+    if (fields != 3) return false;
+
+    if (strcmp(verb, "add") == 0) {
+        int serverSocket = create_socket();
+        if (serverSocket < 0) fprintf(stderr, "Topolgy socket make failed.\n");
+        else if (!topology->add_neighbor(topology, serverAddress, serverSocket, hostname, port)) close(serverSocket);
+        flush_backends();
+        return true;
+    }
+    if (strcmp(verb, "remove") == 0) {
+        topology->remove_neighbor(topology, serverAddress, hostname, port);
+        flush_backends();
+        return true;
+    }
+    return false;
+}
+
+void on_stdin_ready(const Reactor *rc, int fd, unsigned, void *) {
+    /* Carries out commands; any other input terminates the server, as long as we have no topology and no gossip. */
+    char line[BUFFER_SIZE];
+    ssize_t result = read(fd, line, sizeof(line) - 1);
+    bool commanded = false;
+    if (result > 0) {
+        line[result] = '\0';
+        for (char *command = strtok(line, "\n"); command != NULL; command = strtok(NULL, "\n"))
+            if (admin_command(command)) commanded = true;
+    }
+
+    if ((topology->get_size(topology) == 0) && !gossip && !commanded) rc->stop(rc);
+    else if (result <= 0)
+        // Standard input is gone; stop watching it.
+        rc->remove(rc, fd);
+}
+
+void event_loop(struct sockaddr_in *serverAddr) {
+    // Notify
+    printf("Initializing event loop...\n");
+    for (int i = 0; i < backendCount; i++)
+        printf("Using the %s I/O backend.\n", backends[i]->get_name(backends[i]));
+    if (busyPoll != NULL) printf("Busy polling after each wakeup.\n");
+    if (controlBackend != NULL) printf("Handling control traffic ahead of says.\n");
+    printf("Press enter to terminate process.\n");
+    printf("Enter \"add <host> <port>\" or \"remove <host> <port>\" to change neighbors.\n");
+    fflush(stdout);
+
+    // Get some consts defined.
+    const int poll_timeout = -1;    // poll timeout, block until something happens
+
+    // Various setup; the backends share one receive buffer.
+    char *buffer = (char *)malloc(sizeof(char) * (BUFFER_SIZE + 1));
+    struct sockaddr_in *address = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
+    struct loop_state states[MAX_BACKENDS];
+    struct loop_state controlState = {controlBackend, serverAddr, buffer, address};
+
+    // Register our event sources: the I/O backends and standard input.
+    const Reactor *reactor = Reactor_create();
+    if (reactor == NULL) exit(1);
+    for (int i = 0; i < backendCount; i++) {
+        states[i].io = backends[i];
+        states[i].serverAddr = serverAddr;
+        states[i].buffer = buffer;
+        states[i].address = address;
+        reactor->add(reactor, backends[i]->get_fd(backends[i]), REACTOR_READ | REACTOR_EDGE, on_backend_ready, &(states[i]));
     }
+    if (controlBackend != NULL)
+        reactor->add(reactor, controlBackend->get_fd(controlBackend), REACTOR_READ | REACTOR_EDGE, on_backend_ready, &controlState);
+    if (scheduler != NULL) reactor->add(reactor, scheduler->get_fd(scheduler), REACTOR_READ, on_scheduler_ready, NULL);
+    reactor->add(reactor, STDIN_FILENO, REACTOR_READ, on_stdin_ready, NULL);
+    if ((busyPoll != NULL) && !pipelined) busyPoll->attach(busyPoll, reactor);
+
+    // Prepare keep-alive.
+    int renewTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec tick = {{TOPOLOGY_TICK, 0}, {TOPOLOGY_TICK, 0}};
+    if ((renewTimer < 0) || (timerfd_settime(renewTimer, 0, &tick, NULL) < 0)) {
+        fprintf(stderr, "Could not create the renewal timer. (%d)\n", errno);
+        exit(1);
+    }
+    reactor->add(reactor, renewTimer, REACTOR_READ, on_renew_timer, NULL);
+    if (topology->get_timer_fd(topology) >= 0)
+        reactor->add(reactor, topology->get_timer_fd(topology), REACTOR_READ, on_topology_timer, NULL);
+    if (topology->get_egress_fd(topology) >= 0)
+        reactor->add(reactor, topology->get_egress_fd(topology), REACTOR_READ, on_egress_ready, NULL);
+
+    // Stop cleanly when killed; main() blocked these before starting any threads.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    int stopSignal = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (stopSignal >= 0) reactor->add(reactor, stopSignal, REACTOR_READ, on_stop_signal, NULL);
+    else fprintf(stderr, "Could not watch for stop signals. (%d)\n", errno);
+
+    // Start the loop.
+    reactor->run(reactor, poll_timeout);
 
     // Post-loop cleanup.
+    reactor->cleanup(reactor);
+    close(renewTimer);
+    if (stopSignal >= 0) close(stopSignal);
     free((void *)buffer);
     free((void *)address);
 }
 
+/*
+ *  Options
+ */
+
+static const char *ioBackendName = "poll";
+static bool s2sOffload = false;
+static bool rendezvous = false;    // joins go to each channel's home server, not everywhere
+static double s2sLoss = 0;    // percent of S2S datagrams to drop, for testing
+static double s2sDelay = 0;    // milliseconds to hold S2S datagrams, for testing
+static double s2sRate = 0;    // kilobytes per second of says to each neighbor, 0 doesn't pace
+static int busyPollBudget = 0;    // microseconds, 0 blocks right away
+static const char *unixPath = NULL;
+static const char *shmPath = NULL;
+static int egressThreads = 0;    // 0 runs every stage on the main thread
+static int fanoutThreads = 0;    // 0 sends every broadcast inline
+static int drrQuantum = 0;    // recipients per turn, 0 sends every fan-out whole
+static double userRate = 0;    // tokens per second per user, 0 doesn't limit
+static double serverCapacity = RATE_LIMIT_DEFAULT_CAPACITY;    // tokens per second over every user
+static int controlBudget = 0;    // kilobytes of receive buffer for control traffic, 0 shares the data socket
+
+int parse_options(int argc, char *argv[]) {
+    /*
+     * Pulls --name=value options out of argv.
+     * Returns the number of positional arguments left behind.
+     */
+    int positional = 0;
+    for (int i = 0; i < argc; i++) {
+        char *arg = argv[i];
+        if ((i == 0) || (strncmp(arg, "--", 2) != 0)) {
+            // Not an option, keep it in place.
+            argv[positional] = arg;
+            positional += 1;
+        } else if (strncmp(arg, "--io=", 5) == 0) {
+            ioBackendName = arg + 5;
+        } else if (strcmp(arg, "--s2s-offload") == 0) {
+            s2sOffload = true;
+        } else if (strcmp(arg, "--rendezvous") == 0) {
+            rendezvous = true;
+        } else if (strcmp(arg, "--gossip") == 0) {
+            gossip = true;
+        } else if (strncmp(arg, "--s2s-loss=", 11) == 0) {
+            s2sLoss = atof(arg + 11);
+        } else if (strncmp(arg, "--s2s-delay=", 12) == 0) {
+            s2sDelay = atof(arg + 12);
+        } else if (strncmp(arg, "--s2s-rate=", 11) == 0) {
+            s2sRate = atof(arg + 11);
+        } else if (strcmp(arg, "--busy-poll") == 0) {
+            busyPollBudget = BUSY_POLL_DEFAULT_BUDGET;
+        } else if (strncmp(arg, "--busy-poll=", 12) == 0) {
+            busyPollBudget = atoi(arg + 12);
+        } else if (strncmp(arg, "--unix=", 7) == 0) {
+            unixPath = arg + 7;
+        } else if (strncmp(arg, "--shm=", 6) == 0) {
+            shmPath = arg + 6;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            egressThreads = 1;
+        } else if (strncmp(arg, "--pipeline=", 11) == 0) {
+            egressThreads = atoi(arg + 11);
+        } else if (strcmp(arg, "--drr") == 0) {
+            drrQuantum = SCHEDULER_DEFAULT_QUANTUM;
+        } else if (strncmp(arg, "--drr=", 6) == 0) {
+            drrQuantum = atoi(arg + 6);
+        } else if (strcmp(arg, "--rate-limit") == 0) {
+            userRate = RATE_LIMIT_DEFAULT_RATE;
+        } else if (strncmp(arg, "--rate-limit=", 13) == 0) {
+            userRate = atof(arg + 13);
+        } else if (strncmp(arg, "--capacity=", 11) == 0) {
+            serverCapacity = atof(arg + 11);
+        } else if (strcmp(arg, "--control-plane") == 0) {
+            controlBudget = CONTROL_PLANE_DEFAULT_BUDGET;
+        } else if (strncmp(arg, "--control-plane=", 16) == 0) {
+            controlBudget = atoi(arg + 16);
+        } else if (strncmp(arg, "--fanout=", 9) == 0) {
+            fanoutThreads = atoi(arg + 9);
+        } else if (strncmp(arg, "--fanout-threshold=", 19) == 0) {
+            fanoutThreshold = atoi(arg + 19);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            exit(1);
+        }
+    }
+    return positional;
+}
+
+const IOBackend *create_io_backend(int openSocket) {
+    /* Creates the requested I/O backend, falling back to poll. */
+    if (strcmp(ioBackendName, "uring") == 0) {
+        const IOBackend *io = IOBackend_create_uring(openSocket);
+        if (io != NULL) return io;
+        fprintf(stderr, "Falling back to the poll I/O backend.\n");
+    } else if (strcmp(ioBackendName, "poll") != 0) {
+        fprintf(stderr, "Unknown I/O backend %s, using poll.\n", ioBackendName);
+    }
+    return IOBackend_create_poll(openSocket);
+}
+
 /*
  *  Main
  */
 
 int main(int argc, char *argv[]) {
     // Validate arguments.
+    argc = parse_options(argc, argv);
     if ((argc < 3) || !(argc % 2)) {
-        fprintf(stderr, "Usage: %s <hostname> <port> optional: <hostnameA> <portA>, <hostnameB> <portB>, etc\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--io=poll|uring] [--s2s-offload] [--rendezvous] [--gossip] [--s2s-loss=percent] [--s2s-delay=ms] [--s2s-rate=KB/s] [--busy-poll[=usec]] [--unix=path] [--shm=path] [--pipeline[=threads]] [--fanout=threads] [--fanout-threshold=members] [--drr[=quantum]] [--control-plane[=kbytes]] [--rate-limit[=tokens/s]] [--capacity=tokens/s] <hostname> <port> optional: <hostnameA> <portA>, <hostnameB> <portB>, etc\n", argv[0]);
         exit(1);
     }
     char *hostname = argv[1];
@@ -626,6 +1016,10 @@ int main(int argc, char *argv[]) {
     serverAddress = &serverAddr;
 
     // Bind the address to the socket.
+    if ((controlBudget > 0) && !control_plane_prepare(openSocket)) {
+        fprintf(stderr, "SO_REUSEPORT unavailable, control traffic shares the data socket.\n");
+        controlBudget = 0;
+    }
     int result = bind(openSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
 
     if (result < 0) {
@@ -636,13 +1030,45 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Control traffic gets a socket of its own on the same port.
+    int controlSocket = -1;
+    if (controlBudget > 0) {
+        controlSocket = control_plane_open(&serverAddr, controlBudget * 1024);
+        if (controlSocket >= 0) {
+            controlBackend = IOBackend_create_poll(controlSocket);
+            printf("Control traffic has its own socket and %dKB of buffer.\n", controlBudget);
+        } else {
+            fprintf(stderr, "Control traffic shares the data socket.\n");
+
+            // Rebind without SO_REUSEPORT, or anyone under our uid could join the port.
+            close(openSocket);
+            openSocket = create_socket();
+            if ((openSocket < 0) || (bind(openSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0)) {
+                printf("%d %s\n", errno, strerror(errno));
+                fprintf(stderr, "Socket bind failed.\n");
+                exit(1);
+            }
+        }
+    }
+
     // Bind the server topology.
     topology = Topology_create();
+    if (gossip) topology->set_gossip(topology, serverAddress);
     for (int i = 3; i < (argc - 1); i += 2) {
         // Get our arguments.
         char *server_hostname = argv[i];
         char *server_port = argv[i + 1];
 
+        // With gossip, they're only where we start looking.
+        if (gossip) {
+            if (!topology->add_seed(topology, server_hostname, server_port)) {
+                topology->cleanup(topology);
+                close(openSocket);
+                exit(1);
+            }
+            continue;
+        }
+
         // Attempt to open socket.
         int serverSocket = create_socket();
         if (serverSocket < 0) {
@@ -668,16 +1094,129 @@ int main(int argc, char *argv[]) {
     initialize_channels();
     initialize_users();
 
+    // Stop signals are read from the event loop; every thread started from here on inherits the mask.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    sigprocmask(SIG_BLOCK, &stopSignals, NULL);
+
     // Begin the event loop.
-    event_loop(openSocket, &serverAddr);
+    const IOBackend *io = create_io_backend(openSocket);
+    backends[backendCount++] = io;
+    int unixSocket = -1;
+    if (unixPath != NULL) {
+        // Local clients can skip the UDP/IP stack entirely.
+        unixSocket = create_unix_socket(unixPath);
+        if (unixSocket < 0) {
+            fprintf(stderr, "Unix socket bind failed.\n");
+            exit(1);
+        }
+        backends[backendCount++] = IOBackend_create_unix(unixSocket);
+    }
+    if (shmPath != NULL) {
+        // Gateway processes on this host attach to a shared ring pair.
+        const IOBackend *shm = IOBackend_create_shm(shmPath);
+        if (shm == NULL) exit(1);
+        backends[backendCount++] = shm;
+    }
+    if (rendezvous) {
+        // Every server in the mesh has to be started this way.
+        topology->set_rendezvous(topology, true);
+    }
+    if (s2sLoss > 0) {
+        // Pretend the links to our neighbors are lossy.
+        topology->set_loss(topology, s2sLoss / 100);
+        printf("Dropping %.1f%% of S2S datagrams.\n", s2sLoss);
+    }
+    if (s2sDelay > 0) {
+        // Pretend the links to our neighbors are long.
+        topology->set_delay(topology, s2sDelay / 1000);
+        printf("Holding S2S datagrams %.1fms.\n", s2sDelay);
+    }
+    if (s2sRate > 0) {
+        // Meter says out to each neighbor instead of bursting them.
+        topology->set_pacing(topology, s2sRate * 1024);
+        printf("Pacing says to %.1fKB/s per neighbor.\n", s2sRate);
+    }
+    if (s2sOffload) {
+        // Neighbors get batched say bursts; we take theirs coalesced.
+        topology->set_segment_offload(topology, true);
+        if (!io->enable_gro(io))
+            fprintf(stderr, "UDP GRO unavailable on the %s backend, receiving bursts segmented.\n", io->get_name(io));
+    }
+    if (busyPollBudget > 0) {
+        // Spend a core on latency instead of sleeping between datagrams.
+        busyPoll = BusyPoll_create(busyPollBudget);
+        if (!busyPoll->enable_socket(busyPoll, openSocket))
+            fprintf(stderr, "SO_BUSY_POLL unavailable, spinning in the event loop only.\n");
+    }
+    if (egressThreads > 0) {
+        // Receive, handle and send on separate threads.
+        const IOBackend *pipeline = IOBackend_create_pipeline(backends, backendCount, egressThreads, busyPoll);
+        if (pipeline != NULL) {
+            printf("Pipelining I/O over %d egress thread(s).\n", egressThreads);
+            backends[0] = pipeline;
+            backendCount = 1;
+            pipelined = true;
+        } else {
+            fprintf(stderr, "Running every stage on the main thread.\n");
+        }
+    }
+    if (fanoutThreads > 0) {
+        // Huge channels get sent to by a pool of workers.
+        const IOBackend *splittable[MAX_BACKENDS];
+        int splittableCount = 0;
+        for (int i = 0; i < backendCount; i++)
+            if (backends[i]->can_split(backends[i])) splittable[splittableCount++] = backends[i];
+        if (fanoutThreshold <= 0) fanoutThreshold = FANOUT_DEFAULT_THRESHOLD;
+        fanoutPool = FanoutPool_create(splittable, splittableCount, fanoutThreads);
+        if (fanoutPool != NULL)
+            printf("Channels of %d or more get sent to by %d fan-out thread(s).\n", fanoutThreshold, fanoutThreads);
+        else
+            fprintf(stderr, "No backend to fan out through, sending every broadcast inline.\n");
+    }
+    if (userRate > 0) {
+        // Users pay for what they ask of us; past capacity, queries and heavy senders go first.
+        rateLimiter = RateLimiter_create(userRate, serverCapacity);
+        printf("Limiting users to %.0f tokens/s, %.0f tokens/s in all.\n", userRate, serverCapacity);
+    }
+    if (drrQuantum > 0) {
+        // Fan-outs take turns by channel instead of going out whole.
+        scheduler = Scheduler_create(drrQuantum, deliver_datagram);
+        printf("Scheduling fan-outs round-robin, %d recipients a turn.\n", drrQuantum);
+    }
+    event_loop(&serverAddr);
 
-    // Cleanup.
-    printf("Cleaning up channels...\n");
-    cleanup_channels();
+    // Say goodbye first, so nobody keeps routing to us.
+    printf("Leaving the mesh...\n");
+    topology->shutdown(topology, serverAddress, channelList);
+    flush_backends();
+
+    // Cleanup; users first, since they point at channels.
     printf("Cleaning up users...\n");
     cleanup_users();
+    printf("Cleaning up channels...\n");
+    cleanup_channels();
+    if (scheduler != NULL) {
+        scheduler->cleanup(scheduler);
+        flush_backends();
+    }
+    if (fanoutPool != NULL) fanoutPool->cleanup(fanoutPool);
+    if (rateLimiter != NULL) rateLimiter->cleanup(rateLimiter);
     printf("Cleaning up socket...\n");
+    for (int i = 0; i < backendCount; i++)
+        backends[i]->cleanup(backends[i]);
     close(openSocket);
+    if (controlBackend != NULL) {
+        controlBackend->cleanup(controlBackend);
+        close(controlSocket);
+    }
+    if (unixSocket >= 0) {
+        close(unixSocket);
+        unlink(unixPath);
+    }
+    if (busyPoll != NULL) busyPoll->cleanup(busyPoll);
     printf("Cleaning up topology...\n");
     topology->cleanup(topology);
     printf("Goodbye!\n");
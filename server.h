@@ -21,10 +21,23 @@ struct ChannelRef {
 };
 struct Channel *get_channel(char name[CHANNEL_MAX], bool create);
 void cleanup_channel(struct Channel *channel);
+struct ChannelRef *get_channel_list();
+void release_channel(struct Channel *channel);    // our last user left it; see server.c
 bool cmpaddress(sockaddr_in addressA, sockaddr_in addressB) {
-    // Compares two addresses.
+    // Compares two addresses. A local stand-in never equals a network address,
+    // whatever its fields hold; other families aren't compared, as mesh peers
+    // may leave sin_family unset.
+    if ((addressA.sin_family == AF_UNIX) != (addressB.sin_family == AF_UNIX)) return false;
     return ((addressA.sin_port == addressB.sin_port) && (addressA.sin_addr.s_addr == addressB.sin_addr.s_addr));
 }
+bool is_local_address(struct sockaddr_in *address) {
+    // Users on a same-host transport carry a stand-in address (see unixbackend.h).
+    return address->sin_family == AF_UNIX;
+}
+bool has_local_tag(struct sockaddr_in *address, int tag) {
+    // Stand-ins for one particular local transport.
+    return is_local_address(address) && (address->sin_addr.s_addr == htonl(tag));
+}
 
 #include "topology.h"
 
@@ -57,6 +70,12 @@ struct User {
     char *username;
     time_t expiresAt;
     struct ChannelRef *channels = NULL;
+
+    // rate limiting: the user's token bucket, when they were last told to slow down
+    // (monotonic seconds, 0 never), and what they asked for this window and last
+    double tokens, tokensAt, noticeAt;
+    long window;
+    double spent, lastSpent;
 };
 
 /*
@@ -98,6 +117,15 @@ bool add_address_to_list(struct AddressRef *addressRef, struct sockaddr_in *addr
     return true;
 }
 
+struct AddressRef *append_address_to_list(struct AddressRef *tailRef, struct sockaddr_in *address) {
+    /*
+     * Adds an address after the last ref of a list without walking it.
+     * Returns the new last ref.
+     */
+    add_address_to_list(tailRef, address);
+    return (tailRef->_next != NULL) ? tailRef->_next : tailRef;
+}
+
 void free_address_list(struct AddressRef *addressRef) {
     /* Frees an address reference linked list. */
     while (addressRef != NULL) {
@@ -135,6 +163,9 @@ bool create_user(struct sockaddr_in address, char *name) {
     newUser->username = (char *)malloc(sizeof(char) * USERNAME_MAX);
     strcpy(newUser->username, name);
     newUser->channels = channelRef;
+    newUser->tokens = newUser->tokensAt = newUser->noticeAt = 0;
+    newUser->window = 0;
+    newUser->spent = newUser->lastSpent = 0;
 
     // Put the user in the user list.
     struct UserRef *userRef = userList;
@@ -225,8 +256,8 @@ bool remove_user(struct sockaddr_in address) {
                     userList->_this = NULL;
                 } else {
                     // The user list is gonna be replaced with the next user list.
-                    free(userList);
-                    userList = userRef;
+                    userList = userRef->_next;
+                    free(userRef);
                 }
             } else {
                 // The non-first element is used.
@@ -234,6 +265,7 @@ bool remove_user(struct sockaddr_in address) {
                 lastRef->_next = userRef->_next;
                 free(userRef);
             }
+            return true;
         } else {
             // Check the next one.
             lastRef = userRef;
@@ -366,12 +398,14 @@ struct Channel *get_channel(char name[CHANNEL_MAX], bool create) {
 }
 
 struct Channel *get_initial_channel() {
-    if (channelList == NULL) {
-        char *channelName = (char *)malloc(sizeof(char) * CHANNEL_MAX);
-        strcpy(channelName, "Common");
-        get_channel(channelName, true);
-    }
-    return channelList->_this;
+    // Common may have emptied out and gone away since; it isn't always first.
+    char channelName[CHANNEL_MAX] = "Common";
+    return get_channel(channelName, true);
+}
+
+struct ChannelRef *get_channel_list() {
+    // The list as it is now; its head moves whenever the first channel goes.
+    return channelList;
 }
 
 int get_channel_count() {
@@ -573,23 +607,24 @@ void remove_user_from_channel(struct User *user, struct Channel *channel) {
                 // Looks like we have found the necessary channel.
                 // We will need to scrub this channel.
                 if ((lastRef == NULL) && (channelRef->_next == NULL)) {
-                    // We removed the only channel we were in. Ok!
+                    // We removed the only channel we were in. Ok! The empty ref stays.
                     channelRef->_this = NULL;
-                    return;
-                } else if (lastRef == NULL) {
-                    // We were in 2+ channels, but we removed the first one.
-                    user->channels = channelRef->_next;
                 } else {
-                    // We were in 2+ channels, and we did not remove the first.
-                    lastRef->_next = channelRef->_next;
+                    if (lastRef == NULL) {
+                        // We were in 2+ channels, but we removed the first one.
+                        user->channels = channelRef->_next;
+                    } else {
+                        // We were in 2+ channels, and we did not remove the first.
+                        lastRef->_next = channelRef->_next;
+                    }
+
+                    // cleanup !!
+                    free((void *)channelRef);
                 }
 
-                // cleanup !!
-                free((void *)channelRef);
-
-                // remove one user from this channel, cleanup if necessary
+                // remove one user from this channel, and let it go if that was the last
                 channel->userCount = channel->userCount - 1;
-                if ((channel->userCount) <= 0) cleanup_channel(channel);
+                if ((channel->userCount) <= 0) release_channel(channel);
                 return;
             }
 
@@ -0,0 +1,51 @@
+#ifndef _SHAREDBUFFER_H_
+#define _SHAREDBUFFER_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Shared buffer
+ *
+ * A reference-counted datagram. Whatever holds on to a datagram past the
+ * call that handed it over (the scheduler, fan-out workers, the pipeline)
+ * retains the buffer instead of copying it, and the last release frees
+ * it. Counts are atomic, since releases can come from worker threads.
+ */
+
+struct shared_buffer {
+    int refs;
+    int size;
+    char data[];
+};
+
+struct shared_buffer *shared_buffer_create(int size) {
+    /* Allocates a zeroed buffer of size bytes, held once by the caller. */
+    struct shared_buffer *buffer = (struct shared_buffer *)malloc(sizeof(struct shared_buffer) + size);
+    if (buffer == NULL) {fprintf(stderr, "Out of memory"); return NULL;}
+    memset(buffer->data, 0, size);
+    buffer->refs = 1;
+    buffer->size = size;
+    return buffer;
+}
+
+struct shared_buffer *shared_buffer_copy(const void *data, int size) {
+    /* Allocates a buffer holding a copy of data. */
+    struct shared_buffer *buffer = shared_buffer_create(size);
+    if (buffer != NULL) memcpy(buffer->data, data, size);
+    return buffer;
+}
+
+struct shared_buffer *shared_buffer_retain(struct shared_buffer *buffer) {
+    __atomic_add_fetch(&(buffer->refs), 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+void shared_buffer_release(struct shared_buffer *buffer) {
+    if (buffer == NULL) return;
+    if (__atomic_sub_fetch(&(buffer->refs), 1, __ATOMIC_ACQ_REL) == 0) free(buffer);
+}
+
+#endif /* _SHAREDBUFFER_H_ */
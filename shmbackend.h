@@ -0,0 +1,307 @@
+#ifndef _SHMBACKEND_H_
+#define _SHMBACKEND_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "server.h"
+#include "utils.h"
+#include "iobackend.h"
+#include "reactor.h"
+#include "shmring.h"
+
+/*
+ * Shared-memory backend -- a ring pair shared with one gateway process.
+ *
+ * Gateway clients get stand-in addresses like unix peers do, tagged
+ * LOCAL_TAG_SHM, with the gateway's client number in sin_port. A fan-out
+ * is copied into the ring once per SHM_RING_MAX_RECIPIENTS gateway users
+ * and published to the gateway in one go at flush().
+ *
+ * The doorbell, the bell listener and the gateway's bell connection sit in
+ * a reactor of our own; its epoll fd is what the server's loop waits on.
+ */
+
+typedef struct shmbackenddata {
+    struct shm_region *shm;
+    char *path;
+
+    // doorbells and the gateway's connection
+    const Reactor *reactor;
+    int listener, connection;
+    int toServerBell, toGatewayBell;
+    bool attached;
+
+    // ring positions
+    uint32_t head;           // toServer, consumed
+    uint32_t tail;           // toGateway, filled but maybe not published
+    uint32_t publishedTail;
+    struct shm_slot *slot;   // toGateway slot being filled
+    bool blocked;            // toGateway was full, drop the rest of this fan-out
+
+    // counters
+    long long received, sent, batches, doorbells, dropped;
+} ShmBackendData;
+
+static void shm_backend_detach(ShmBackendData *sbd) {
+    /* Forgets the gateway; its users will time out like anyone else. */
+    if (!(sbd->attached)) return;
+    sbd->reactor->remove(sbd->reactor, sbd->connection);
+    close(sbd->connection);
+    sbd->connection = -1;
+    sbd->attached = false;
+    printf("Gateway detached after %lld requests in, %lld datagrams out in %lld batches (%lld doorbells, %lld dropped).\n",
+           sbd->received, sbd->sent, sbd->batches, sbd->doorbells, sbd->dropped);
+    fflush(stdout);
+}
+
+static void shm_backend_on_connection(const Reactor *, int, unsigned, void *context) {
+    /* The gateway only ever closes its bell connection. */
+    ShmBackendData *sbd = (ShmBackendData *)context;
+    char byte;
+    if (recv(sbd->connection, &byte, 1, MSG_DONTWAIT) == 0) shm_backend_detach(sbd);
+}
+
+static void shm_backend_on_listener(const Reactor *rc, int, unsigned, void *context) {
+    /* Attaches a gateway: fresh rings, then its doorbells. */
+    ShmBackendData *sbd = (ShmBackendData *)context;
+    int connection = accept(sbd->listener, NULL, NULL);
+    if (connection < 0) return;
+    if (sbd->attached) {
+        // A ring pair has exactly one producer and consumer each way.
+        fprintf(stderr, "A gateway is already attached, turning another away.\n");
+        close(connection);
+        return;
+    }
+
+    shm_ring_reset(&(sbd->shm->toServer));
+    shm_ring_reset(&(sbd->shm->toGateway));
+    sbd->shm->generation += 1;
+    sbd->head = 0;
+    sbd->tail = 0;
+    sbd->publishedTail = 0;
+    sbd->slot = NULL;
+    shm_doorbell_clear(sbd->toServerBell);
+    shm_doorbell_clear(sbd->toGatewayBell);
+
+    if (!shm_send_bells(connection, sbd->toServerBell, sbd->toGatewayBell)) {
+        fprintf(stderr, "Could not hand the gateway its doorbells.\n");
+        close(connection);
+        return;
+    }
+    sbd->connection = connection;
+    sbd->attached = true;
+    sbd->received = sbd->sent = sbd->batches = sbd->doorbells = sbd->dropped = 0;
+    rc->add(rc, connection, REACTOR_READ, shm_backend_on_connection, sbd);
+    printf("Gateway attached.\n");
+    fflush(stdout);
+}
+
+static void shm_backend_on_doorbell(const Reactor *, int, unsigned, void *context) {
+    /* The ring gets drained by recv; just reset the bell. */
+    ShmBackendData *sbd = (ShmBackendData *)context;
+    shm_doorbell_clear(sbd->toServerBell);
+}
+
+static void shm_backend_cleanup(const IOBackend *io) {
+    ShmBackendData *sbd = (ShmBackendData *)(io->self);
+    sbd->reactor->cleanup(sbd->reactor);
+    if (sbd->connection >= 0) close(sbd->connection);
+    close(sbd->listener);
+    close(sbd->toServerBell);
+    close(sbd->toGatewayBell);
+    shm_region_unmap(sbd->shm);
+
+    // Take the files with us.
+    char bellPath[UNIX_PATH_MAX];
+    shm_bell_path(bellPath, sbd->path);
+    unlink(bellPath);
+    unlink(sbd->path);
+    free(sbd->path);
+    free(io->self);
+    free((void *)io);
+}
+
+static const char *shm_backend_get_name(const IOBackend *) {
+    return "shm";
+}
+
+static int shm_backend_get_fd(const IOBackend *io) {
+    ShmBackendData *sbd = (ShmBackendData *)(io->self);
+    return sbd->reactor->get_fd(sbd->reactor);
+}
+
+static int shm_backend_recv(const IOBackend *io, char *buffer, int size, struct sockaddr_in *address) {
+    /* Takes one request off the gateway's ring. */
+    ShmBackendData *sbd = (ShmBackendData *)(io->self);
+    while (1) {
+        struct shm_slot *slot = NULL;
+        if (sbd->attached) slot = shm_ring_peek(&(sbd->shm->toServer), sbd->head);
+        if (slot != NULL) {
+            int length = ((int)(slot->length) < size) ? (int)(slot->length) : size;
+            memcpy(buffer, slot->data, length);
+            memset(address, 0, sizeof(struct sockaddr_in));
+            address->sin_family = AF_UNIX;
+            address->sin_addr.s_addr = htonl(LOCAL_TAG_SHM);
+            address->sin_port = htons(slot->clients[0]);
+            sbd->head += 1;
+            shm_ring_release(&(sbd->shm->toServer), sbd->head);
+            sbd->received += 1;
+            return length;
+        }
+
+        // Handle attaches, hangups and the doorbell, then see if we can sleep.
+        sbd->reactor->poll_once(sbd->reactor, 0);
+        if (!(sbd->attached)) return 0;
+        if (shm_ring_sleep(&(sbd->shm->toServer), sbd->head)) return 0;
+    }
+}
+
+static void shm_backend_commit(ShmBackendData *sbd) {
+    /* Finishes the slot being filled. */
+    if (sbd->slot == NULL) return;
+    sbd->tail += 1;
+    sbd->slot = NULL;
+}
+
+static void shm_backend_publish(ShmBackendData *sbd) {
+    /* Publishes every finished slot, waking the gateway if it sleeps. */
+    if (sbd->tail == sbd->publishedTail) return;
+    sbd->batches += 1;
+    sbd->publishedTail = sbd->tail;
+    if (shm_ring_publish(&(sbd->shm->toGateway), sbd->tail)) {
+        sbd->doorbells += 1;
+        shm_doorbell_ring(sbd->toGatewayBell);
+    }
+}
+
+static bool shm_backend_send(const IOBackend *io, const void *datagram, int size, struct AddressRef *addressList) {
+    /* Copies the datagram into the ring once per batch of gateway users. */
+    ShmBackendData *sbd = (ShmBackendData *)(io->self);
+    if (!(sbd->attached)) return true;
+    if (size > SHM_RING_SLOT_DATA) return false;
+
+    sbd->slot = NULL;
+    sbd->blocked = false;
+    while ((addressList != NULL) && (addressList->_this != NULL)) {
+        struct sockaddr_in *address = addressList->_this;
+        addressList = addressList->_next;
+        if (!has_local_tag(address, LOCAL_TAG_SHM)) continue;
+        if (sbd->blocked) {
+            sbd->dropped += 1;
+            continue;
+        }
+
+        // Start a slot if we need one.
+        if (sbd->slot == NULL) {
+            sbd->slot = shm_ring_reserve(&(sbd->shm->toGateway), sbd->tail);
+            if (sbd->slot == NULL) {
+                // Full; hand over what we have and see if the gateway keeps up.
+                shm_backend_publish(sbd);
+                sbd->slot = shm_ring_reserve(&(sbd->shm->toGateway), sbd->tail);
+            }
+            if (sbd->slot == NULL) {
+                // The gateway is behind; like a full socket buffer, we drop.
+                sbd->blocked = true;
+                sbd->dropped += 1;
+                continue;
+            }
+            memcpy(sbd->slot->data, datagram, size);
+            sbd->slot->length = size;
+            sbd->slot->count = 0;
+        }
+
+        sbd->slot->clients[sbd->slot->count] = ntohs(address->sin_port);
+        sbd->slot->count += 1;
+        sbd->sent += 1;
+        if (sbd->slot->count == SHM_RING_MAX_RECIPIENTS) shm_backend_commit(sbd);
+    }
+    shm_backend_commit(sbd);
+    return !(sbd->blocked);
+}
+
+static void shm_backend_flush(const IOBackend *io) {
+    /* Publishes everything queued since the last flush in one go. */
+    ShmBackendData *sbd = (ShmBackendData *)(io->self);
+    if (sbd->attached) shm_backend_publish(sbd);
+}
+
+static bool shm_backend_enable_gro(const IOBackend *) {
+    // Nothing to coalesce; the ring already batches.
+    return false;
+}
+
+static void shm_backend_forget(const IOBackend *, struct sockaddr_in *) {
+    // The gateway numbers its own clients.
+    return;
+}
+
+static bool shm_backend_can_split(const IOBackend *) {
+    // recv resets the rings when a gateway attaches.
+    return false;
+}
+
+const IOBackend *IOBackend_create_shm(const char *path) {
+    /* Creates the ring file and bell socket at path, or returns NULL. */
+    char bellPath[UNIX_PATH_MAX];
+    if (strlen(path) + strlen(".bell") >= UNIX_PATH_MAX) {
+        fprintf(stderr, "Shared memory path is too long\n");
+        return NULL;
+    }
+    shm_bell_path(bellPath, path);
+
+    struct shm_region *shm = shm_region_map(path, true);
+    if (shm == NULL) {
+        fprintf(stderr, "Could not map %s. (%d)\n", path, errno);
+        return NULL;
+    }
+
+    // The bell listener gateways attach through.
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_un bellAddr;
+    memset(&bellAddr, 0, sizeof(bellAddr));
+    bellAddr.sun_family = AF_UNIX;
+    strcpy(bellAddr.sun_path, bellPath);
+    unlink(bellPath);
+    if ((listener < 0) || (bind(listener, (struct sockaddr *)&bellAddr, sizeof(bellAddr)) < 0) || (listen(listener, 4) < 0)) {
+        fprintf(stderr, "Could not listen on %s. (%d)\n", bellPath, errno);
+        if (listener >= 0) close(listener);
+        shm_region_unmap(shm);
+        unlink(path);
+        return NULL;
+    }
+
+    IOBackend *io = (IOBackend *)malloc(sizeof(IOBackend));
+    memset(io, 0, sizeof(IOBackend));
+
+    ShmBackendData *sbd = (ShmBackendData *)malloc(sizeof(ShmBackendData));
+    memset(sbd, 0, sizeof(ShmBackendData));
+    sbd->shm = shm;
+    sbd->path = strdup(path);
+    sbd->listener = listener;
+    sbd->connection = -1;
+    sbd->toServerBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    sbd->toGatewayBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    sbd->reactor = Reactor_create();
+    if (sbd->reactor == NULL) exit(1);
+    sbd->reactor->add(sbd->reactor, listener, REACTOR_READ, shm_backend_on_listener, sbd);
+    sbd->reactor->add(sbd->reactor, sbd->toServerBell, REACTOR_READ, shm_backend_on_doorbell, sbd);
+
+    *io = {NULL, shm_backend_cleanup, shm_backend_get_name, shm_backend_get_fd,
+           shm_backend_recv, shm_backend_send, shm_backend_flush, shm_backend_enable_gro,
+           shm_backend_forget, shm_backend_can_split};
+    io->self = (void *)sbd;
+    return io;
+}
+
+#endif /* _SHMBACKEND_H_ */
@@ -0,0 +1,223 @@
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "duckchat.h"
+
+/*
+ * Shared-memory ring pair
+ *
+ * A server and one gateway process share an mmap'd file holding two
+ * single-producer/single-consumer rings: gateway to server, and server to
+ * gateway. Slots carry the duckchat.h structs as-is, plus which of the
+ * gateway's clients they came from or go to.
+ *
+ * Nobody makes a syscall per message. A producer fills slots, then
+ * publishes them all with one store. It only rings the consumer's eventfd
+ * doorbell if the consumer said it was going to sleep.
+ *
+ * The eventfds can't be found through the file, so the server also listens
+ * on a unix stream socket at <path>.bell and hands them to a gateway that
+ * connects (SCM_RIGHTS). That connection stays open while the gateway is
+ * attached; when it closes, the server knows the gateway is gone.
+ */
+
+#define SHM_RING_MAGIC 0x4475636b    // "Duck"
+#define SHM_RING_SLOTS 256
+#define SHM_RING_MAX_RECIPIENTS 64
+#define SHM_RING_SLOT_DATA BUFFER_SIZE
+#define SHM_RING_CACHE_LINE 64
+
+struct shm_slot {
+    uint32_t length;
+    uint16_t count;    // how many clients
+    uint16_t clients[SHM_RING_MAX_RECIPIENTS];
+    char data[SHM_RING_SLOT_DATA];
+};
+
+// head, tail and the sleep flag each get their own cache line
+struct shm_ring {
+    alignas(SHM_RING_CACHE_LINE) uint32_t head;    // next slot to consume
+    alignas(SHM_RING_CACHE_LINE) uint32_t tail;    // next slot to produce
+    alignas(SHM_RING_CACHE_LINE) uint32_t sleeping;
+    alignas(SHM_RING_CACHE_LINE) struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+struct shm_region {
+    uint32_t magic;
+    uint32_t generation;    // bumped every time a gateway attaches
+    struct shm_ring toServer;
+    struct shm_ring toGateway;
+};
+
+/*
+ * Mapping
+ */
+
+struct shm_region *shm_region_map(const char *path, bool create) {
+    /* Maps the ring file, creating and sizing it first if asked to. */
+    int fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0600);
+    if (fd < 0) return NULL;
+    if (create && (ftruncate(fd, sizeof(struct shm_region)) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    void *region = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) return NULL;
+
+    struct shm_region *shm = (struct shm_region *)region;
+    if (create) {
+        memset(shm, 0, sizeof(struct shm_region));
+        shm->magic = SHM_RING_MAGIC;
+    } else if (shm->magic != SHM_RING_MAGIC) {
+        munmap(region, sizeof(struct shm_region));
+        return NULL;
+    }
+    return shm;
+}
+
+void shm_region_unmap(struct shm_region *shm) {
+    munmap((void *)shm, sizeof(struct shm_region));
+}
+
+void shm_ring_reset(struct shm_ring *ring) {
+    __atomic_store_n(&(ring->head), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(ring->tail), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Producing
+ */
+
+struct shm_slot *shm_ring_reserve(struct shm_ring *ring, uint32_t tail) {
+    /*
+     * Returns the slot at our (unpublished) tail, or NULL if the ring is
+     * full. The slot isn't visible to the consumer until it's published.
+     */
+    uint32_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    if ((tail - head) >= SHM_RING_SLOTS) return NULL;
+    return &(ring->slots[tail % SHM_RING_SLOTS]);
+}
+
+bool shm_ring_publish(struct shm_ring *ring, uint32_t tail) {
+    /*
+     * Makes every slot before tail visible.
+     * Returns true if the consumer is asleep and needs its doorbell rung.
+     */
+    __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(ring->sleeping), __ATOMIC_RELAXED) == 0) return false;
+    __atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+ * Consuming
+ */
+
+struct shm_slot *shm_ring_peek(struct shm_ring *ring, uint32_t head) {
+    /* Returns the next published slot, or NULL if there isn't one. */
+    if (head == __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE)) return NULL;
+    return &(ring->slots[head % SHM_RING_SLOTS]);
+}
+
+void shm_ring_release(struct shm_ring *ring, uint32_t head) {
+    /* Hands every slot before head back to the producer. */
+    __atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+}
+
+bool shm_ring_sleep(struct shm_ring *ring, uint32_t head) {
+    /*
+     * Tells the producer we're about to block on the doorbell.
+     * Returns false if something was published in the meantime.
+     */
+    __atomic_store_n(&(ring->sleeping), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (head == __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE)) return true;
+    __atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+    return false;
+}
+
+/*
+ * Doorbells
+ */
+
+void shm_doorbell_ring(int bell) {
+    uint64_t one = 1;
+    ssize_t result = write(bell, &one, sizeof(one));
+    (void)result;
+}
+
+void shm_doorbell_clear(int bell) {
+    uint64_t count;
+    ssize_t result = read(bell, &count, sizeof(count));
+    (void)result;
+}
+
+void shm_bell_path(char *bellPath, const char *path) {
+    snprintf(bellPath, UNIX_PATH_MAX, "%s.bell", path);
+}
+
+bool shm_send_bells(int connection, int toServerBell, int toGatewayBell) {
+    /* Passes both doorbells to a gateway over its bell connection. */
+    int fds[2] = {toServerBell, toGatewayBell};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    char byte = 'D';
+    struct iovec iov = {&byte, 1};
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(connection, &msg, 0) == 1;
+}
+
+bool shm_recv_bells(int connection, int *toServerBell, int *toGatewayBell) {
+    /* Picks up the doorbells the server passed us. */
+    int fds[2];
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte;
+    struct iovec iov = {&byte, 1};
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(connection, &msg, 0) != 1) return false;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ((cmsg == NULL) || (cmsg->cmsg_type != SCM_RIGHTS) || (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))))
+        return false;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *toServerBell = fds[0];
+    *toGatewayBell = fds[1];
+    return true;
+}
+
+#endif /* _SHMRING_H_ */
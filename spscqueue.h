@@ -0,0 +1,107 @@
+#ifndef _SPSCQUEUE_H_
+#define _SPSCQUEUE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+/*
+ * Single-producer/single-consumer pointer queue
+ *
+ * Lock-free hand-off between two threads. Same protocol as the shared
+ * memory rings: the producer pushes any number of items and publishes
+ * them with one store, and only rings the eventfd doorbell when the
+ * consumer has said it's going to sleep.
+ */
+
+#define SPSC_QUEUE_CACHE_LINE 64
+
+struct spsc_queue {
+    alignas(SPSC_QUEUE_CACHE_LINE) uint32_t head;    // next item to pop
+    alignas(SPSC_QUEUE_CACHE_LINE) uint32_t tail;    // published items end here
+    alignas(SPSC_QUEUE_CACHE_LINE) uint32_t sleeping;
+    alignas(SPSC_QUEUE_CACHE_LINE) uint32_t localTail;    // producer only
+    uint32_t capacity;    // a power of two
+    int bell;
+    void **items;
+};
+
+struct spsc_queue *spsc_queue_create(uint32_t capacity) {
+    /* Creates a queue holding capacity (rounded up to a power of two) items. */
+    uint32_t size = 1;
+    while (size < capacity) size <<= 1;
+
+    struct spsc_queue *queue = (struct spsc_queue *)aligned_alloc(SPSC_QUEUE_CACHE_LINE, sizeof(struct spsc_queue));
+    if (queue == NULL) return NULL;
+    memset(queue, 0, sizeof(struct spsc_queue));
+    queue->capacity = size;
+    queue->sleeping = 1;    // so the first publish rings the consumer in
+    queue->items = (void **)malloc(sizeof(void *) * size);
+    queue->bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((queue->items == NULL) || (queue->bell < 0)) {
+        if (queue->items != NULL) free(queue->items);
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+void spsc_queue_destroy(struct spsc_queue *queue) {
+    close(queue->bell);
+    free(queue->items);
+    free(queue);
+}
+
+bool spsc_queue_push(struct spsc_queue *queue, void *item) {
+    /* Queues an item without publishing it. Returns false if full. */
+    uint32_t head = __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE);
+    if ((queue->localTail - head) >= queue->capacity) return false;
+    queue->items[queue->localTail & (queue->capacity - 1)] = item;
+    queue->localTail += 1;
+    return true;
+}
+
+void spsc_queue_publish(struct spsc_queue *queue) {
+    /* Makes every pushed item visible, waking the consumer if it sleeps. */
+    if (queue->localTail == __atomic_load_n(&(queue->tail), __ATOMIC_RELAXED)) return;
+    __atomic_store_n(&(queue->tail), queue->localTail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(queue->sleeping), __ATOMIC_RELAXED) == 0) return;
+    __atomic_store_n(&(queue->sleeping), 0, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    ssize_t result = write(queue->bell, &one, sizeof(one));
+    (void)result;
+}
+
+void *spsc_queue_pop(struct spsc_queue *queue) {
+    /* Takes the next published item, or NULL if there isn't one. */
+    uint32_t head = __atomic_load_n(&(queue->head), __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&(queue->tail), __ATOMIC_ACQUIRE)) return NULL;
+    void *item = queue->items[head & (queue->capacity - 1)];
+    __atomic_store_n(&(queue->head), head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+bool spsc_queue_sleep(struct spsc_queue *queue) {
+    /*
+     * Tells the producer we're about to wait on the bell.
+     * Returns false if something was published in the meantime.
+     */
+    uint64_t count;
+    ssize_t result = read(queue->bell, &count, sizeof(count));
+    (void)result;
+
+    __atomic_store_n(&(queue->sleeping), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t head = __atomic_load_n(&(queue->head), __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&(queue->tail), __ATOMIC_ACQUIRE)) return true;
+    __atomic_store_n(&(queue->sleeping), 0, __ATOMIC_RELAXED);
+    return false;
+}
+
+#endif /* _SPSCQUEUE_H_ */
@@ -5,7 +5,10 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+#include <math.h>
 #include <cerrno>
 
 #include <sys/socket.h>
@@ -13,10 +16,15 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
 
 #include "utils.h"
 #include "duckchat.h"
 #include "server.h"
+#include "udpoffload.h"
+#include "linkstate.h"
+#include "membership.h"
 
 /*
  * topology ADT
@@ -25,6 +33,71 @@
 #define TOPOLOGY_MAX_SIZE 100
 #define TOPOLOGY_MAX_CHANNELS 100
 #define TOPOLOGY_MAX_ID_POOL 2000
+#define TOPOLOGY_BATCH_CHANNELS ((BUFFER_SIZE - sizeof(struct request_server_channels)) / CHANNEL_MAX)
+#define TOPOLOGY_PACK_CHANNELS (TOPOLOGY_BATCH_CHANNELS - 1)    // so a batch still fits once wrapped as reliable
+
+// Every server picks its own phase and renews each neighbor a random
+// 65-90% of the way through TOPOLOGY_RENEW, so a neighbor that ages our
+// channels every TOPOLOGY_RENEW always hears from us in between.
+#define TOPOLOGY_TICK 1                 // seconds between renew() calls
+#define TOPOLOGY_RENEW_EARLIEST 0.65
+#define TOPOLOGY_RENEW_LATEST 0.9
+#define TOPOLOGY_RATE_SMOOTHING 10.0    // seconds, for the control-plane rate
+
+// Joins and leaves for servers that understand batches are numbered and
+// acked. Unacked ones go again once the retransmission timeout, kept per
+// server from its measured round trip as TCP does, runs out; after
+// TOPOLOGY_MAX_RETRIES we give up and leave it to a digest resync.
+#define TOPOLOGY_RTO_INITIAL 0.2        // seconds, before the first round trip is measured
+#define TOPOLOGY_RTO_MIN 0.02
+#define TOPOLOGY_RTO_MAX 2.0
+#define TOPOLOGY_MAX_RETRIES 8
+#define TOPOLOGY_WINDOW 16              // unacked datagrams in flight per server
+#define TOPOLOGY_MAX_UNACKED 256        // queued per server before we give up on it
+#define TOPOLOGY_DUP_ACKS 2             // repeated acks before retransmitting early
+
+// Neighbors that speak heartbeats are watched with a phi-accrual detector:
+// how unlikely the silence since the last one is, given how they've been
+// arriving. Past the threshold the neighbor is down and routed around.
+#define TOPOLOGY_HELLO_INTERVAL 0.25    // seconds
+#define TOPOLOGY_HELLO_PAUSE 0.5        // silence tolerated on top of the usual, for a busy event loop
+#define TOPOLOGY_PHI_MIN_STDDEV 0.1     // seconds, so perfectly regular arrivals don't make us jumpy
+#define TOPOLOGY_PHI_THRESHOLD 8.0      // about a second and a half of silence
+
+// Heartbeats also measure each link. Its cost is one plus its round trip
+// in TOPOLOGY_COST_MS units, divided by the share of datagrams that make
+// it, and paths prefer cheap links. The round trip is the least seen over
+// the last window or two, the link's own delay without a busy event loop's;
+// there's none until a whole window has gone by. A cost is re-advertised
+// only once it moves by half and by TOPOLOGY_COST_STEP, and not more often
+// than every TOPOLOGY_COST_HOLD.
+#define TOPOLOGY_COST_MS 1.0
+#define TOPOLOGY_COST_STEP 2
+#define TOPOLOGY_COST_HOLD 5.0          // seconds
+#define TOPOLOGY_RTT_WINDOW 10.0        // seconds
+#define TOPOLOGY_RTT_SMOOTHING 0.125
+#define TOPOLOGY_LOSS_SMOOTHING (1 / 32.0)
+
+// With gossip on, one member is pinged each period; one that hasn't acked
+// within TOPOLOGY_PING_TIMEOUT is pinged through a few others instead, and
+// is suspect if none of them hear back by the end of the period. Pings and
+// acks carry up to TOPOLOGY_PIGGYBACK membership updates.
+#define TOPOLOGY_GOSSIP_PERIOD 1.0      // seconds
+#define TOPOLOGY_PING_TIMEOUT 0.3       // seconds
+#define TOPOLOGY_INDIRECT_PINGS 3
+#define TOPOLOGY_PIGGYBACK 8
+#define TOPOLOGY_MAX_SEEDS 16
+
+// Says to each neighbor wait in a queue of their own, one flow per
+// channel, and the flows take turns; past TOPOLOGY_EGRESS_BUDGET bytes the
+// longest flow loses its oldest say. With a pacing rate a token bucket
+// holding TOPOLOGY_EGRESS_BURST bytes meters them out, and a full socket
+// holds the queue until it's writable again instead of losing the say.
+#define TOPOLOGY_EGRESS_BUDGET (256 * 1024)    // bytes
+#define TOPOLOGY_EGRESS_BURST (16 * 1024)      // bytes
+#define TOPOLOGY_EGRESS_EVENTS 16
+#define TOPOLOGY_EGRESS_DEPTH (TOPOLOGY_EGRESS_BUDGET / sizeof(request_server_say))    // says that fit the budget
+#define TOPOLOGY_FLOW_BUCKETS 64        // of each neighbor's channel index
 
 typedef struct topology Topology;
 typedef struct serverdata ServerData;
@@ -37,7 +110,7 @@ struct topology {
 	bool (*add_address)(const Topology *tp, int socket, char *hostname, char *port);
 	ServerData *(*find_server)(const Topology *tp, struct sockaddr_in *address);
 
-	// renewal management
+	// renewal management; call every TOPOLOGY_TICK, it renews whichever servers are due
 	bool (*renew)(const Topology *tp, struct sockaddr_in *serverAddr, struct ChannelRef *channelList);
 
 	// topology calls
@@ -48,19 +121,170 @@ struct topology {
 	// topology receives
 	bool (*s2s_join_recv)(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName);
 	bool (*s2s_leave_recv)(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName);
-	bool (*s2s_say_recv)(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, long long id, char *username, char *channelName, char *text);
+	bool (*s2s_say_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_say *datagram);
 
 	// id management
 	void (*id_store)(const Topology *tp, long long id);
 	bool (*id_has)(const Topology *tp, long long id);
+
+	// segmentation offload
+	void (*set_segment_offload)(const Topology *tp, bool enabled);
+	void (*flush)(const Topology *tp);
+
+	// sends a say one of our users made, already encoded; it gets a fresh ID
+	bool (*s2s_say_originate)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_say *datagram);
+
+	// joins or leaves (S2S_JOIN/S2S_LEAVE) every channel in the list with every server, batched where understood
+	bool (*s2s_channels_send)(const Topology *tp, struct sockaddr_in *serverAddr, s2s_t type, struct ChannelRef *channelList);
+	bool (*s2s_channels_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_channels *datagram);
+
+	// digest renewal; channelList is every channel we have, as for renew
+	bool (*s2s_digest_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_digest *datagram, struct ChannelRef *channelList);
+
+	// prints the smoothed control-plane rates and say batching
+	void (*report)(const Topology *tp);
+
+	// link-state advertisements, which keep says on one loop-free tree
+	bool (*s2s_lsa_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_lsa *datagram);
+
+	// joins travel only toward each channel's home server; every server must agree
+	void (*set_rendezvous)(const Topology *tp, bool enabled);
+
+	// our last user left a channel; true if we left it too, false if others still need it through us
+	bool (*s2s_channel_empty)(const Topology *tp, struct sockaddr_in *serverAddr, char *channelName);
+
+	// leaves everything with everyone and withdraws our links, before we exit
+	void (*shutdown)(const Topology *tp, struct sockaddr_in *serverAddr, struct ChannelRef *channelList);
+
+	// acked joins and leaves, and heartbeats; call run_timers whenever the timer fd is readable
+	bool (*s2s_reliable_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_reliable *datagram);
+	bool (*s2s_ack_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_ack *datagram);
+	int  (*get_timer_fd)(const Topology *tp);
+	void (*run_timers)(const Topology *tp, struct sockaddr_in *serverAddr, struct ChannelRef *channelList);
+
+	// drops this fraction of what we send other servers, to test over a lossy link
+	void (*set_loss)(const Topology *tp, double loss);
+
+	bool (*s2s_hello_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_hello *datagram);
+
+	// holds what we send other servers this many seconds, to test over a slow link
+	void (*set_delay)(const Topology *tp, double delay);
+
+	// changes our neighbors while we run; add_neighbor takes over the socket, as add_address does
+	bool (*add_neighbor)(const Topology *tp, struct sockaddr_in *serverAddr, int socket, char *hostname, char *port);
+	bool (*remove_neighbor)(const Topology *tp, struct sockaddr_in *serverAddr, char *hostname, char *port);
+
+	// gossip membership: we join through seeds, and our neighbors are our links in an overlay over everyone
+	void (*set_gossip)(const Topology *tp, struct sockaddr_in *serverAddr);
+	bool (*add_seed)(const Topology *tp, char *hostname, char *port);
+	bool (*s2s_gossip_recv)(const Topology *tp, struct sockaddr_in *serverAddr, request_server_gossip *datagram);
+
+	// paces says to each neighbor to this many bytes a second, 0 for as fast as they go
+	void (*set_pacing)(const Topology *tp, double rate);
+
+	// neighbors whose sockets filled up; call egress_ready whenever the egress fd is readable
+	int  (*get_egress_fd)(const Topology *tp);
+	void (*egress_ready)(const Topology *tp);
 };
 
 #include "channelList.h"
 
+// A datagram the delay shim is holding.
+typedef struct topologydelayed {
+	struct topologydelayed *next;
+	struct serverdata *sd;
+	double due;
+	size_t size;
+	char datagram[];
+} TopologyDelayed;
+
+// A reliable datagram we've sent a server, kept until it's acked.
+typedef struct topologyunacked {
+	struct topologyunacked *next;
+	unsigned int seq;
+	int transmissions;
+	double sentAt;       // monotonic seconds, 0 until it first goes out
+	size_t size;
+	char datagram[];     // a request_server_reliable
+} TopologyUnacked;
+
+// A say waiting in a neighbor's egress queue.
+typedef struct topologyqueued {
+	struct topologyqueued *next;
+	request_server_say datagram;
+} TopologyQueued;
+
+// One channel's says waiting for a neighbor, oldest first. Each flow is
+// in the turn order, a bucket of the channel index, and the list of flows
+// holding as many says as it does, so none of them needs a search.
+typedef struct topologyflow {
+	struct topologyflow *next, *previous;            // turn order
+	struct topologyflow *hashNext;                   // same index bucket
+	struct topologyflow *sameNext, *samePrevious;    // same count
+	unsigned long long hash;
+	char channel[CHANNEL_MAX];
+	TopologyQueued *head, *tail;
+	int count;
+} TopologyFlow;
+
 typedef struct serverdata {
 	struct sockaddr_in *address;
 	int socket;
 	const ChannelList *channelList;
+
+	// says waiting to go out as one segmented send
+	char *sayBatch;
+	int sayBatchCount;
+
+	// it has sent us an S2S_*_BATCH, digest or advertisement, so it
+	// understands those and takes its joins and leaves reliably
+	bool batches;
+
+	// what we've sent it reliably, oldest first, and how long acks take
+	unsigned int sendEpoch, sendSeq, ackedSeq;
+	TopologyUnacked *unacked;
+	int unackedCount, dupAcks;
+	double srtt, rttvar, rto;
+
+	// how far we've applied its reliable datagrams
+	bool peerKnown;
+	unsigned int peerEpoch, peerSeq;
+
+	// its heartbeats: when the last came, and the spacing so far (0 until the first)
+	double lastHello, helloMean, helloVar;
+	bool down;
+
+	// the link as heartbeats measure it, and the cost we advertise for it
+	double linkRtt, linkLoss;
+	double rttMin, rttWindowMin, rttWindowEnd;
+	unsigned int lastHelloSeq, cost;
+	long long echoStamp;
+	double echoAt;
+
+	// added while we were running, and hasn't heard our links yet
+	bool fresh;
+
+	// gossip's overlay picked it, and takes it away again
+	bool gossiped;
+
+	// says waiting to go to it, in flows taking turns (whoever's turn it
+	// is first), the token bucket pacing them, and whether we're waiting
+	// on its socket; egressAt is when tokens next allow one, 0 if not waiting
+	TopologyFlow *flows, *flowsTail;
+	TopologyFlow **flowIndex;       // TOPOLOGY_FLOW_BUCKETS, by channel hash; NULL until something queues
+	TopologyFlow **flowsByCount;    // TOPOLOGY_EGRESS_DEPTH + 2, indexed by how many says a flow holds
+	int longest;                    // the highest count any flow holds
+	int queued;
+	size_t queuedBytes;
+	double tokens, tokensAt, egressAt;
+	bool blocked;
+	long long dropped, stalls;
+
+	// In rendezvous mode, channelList only holds what this server joined
+	// through us; where we joined ourselves follows from link state.
+
+	// when we next renew our channels with it and age its own (monotonic seconds)
+	double renewAt, ageAt;
 } ServerData;
 
 
@@ -70,9 +294,109 @@ typedef struct topologydata {
 
     long long recentIds[TOPOLOGY_MAX_ID_POOL];
     int idPoolSize;
+    uint64_t idState;    // say ID generator, seeded once
+
+    bool segmentOffload;
+    long long sayDatagrams;
+    long long saySyscalls;
+
+    // joins, leaves, batches and digests since the last tick
+    long long controlDatagrams;
+    long long controlReceived;
+
+    // per second, smoothed over TOPOLOGY_RATE_SMOOTHING; peaks since the last report
+    double lastTick;
+    double sentRate, receivedRate;
+    double sentPeak, receivedPeak;
+
+    // our advertisement goes out every renewal period, and everyone's are kept here
+    const LinkState *linkState;
+    unsigned int lsaSeq;
+    double lsaAt;
+
+    // joins go toward each channel's home instead of everywhere
+    bool rendezvous;
+
+    // we've said goodbye; nothing else goes out
+    bool stopping;
+
+    // fires when the earliest unacked datagram is due again, or heartbeats are
+    int timer;
+    long long reliableSent, retransmitted, fastRetransmitted, gaveUp;
+    unsigned int helloSeq;
+    double helloAt;
+    long long failovers;
+
+    // the loss shim, and what it ate
+    double loss;
+    long long lost;
+
+    // the delay shim, and what it's holding, oldest first
+    double delay;
+    TopologyDelayed *delayed, *delayedTail;
+
+    // when link costs may next be re-advertised
+    double costAt;
+
+    // the pacing rate for says to each neighbor (bytes per second, 0 not
+    // paced), and the sockets we're waiting on to take more
+    double egressRate;
+    int egressPoll;
+
+    // gossip membership, if on, and this period's probe
+    const Membership *membership;
+    int gossipSocket;
+    struct sockaddr_in seeds[TOPOLOGY_MAX_SEEDS];
+    int seedCount;
+    struct sockaddr_in probeTarget;
+    unsigned int probeSeq;
+    bool probing, probeAcked, probeIndirect;
+    double probeAt, probeSentAt;
+    long long pings, indirectPings, suspicions;
 } TopologyData;
 
+static double topology_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+static long long topology_new_id(TopologyData *tpd) {
+	/* Hands out a random-looking say ID (splitmix64) without a syscall per say. */
+	uint64_t z = (tpd->idState += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (long long)(z ^ (z >> 31));
+}
+static double topology_random(TopologyData *tpd) {
+	/* Uniform in [0, 1), from the same generator. */
+	return ((uint64_t)topology_new_id(tpd) >> 11) * (1.0 / 9007199254740992.0);
+}
+static double topology_renew_interval(TopologyData *tpd) {
+	return TOPOLOGY_RENEW * (TOPOLOGY_RENEW_EARLIEST + (TOPOLOGY_RENEW_LATEST - TOPOLOGY_RENEW_EARLIEST) * topology_random(tpd));
+}
+
+static void topology_reliable_drop(ServerData *sd);
+static void topology_egress_drop(TopologyData *tpd, ServerData *sd);
 static void topology_cleanup(const Topology *tp) {
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		if (sd->sayBatch != NULL) free(sd->sayBatch);
+		topology_reliable_drop(sd);
+		topology_egress_drop(tpd, sd);
+	}
+	while (tpd->delayed != NULL) {
+		TopologyDelayed *next = tpd->delayed->next;
+		free(tpd->delayed);
+		tpd->delayed = next;
+	}
+	tpd->linkState->cleanup(tpd->linkState);
+	if (tpd->timer >= 0) close(tpd->timer);
+	if (tpd->egressPoll >= 0) close(tpd->egressPoll);
+	if (tpd->membership != NULL) {
+		tpd->membership->cleanup(tpd->membership);
+		close(tpd->gossipSocket);
+	}
 	free(tp->self);
 	free((void *)tp);
 }
@@ -87,22 +411,31 @@ static int topology_get_socket(const Topology *tp, int index) {
 	return tpd->serverTopology[index]->socket;
 }
 
-static bool topology_add_address(const Topology *tp, int socket, char *hostname, char *port) {
-    // get our tp data
-    TopologyData *tpd = (TopologyData *)(tp->self);
-
-    // make a new address
-    struct sockaddr_in *serverAddr = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-    memset(serverAddr, 0, sizeof(struct sockaddr_in));
-    serverAddr->sin_family = AF_INET;
-    serverAddr->sin_port = htons(atoi(port));
+static bool topology_resolve(char *hostname, char *port, struct sockaddr_in *address) {
+    /* Fills in the address of hostname:port, or complains and returns false. */
+    memset(address, 0, sizeof(struct sockaddr_in));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(atoi(port));
 
     struct hostent *he;
     if ((he = gethostbyname(hostname)) == NULL) {
         fprintf(stderr, "Error resolving hostname\n");
-        exit(1);
+        return false;
+    }
+    memcpy(&(address->sin_addr), he->h_addr_list[0], he->h_length);
+    return true;
+}
+
+static ServerData *topology_insert(TopologyData *tpd, int socket, struct sockaddr_in *address) {
+    /* Makes a server of address, sending it through socket; NULL if we have too many. */
+    if (tpd->size >= TOPOLOGY_MAX_SIZE) {
+        fprintf(stderr, "Too many servers, at most %d\n", TOPOLOGY_MAX_SIZE);
+        return NULL;
     }
-    memcpy(&(serverAddr->sin_addr), he->h_addr_list[0], he->h_length);
+
+    // make a new address
+    struct sockaddr_in *serverAddr = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
+    memcpy(serverAddr, address, sizeof(struct sockaddr_in));
 
     // make serverdata, populate it
     ServerData *sd = (ServerData *)malloc(sizeof(ServerData));
@@ -112,13 +445,29 @@ static bool topology_add_address(const Topology *tp, int socket, char *hostname,
     sd->socket = socket;
     sd->channelList = ChannelList_create();
 
+    // A random phase, so servers started together don't renew together.
+    double now = topology_now();
+    sd->renewAt = now + (TOPOLOGY_RENEW_LATEST * TOPOLOGY_RENEW * topology_random(tpd));
+    sd->ageAt = now + TOPOLOGY_RENEW * (1 + topology_random(tpd));
+    sd->sendEpoch = (unsigned int)topology_new_id(tpd);
+    sd->rto = TOPOLOGY_RTO_INITIAL;
+    sd->cost = 1;
+    sd->tokens = TOPOLOGY_EGRESS_BURST;
+    sd->tokensAt = now;
+
     // add the address to the struct
     int current_size = tpd->size;
     (tpd->serverTopology)[current_size] = sd;
     tpd->size += 1;
+    return sd;
+}
 
-    // everything seems good
-    return true;
+static bool topology_add_address(const Topology *tp, int socket, char *hostname, char *port) {
+    // get our tp data
+    TopologyData *tpd = (TopologyData *)(tp->self);
+    struct sockaddr_in address;
+    if (!topology_resolve(hostname, port, &address)) return false;
+    return topology_insert(tpd, socket, &address) != NULL;
 }
 
 static ServerData *topology_find_server(const Topology *tp, struct sockaddr_in *address) {
@@ -133,29 +482,422 @@ static ServerData *topology_find_server(const Topology *tp, struct sockaddr_in *
 	// Could not find the server.
 	return NULL;
 }
+static ServerData *topology_upstream(TopologyData *tpd, struct sockaddr_in *serverAddr, char *channelName) {
+	/* Our neighbor toward a channel's home server, or NULL if that's us (or we can't tell yet). */
+	struct sockaddr_in home, hop;
+	const LinkState *ls = tpd->linkState;
+	if (!(ls->home(ls, serverAddr, channel_list_hash(channelName), &home))) return NULL;
+	if (!(ls->next_hop(ls, serverAddr, &home, &hop))) return NULL;
+	for (int i = 0; i < tpd->size; i++)
+		if (cmpaddress(*((tpd->serverTopology)[i]->address), hop)) return (tpd->serverTopology)[i];
+	return NULL;
+}
+static bool topology_routes_via(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, char *channelName) {
+	/* Whether we renew this channel with this server: all of them, or only toward its home. */
+	return !(tpd->rendezvous) || (topology_upstream(tpd, serverAddr, channelName) == sd);
+}
+static struct Channel *topology_get_channel(const char *channelName, bool create) {
+	/* get_channel for names that aren't CHANNEL_MAX buffers of their own, like a table's. */
+	char name[CHANNEL_MAX];
+	memset(name, 0, CHANNEL_MAX);
+	strncpy(name, channelName, CHANNEL_MAX - 1);
+	return get_channel(name, create);
+}
+static bool topology_downstream(TopologyData *tpd, char *channelName) {
+	/* Whether any server joined this channel through us. */
+	for (int i = 0; i < tpd->size; i++) {
+		const ChannelList *cl = (tpd->serverTopology)[i]->channelList;
+		if (cl->has_channel(cl, channelName)) return true;
+	}
+	return false;
+}
+static void topology_arm_timer(TopologyData *tpd);
+static int topology_sendto(TopologyData *tpd, ServerData *sd, const void *datagram, size_t size) {
+	/* Sends a datagram to another server, unless the loss shim eats it or the delay shim holds it. */
+	if ((tpd->loss > 0) && (topology_random(tpd) < tpd->loss)) {
+		tpd->lost += 1;
+		return (int)size;
+	}
+	if (tpd->delay > 0) {
+		TopologyDelayed *held = (TopologyDelayed *)malloc(sizeof(TopologyDelayed) + size);
+		if (held == NULL) {fprintf(stderr, "Out of memory"); return -1;}
+		held->next = NULL;
+		held->sd = sd;
+		held->due = topology_now() + tpd->delay;
+		held->size = size;
+		memcpy(held->datagram, datagram, size);
+		if (tpd->delayedTail != NULL) tpd->delayedTail->next = held;
+		else tpd->delayed = held;
+		tpd->delayedTail = held;
+		topology_arm_timer(tpd);
+		return (int)size;
+	}
+	return sendto(sd->socket, datagram, size, MSG_DONTWAIT, (struct sockaddr *)(sd->address), sizeof(struct sockaddr_in));
+}
+static void topology_release_delayed(TopologyData *tpd, double now) {
+	/* Sends whatever the delay shim has held long enough. */
+	while ((tpd->delayed != NULL) && (tpd->delayed->due <= now)) {
+		TopologyDelayed *held = tpd->delayed;
+		ServerData *sd = held->sd;
+		int result = sendto(sd->socket, held->datagram, held->size, MSG_DONTWAIT, (struct sockaddr *)(sd->address), sizeof(struct sockaddr_in));
+		if (result == -1) fprintf(stderr, "S2S delayed send failure. (%d)\n", result);
+		tpd->delayed = held->next;
+		if (tpd->delayed == NULL) tpd->delayedTail = NULL;
+		free(held);
+	}
+}
+static void topology_arm_timer(TopologyData *tpd) {
+	/* Sets the timer for the next heartbeat, held datagram, paced say, or whichever server's oldest unacked datagram is due first. */
+	double due = tpd->helloAt;
+	if ((tpd->delayed != NULL) && (tpd->delayed->due < due)) due = tpd->delayed->due;
+	if ((tpd->membership != NULL) && (tpd->probeAt < due)) due = tpd->probeAt;
+	if ((tpd->membership != NULL) && tpd->probing && !(tpd->probeAcked) && !(tpd->probeIndirect) &&
+	    (tpd->probeSentAt + TOPOLOGY_PING_TIMEOUT < due))
+		due = tpd->probeSentAt + TOPOLOGY_PING_TIMEOUT;
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		if ((sd->egressAt > 0) && ((due == 0) || (sd->egressAt < due))) due = sd->egressAt;
+		if ((sd->unacked == NULL) || (sd->unacked->sentAt == 0)) continue;
+		if ((due == 0) || (sd->unacked->sentAt + sd->rto < due)) due = sd->unacked->sentAt + sd->rto;
+	}
+
+	// Zero disarms it; anything already due fires right away.
+	struct itimerspec timer;
+	memset(&timer, 0, sizeof(timer));
+	if (due > 0) {
+		double wait = due - topology_now();
+		if (wait < 0.001) wait = 0.001;
+		timer.it_value.tv_sec = (time_t)wait;
+		timer.it_value.tv_nsec = (long)((wait - (time_t)wait) * 1e9);
+	}
+	if (tpd->timer >= 0) timerfd_settime(tpd->timer, 0, &timer, NULL);
+}
+static void topology_reliable_push(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, bool again) {
+	/*
+	 * Sends whatever in sd's window hasn't gone out yet, or, again, all of
+	 * it: receivers drop anything after a gap, so it all goes back-to-back.
+	 */
+	double now = topology_now();
+	TopologyUnacked *entry = sd->unacked;
+	for (int i = 0; (entry != NULL) && (i < TOPOLOGY_WINDOW); i++, entry = entry->next) {
+		if ((entry->sentAt > 0) && !again) continue;
+		if (entry->transmissions > 0) {
+			print_addresses(serverAddr, sd->address);
+			printf("send S2S Reliable %u again\n", entry->seq);
+			tpd->retransmitted += 1;
+		}
+		int result = topology_sendto(tpd, sd, entry->datagram, entry->size);
+		if (result == -1) fprintf(stderr, "S2S reliable send failure. (%d)\n", result);
+		entry->transmissions += 1;
+		entry->sentAt = now;
+		tpd->controlDatagrams += 1;
+	}
+	topology_arm_timer(tpd);
+}
+static void topology_reliable_drop(ServerData *sd) {
+	/* Forgets everything sd hasn't acked. */
+	while (sd->unacked != NULL) {
+		TopologyUnacked *next = sd->unacked->next;
+		free(sd->unacked);
+		sd->unacked = next;
+	}
+	sd->unackedCount = sd->dupAcks = 0;
+}
+static void topology_reliable_reset(TopologyData *tpd, ServerData *sd) {
+	/*
+	 * Gives up on everything sd hasn't acked and starts a new epoch with
+	 * it. Renewing right away resyncs whatever was lost.
+	 */
+	topology_reliable_drop(sd);
+	sd->sendEpoch = (unsigned int)topology_new_id(tpd);
+	sd->sendSeq = sd->ackedSeq = 0;
+	sd->renewAt = topology_now();
+	tpd->gaveUp += 1;
+}
+static void topology_reliable_send(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, request_server_channels *payload) {
+	/* Numbers a batch for sd and keeps it until acked, sending it if the window has room. */
+	if (sd->down) return;
+	size_t size = sizeof(request_server_channels) + (CHANNEL_MAX * payload->req_count);
+	if (sd->unackedCount >= TOPOLOGY_MAX_UNACKED) topology_reliable_reset(tpd, sd);
+
+	// If the last one is still waiting on the window, this rides along when it's the same kind.
+	TopologyUnacked **last = &(sd->unacked);
+	while ((*last != NULL) && ((*last)->next != NULL)) last = &((*last)->next);
+	if ((*last != NULL) && ((*last)->sentAt == 0)) {
+		request_server_channels *queued = (request_server_channels *)(((request_server_reliable *)((*last)->datagram))->req_payload);
+		if ((queued->req_type == payload->req_type) && ((size_t)(queued->req_count + payload->req_count) <= TOPOLOGY_PACK_CHANNELS)) {
+			size_t grow = CHANNEL_MAX * payload->req_count;
+			TopologyUnacked *grown = (TopologyUnacked *)realloc(*last, sizeof(TopologyUnacked) + (*last)->size + grow);
+			if (grown == NULL) {fprintf(stderr, "Out of memory"); return;}
+			*last = grown;
+			queued = (request_server_channels *)(((request_server_reliable *)(grown->datagram))->req_payload);
+			memcpy(queued->req_channels[queued->req_count], payload->req_channels, grow);
+			queued->req_count += payload->req_count;
+			grown->size += grow;
+			return;
+		}
+	}
+
+	TopologyUnacked *entry = (TopologyUnacked *)malloc(sizeof(TopologyUnacked) + sizeof(request_server_reliable) + size);
+	if (entry == NULL) {fprintf(stderr, "Out of memory"); return;}
+	memset(entry, 0, sizeof(TopologyUnacked) + sizeof(request_server_reliable));
+	entry->seq = ++(sd->sendSeq);
+	entry->size = sizeof(request_server_reliable) + size;
+
+	request_server_reliable *datagram = (request_server_reliable *)(entry->datagram);
+	datagram->req_type = S2S_RELIABLE;
+	memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
+	datagram->req_epoch = sd->sendEpoch;
+	datagram->req_seq = entry->seq;
+	memcpy(datagram->req_payload, payload, size);
+
+	// Onto the end of the queue.
+	if (*last != NULL) last = &((*last)->next);
+	*last = entry;
+	sd->unackedCount += 1;
+	tpd->reliableSent += 1;
+	topology_reliable_push(tpd, serverAddr, sd, false);
+}
+static void topology_send_channel(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, s2s_t type, char *channelName) {
+	/* Sends one single-channel join or leave to one server: a reliable batch of one where understood. */
+	if (sd->batches) {
+		char buffer[sizeof(request_server_channels) + CHANNEL_MAX];
+		request_server_channels *batch = (request_server_channels *)buffer;
+		memset(buffer, 0, sizeof(buffer));
+		memcpy((void *)(&batch->address), serverAddr, sizeof(struct sockaddr_in));
+		batch->req_type = (type == S2S_JOIN) ? S2S_JOIN_BATCH : S2S_LEAVE_BATCH;
+		batch->req_count = 1;
+		strncpy(batch->req_channels[0], channelName, CHANNEL_MAX - 1);
+		topology_reliable_send(tpd, serverAddr, sd, batch);
+		return;
+	}
+
+	request_server_join datagram;    // a leave is laid out the same
+	memset(&datagram, 0, sizeof(datagram));
+	memcpy((void *)(&datagram.address), serverAddr, sizeof(struct sockaddr_in));
+	datagram.req_type = type;
+	strncpy(datagram.req_channel, channelName, CHANNEL_MAX - 1);    // names from tables are only as long as they are
+
+	int result = topology_sendto(tpd, sd, &datagram, sizeof(request_server_join));
+	if (result == -1) fprintf(stderr, "S2S %s send failure. (%d)\n", (type == S2S_JOIN) ? "join" : "leave", result);
+	tpd->controlDatagrams += 1;
+}
+static void topology_send_batch(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, request_server_channels *datagram) {
+	/* Sends a filled-in batch to one server, reliably unless it's our advertisement. */
+	print_addresses(serverAddr, sd->address);
+	printf("send S2S %s batch of %d\n", (datagram->req_type == S2S_JOIN_BATCH) ? "Join" : "Leave", datagram->req_count);
+	if (sd->batches) {
+		topology_reliable_send(tpd, serverAddr, sd, datagram);
+		return;
+	}
+
+	int result = topology_sendto(tpd, sd, datagram, sizeof(request_server_channels) + (CHANNEL_MAX * datagram->req_count));
+	if (result == -1) fprintf(stderr, "S2S batch send failure. (%d)\n", result);
+	tpd->controlDatagrams += 1;
+}
+static void topology_pack_channel(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, s2s_t type, request_server_channels *datagram, char *channelName) {
+	/* Sends one channel on its own, or packs it into the batch and sends that once it's full. */
+	if (!(sd->batches)) {
+		print_addresses(serverAddr, sd->address);
+		printf("send S2S %s %s\n", (type == S2S_JOIN) ? "Join" : "Leave", channelName);
+		topology_send_channel(tpd, serverAddr, sd, type, channelName);
+		return;
+	}
+	strncpy(datagram->req_channels[datagram->req_count], channelName, CHANNEL_MAX - 1);
+	datagram->req_count += 1;
+	if ((size_t)datagram->req_count == TOPOLOGY_PACK_CHANNELS) {
+		topology_send_batch(tpd, serverAddr, sd, datagram);
+		memset(datagram->req_channels, 0, CHANNEL_MAX * datagram->req_count);
+		datagram->req_count = 0;
+	}
+}
+static bool topology_channels_send_server(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, s2s_t type, struct ChannelRef *channelList) {
+	/*
+	 * Joins or leaves every channel in the list with one server. Servers
+	 * that understand batches get TOPOLOGY_PACK_CHANNELS per datagram;
+	 * the rest get one datagram per channel, then an empty batch to
+	 * advertise that we understand them.
+	 */
+	request_server_channels *datagram = (request_server_channels *)malloc(BUFFER_SIZE);
+	if (datagram == NULL) {fprintf(stderr, "Out of memory"); return false;}
+
+	memset(datagram, 0, BUFFER_SIZE);
+	memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
+	datagram->req_type = (type == S2S_JOIN) ? S2S_JOIN_BATCH : S2S_LEAVE_BATCH;
+
+	for (struct ChannelRef *channelRef = channelList; channelRef != NULL; channelRef = channelRef->_next) {
+		// If no channel name -- bye
+		if (channelRef->_this == NULL) break;
+		if (channelRef->_this->channelName == NULL) break;
+		char *channelName = channelRef->_this->channelName;
+		if (!topology_routes_via(tpd, serverAddr, sd, channelName)) continue;
+
+		// Keep the routing table in step, as the single sends do. Our own
+		// rendezvous joins aren't in it, only theirs through us.
+		if (!(tpd->rendezvous)) {
+			if (type == S2S_JOIN) sd->channelList->add_channel(sd->channelList, channelName);
+			else sd->channelList->remove_channel(sd->channelList, channelName);
+		}
+
+		topology_pack_channel(tpd, serverAddr, sd, type, datagram, channelName);
+	}
+
+	// The remainder, or the advertisement.
+	if ((datagram->req_count > 0) || !(sd->batches))
+		topology_send_batch(tpd, serverAddr, sd, datagram);
+	free(datagram);
+	return true;
+}
+static unsigned long long topology_digest(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, struct ChannelRef *channelList, int *count) {
+	/* Digests the channels we renew with sd, as channel_list_digest does a server's. */
+	unsigned long long digest = 0;
+	*count = 0;
+	for (struct ChannelRef *channelRef = channelList; channelRef != NULL; channelRef = channelRef->_next) {
+		if ((channelRef->_this == NULL) || (channelRef->_this->channelName == NULL)) break;
+		if (!topology_routes_via(tpd, serverAddr, sd, channelRef->_this->channelName)) continue;
+		digest += channel_list_hash(channelRef->_this->channelName);
+		*count += 1;
+	}
+	return digest;
+}
+static void topology_send_digest(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, s2s_t type, unsigned long long digest, int count) {
+	/* Sends a digest (or a resync request carrying ours) to one server. */
+	print_addresses(serverAddr, sd->address);
+	printf("send S2S %s of %d channels\n", (type == S2S_DIGEST) ? "Digest" : "Resync", count);
+
+	request_server_digest datagram;
+	memset(&datagram, 0, sizeof(datagram));
+	memcpy((void *)(&datagram.address), serverAddr, sizeof(struct sockaddr_in));
+	datagram.req_type = type;
+	datagram.req_count = count;
+	datagram.req_digest = digest;
+
+	int result = topology_sendto(tpd, sd, &datagram, sizeof(request_server_digest));
+	if (result == -1) fprintf(stderr, "S2S digest send failure. (%d)\n", result);
+	tpd->controlDatagrams += 1;
+}
+static void topology_send_lsa(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, request_server_lsa *datagram) {
+	/* Sends an advertisement on to one server, as coming from us. */
+	print_addresses(serverAddr, sd->address);
+	printf("send S2S LSA %u of %d links\n", datagram->req_seq, datagram->req_count);
+	memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
+
+	int result = topology_sendto(tpd, sd, datagram, sizeof(request_server_lsa) + (sizeof(struct server_link) * datagram->req_count));
+	if (result == -1) fprintf(stderr, "S2S LSA send failure. (%d)\n", result);
+	tpd->controlDatagrams += 1;
+}
+static void topology_originate_lsa(TopologyData *tpd, struct sockaddr_in *serverAddr, bool withdraw) {
+	/* Advertises our neighbors (or, withdrawing, none) to every server, keeping a copy ourselves. */
+	request_server_lsa *datagram = (request_server_lsa *)malloc(BUFFER_SIZE);
+	if (datagram == NULL) {fprintf(stderr, "Out of memory"); return;}
+	memset(datagram, 0, BUFFER_SIZE);
+	datagram->req_type = S2S_LSA;
+	memcpy((void *)(&datagram->origin), serverAddr, sizeof(struct sockaddr_in));
+
+	// Seconds since the epoch, so a restarted server still outranks its old advertisements.
+	unsigned int seq = (unsigned int)time(NULL);
+	if ((int)(seq - tpd->lsaSeq) <= 0) seq = tpd->lsaSeq + 1;
+	datagram->req_seq = tpd->lsaSeq = seq;
+	for (int i = 0; !withdraw && (i < tpd->size) && (datagram->req_count < LINKSTATE_MAX_LINKS); i++) {
+		if ((tpd->serverTopology)[i]->down) continue;
+		memcpy(&(datagram->req_links[datagram->req_count].address), (tpd->serverTopology)[i]->address, sizeof(struct sockaddr_in));
+		datagram->req_links[datagram->req_count].cost = (tpd->serverTopology)[i]->cost;
+		datagram->req_count += 1;
+	}
+
+	tpd->linkState->update(tpd->linkState, serverAddr, seq, datagram->req_links, datagram->req_count);
+	for (int i = 0; i < tpd->size; i++)
+		topology_send_lsa(tpd, serverAddr, (tpd->serverTopology)[i], datagram);
+	free(datagram);
+}
+static void topology_send_database(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd) {
+	/* Sends a neighbor that's just come up every advertisement we hold, which it missed while it wasn't linked to us. */
+	request_server_lsa *datagram = (request_server_lsa *)malloc(BUFFER_SIZE);
+	if (datagram == NULL) {fprintf(stderr, "Out of memory"); return;}
+	for (int i = 0;; i++) {
+		memset(datagram, 0, BUFFER_SIZE);
+		datagram->req_type = S2S_LSA;
+		if (!(tpd->linkState->advertisement(tpd->linkState, i, &(datagram->origin), &(datagram->req_seq), datagram->req_links, &(datagram->req_count))))
+			break;
+		topology_send_lsa(tpd, serverAddr, sd, datagram);
+	}
+	free(datagram);
+}
+static void topology_update_rates(TopologyData *tpd, double now) {
+	/* Folds this tick's control datagrams into the smoothed rates. */
+	double elapsed = (tpd->lastTick > 0) ? (now - tpd->lastTick) : TOPOLOGY_TICK;
+	tpd->lastTick = now;
+	if (elapsed <= 0) return;
+
+	double sent = tpd->controlDatagrams / elapsed;
+	double received = tpd->controlReceived / elapsed;
+	double weight = 1 - exp(-elapsed / TOPOLOGY_RATE_SMOOTHING);
+	tpd->sentRate += (sent - tpd->sentRate) * weight;
+	tpd->receivedRate += (received - tpd->receivedRate) * weight;
+	if (sent > tpd->sentPeak) tpd->sentPeak = sent;
+	if (received > tpd->receivedPeak) tpd->receivedPeak = received;
+	tpd->controlDatagrams = tpd->controlReceived = 0;
+}
+static bool topology_leave_channel(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName);
 static bool topology_renew(const Topology *tp, struct sockaddr_in *serverAddr, struct ChannelRef *currentChannel) {
 	/* 
-	 * Sends the renew request for the server topology.
+	 * Sends the renew request to every server that's due for one.
 	 * Also handles the leaves for old servers.
 	 */
-	// First, renew all of our channels.
-	while (currentChannel != NULL) {
-		// If no channel name -- bye
-		if (currentChannel->_this == NULL) break;
-		if (currentChannel->_this->channelName == NULL) break;
+	TopologyData *tpd = (TopologyData *)tp->self;
+	double now = topology_now();
+	topology_update_rates(tpd, now);
 
-		// Send a join for this channel.
-		tp->s2s_join_send(tp, serverAddr, NULL, currentChannel->_this->channelName);
-		
-		// Move onto next channel.
-		currentChannel = currentChannel->_next;
+	// Keep our advertisement fresh, and forget servers that have gone quiet.
+	if (now >= tpd->lsaAt) {
+		tpd->lsaAt = now + topology_renew_interval(tpd);
+		topology_originate_lsa(tpd, serverAddr, false);
 	}
+	tpd->linkState->expire(tpd->linkState);
 
-	// Now, we need to review our server topology and age everything.
-	TopologyData *tpd = (TopologyData *)tp->self;
+	// When paths move, renew right away rather than at the next renewal:
+	// toward the new homes, or, flooding, along the new tree.
+	// A fresh neighbor waits for its first heartbeat, when it can take a digest.
+	if (tpd->linkState->changed(tpd->linkState))
+		for (int i = 0; i < tpd->size; i++)
+			if (!((tpd->serverTopology)[i]->fresh)) (tpd->serverTopology)[i]->renewAt = now;
+
+	if (tpd->rendezvous) {
+		// We stay on the tree for anyone who joined through us, users or not.
+		for (int i = 0; i < tpd->size; i++) {
+			ChannelListData *cld = (ChannelListData *)((tpd->serverTopology)[i]->channelList->self);
+			while (cld != NULL) {
+				if (cld->channelName != NULL) topology_get_channel(cld->channelName, true);
+				cld = (cld->next != NULL) ? (ChannelListData *)(cld->next->self) : NULL;
+			}
+		}
+	}
+
+	// First, renew all of our channels: a digest where it's understood,
+	// every channel otherwise.
+	// In rendezvous mode, each server only hears about what we route through it.
+	int count = -1;
+	unsigned long long digest = 0;
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		if ((now < sd->renewAt) || sd->down) continue;
+		sd->renewAt = now + topology_renew_interval(tpd);
+
+		if (!(sd->batches)) {
+			topology_channels_send_server(tpd, serverAddr, sd, S2S_JOIN, currentChannel);
+			continue;
+		}
+		if ((count < 0) || tpd->rendezvous) digest = topology_digest(tpd, serverAddr, sd, currentChannel, &count);
+		topology_send_digest(tpd, serverAddr, sd, S2S_DIGEST, digest, count);
+	}
+
+	// Now, we need to review our server topology and age what's due.
 	for (int i = 0; i < tpd->size; i++) {
 		// Get the server topology for this.
 		ServerData *sd = (tpd->serverTopology)[i];
+		if (now < sd->ageAt) continue;
+		sd->ageAt += TOPOLOGY_RENEW;
+		if (sd->ageAt <= now) sd->ageAt = now + TOPOLOGY_RENEW;
 
 		// Age its topology.
 		const ChannelList *cl = sd->channelList;
@@ -168,7 +910,7 @@ static bool topology_renew(const Topology *tp, struct sockaddr_in *serverAddr, s
 			ChannelListData *outdatedData = (ChannelListData *)outdated->self;
 
 			// Treat this as receiving a leave call -- this will also clean up the channel structure.
-			tp->s2s_leave_recv(tp, serverAddr, sd->address, outdatedData->channelName);
+			topology_leave_channel(tp, serverAddr, sd->address, outdatedData->channelName);
 		}
 	}
 
@@ -178,6 +920,15 @@ static bool topology_renew(const Topology *tp, struct sockaddr_in *serverAddr, s
 static bool topology_s2s_join_send(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName) {
 	// Send this to all adjacent servers.
 	TopologyData *tpd = (TopologyData *)tp->self;
+	if (tpd->rendezvous) {
+		// Only toward the channel's home; nothing to do if that's us.
+		ServerData *sd = topology_upstream(tpd, serverAddr, channelName);
+		if ((sd == NULL) || ((address != NULL) && cmpaddress(*(sd->address), *address))) return true;
+		print_addresses(serverAddr, sd->address);
+		printf("send S2S Join %s\n", channelName);
+		topology_send_channel(tpd, serverAddr, sd, S2S_JOIN, channelName);
+		return true;
+	}
 	for (int i = 0; i < tpd->size; i++) {
 		// Print what we are sending to this server.
 		ServerData *sd = (tpd->serverTopology)[i];
@@ -191,18 +942,8 @@ static bool topology_s2s_join_send(const Topology *tp, struct sockaddr_in *serve
         // Add this channel to the channelList for this server.
         sd->channelList->add_channel(sd->channelList, channelName);
 
-        // Create our datagram.
-        request_server_join *datagram = (request_server_join *)malloc(sizeof(request_server_join));
-        memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
-        datagram->req_type = S2S_JOIN;
-        memcpy(datagram->req_channel, channelName, sizeof(char) * CHANNEL_MAX);
-
         // Send our datagram over.
-        int result = sendto(
-            sd->socket, datagram, sizeof(request_server_join), MSG_DONTWAIT,
-            (struct sockaddr *)(sd->address), sizeof(struct sockaddr_in)
-        );
-        if (result == -1) fprintf(stderr, "S2S join send failure. (%d)\n", result);
+        topology_send_channel(tpd, serverAddr, sd, S2S_JOIN, channelName);
 	}
 	return true;
 }
@@ -220,18 +961,8 @@ static bool topology_s2s_leave_send(const Topology *tp, struct sockaddr_in *serv
 	        // Take this channel out of the server's routing table.
 	        sd->channelList->remove_channel(sd->channelList, channelName);
 
-	        // Create our datagram.
-	        request_server_leave *datagram = (request_server_leave *)malloc(sizeof(request_server_leave));
-	        memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
-	        datagram->req_type = S2S_LEAVE;
-	        memcpy(datagram->req_channel, channelName, sizeof(char) * CHANNEL_MAX);
-
 	        // Send our datagram over.
-	        int result = sendto(
-	            sd->socket, datagram, sizeof(request_server_leave), MSG_DONTWAIT,
-	            (struct sockaddr *)(sd->address), sizeof(struct sockaddr_in)
-	        );
-	        if (result == -1) fprintf(stderr, "S2S leave send failure. (%d)\n", result);
+	        topology_send_channel(tpd, serverAddr, sd, S2S_LEAVE, channelName);
 		}
 	} else {
 		// We are only sending a leave to one server.
@@ -244,59 +975,241 @@ static bool topology_s2s_leave_send(const Topology *tp, struct sockaddr_in *serv
         // Take this channel out of the server's routing table.
         sd->channelList->remove_channel(sd->channelList, channelName);
 
-        // Create our datagram.
-        request_server_leave *datagram = (request_server_leave *)malloc(sizeof(request_server_leave));
-        memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
-        datagram->req_type = S2S_LEAVE;
-        memcpy(datagram->req_channel, channelName, sizeof(char) * CHANNEL_MAX);
-
         // Send our datagram over.
-        int result = sendto(
-            sd->socket, datagram, sizeof(request_server_leave), MSG_DONTWAIT,
-            (struct sockaddr *)(sd->address), sizeof(struct sockaddr_in)
-        );
-        if (result == -1) fprintf(stderr, "S2S leave send failure. (%d)\n", result);
+        topology_send_channel(tpd, serverAddr, sd, S2S_LEAVE, channelName);
 	}
 
 	// Mission success.
 	return true;
 }
-static bool topology_s2s_say_send(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *username, char *channelName, char *text, long long id) {
-	// Create our datagram.
-    request_server_say *datagram = (request_server_say *)malloc(sizeof(request_server_say));
-    memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
-    datagram->req_type = S2S_SAY;
-    memcpy(datagram->txt_username, username, sizeof(char) * USERNAME_MAX);
-    memcpy(datagram->txt_channel, channelName, sizeof(char) * CHANNEL_MAX);
-    memcpy(datagram->txt_text, text, sizeof(char) * SAY_MAX);
+static bool topology_flush_server(TopologyData *tpd, ServerData *sd) {
+	/*
+	 * Sends every batched say for one server in a single segmented send.
+	 * False if its socket is full; whatever didn't go out is kept to go
+	 * again, so the server never sees a say twice.
+	 */
+	if (sd->sayBatchCount == 0) return true;
+	int sent;
+	int result = udp_send_segments(sd->socket, sd->sayBatch, sizeof(request_server_say),
+	                               sd->sayBatchCount, sd->address, &sent);
+	tpd->sayDatagrams += sent;
+	if ((result == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+		// Keep only the tail the fallback didn't get to.
+		tpd->saySyscalls += sent;
+		sd->sayBatchCount -= sent;
+		memmove(sd->sayBatch, sd->sayBatch + (sizeof(request_server_say) * sent),
+		        sizeof(request_server_say) * sd->sayBatchCount);
+		return false;
+	}
+	if (result == -1) fprintf(stderr, "S2S say send failure. (%d)\n", result);
+	else tpd->saySyscalls += result;
+	sd->sayBatchCount = 0;
+	return true;
+}
+static bool topology_egress_send(TopologyData *tpd, ServerData *sd, request_server_say *datagram) {
+	/* Sends a say, or adds it to the server's batch with offload on; false if the socket's full. */
+	if (tpd->segmentOffload) {
+		if (sd->sayBatch == NULL) {
+			sd->sayBatch = (char *)malloc(sizeof(request_server_say) * UDP_OFFLOAD_MAX_SEGMENTS);
+			if (sd->sayBatch == NULL) {fprintf(stderr, "Out of memory"); return true;}
+		}
+		if ((sd->sayBatchCount >= UDP_OFFLOAD_MAX_SEGMENTS) && !topology_flush_server(tpd, sd)) return false;
+		memcpy(sd->sayBatch + (sizeof(request_server_say) * sd->sayBatchCount), datagram, sizeof(request_server_say));
+		sd->sayBatchCount += 1;
+		return true;
+	}
 
-    if (id == 0) {
-        // give it a random id
-        int randomData = open("/dev/urandom", O_RDONLY);
-        if (randomData < 0) {
-        	// Read error ... fallback to id 0
-        	datagram->id = 0;
-        	printf("WARNING: Could not read random data to generate say ID!\n");
-        } else {
-        	long long id;
-        	ssize_t result = read(randomData, &id, sizeof(long long));
-        	if (result < 0) {
-        		// BAD
-        		datagram->id = 0;
-        	} else datagram->id = id;
-        	close(randomData);
-        }
-        // store the id in pool
-    	tp->id_store(tp, datagram->id);
-    } else {
-    	// otherwise use the one we were passed
-    	datagram->id = id;
-    }
+	int result = topology_sendto(tpd, sd, datagram, sizeof(request_server_say));
+	if ((result == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return false;
+	if (result == -1) fprintf(stderr, "S2S say send failure. (%d)\n", result);
+	tpd->sayDatagrams += 1;
+	tpd->saySyscalls += 1;
+	return true;
+}
+static void topology_flow_recount(ServerData *sd, TopologyFlow *flow, int count) {
+	/* Moves a flow to the list of those holding count says, keeping track of the longest. */
+	if (flow->count > 0) {
+		if (flow->samePrevious != NULL) flow->samePrevious->sameNext = flow->sameNext;
+		else (sd->flowsByCount)[flow->count] = flow->sameNext;
+		if (flow->sameNext != NULL) flow->sameNext->samePrevious = flow->samePrevious;
+	}
+	flow->count = count;
+	flow->samePrevious = NULL;
+	flow->sameNext = NULL;
+	if (count > 0) {
+		flow->sameNext = (sd->flowsByCount)[count];
+		if (flow->sameNext != NULL) flow->sameNext->samePrevious = flow;
+		(sd->flowsByCount)[count] = flow;
+	}
 
-    // Forward it to EVERY SERVER with the channel.
-    bool hasSent = false;
+	// Counts move one at a time, so the longest moves at most one step.
+	if (count > sd->longest) sd->longest = count;
+	while ((sd->longest > 0) && ((sd->flowsByCount)[sd->longest] == NULL)) sd->longest -= 1;
+}
+static void topology_flow_free(ServerData *sd, TopologyFlow *flow) {
+	/* Frees a flow that's run dry, taking it out of the turn order and the index. */
+	if (flow->previous != NULL) flow->previous->next = flow->next;
+	else sd->flows = flow->next;
+	if (flow->next != NULL) flow->next->previous = flow->previous;
+	else sd->flowsTail = flow->previous;
+
+	TopologyFlow **link = &((sd->flowIndex)[flow->hash % TOPOLOGY_FLOW_BUCKETS]);
+	while (*link != flow) link = &((*link)->hashNext);
+	*link = flow->hashNext;
+	free(flow);
+}
+static void topology_flow_take(ServerData *sd, TopologyFlow *flow) {
+	/* Frees the oldest say in a flow, and the flow too if that was its last. */
+	TopologyQueued *entry = flow->head;
+	flow->head = entry->next;
+	if (flow->head == NULL) flow->tail = NULL;
+	free(entry);
+	sd->queued -= 1;
+	sd->queuedBytes -= sizeof(request_server_say);
+	topology_flow_recount(sd, flow, flow->count - 1);
+	if (flow->head == NULL) topology_flow_free(sd, flow);
+}
+static void topology_egress_pop(ServerData *sd) {
+	/* Takes the oldest say off the flow whose turn it is, and passes the turn on. */
+	TopologyFlow *flow = sd->flows;
+	bool last = (flow->count == 1);
+	topology_flow_take(sd, flow);
+	if (last || (flow->next == NULL)) return;
+
+	// Back of the line.
+	sd->flows = flow->next;
+	sd->flows->previous = NULL;
+	flow->next = NULL;
+	flow->previous = sd->flowsTail;
+	sd->flowsTail->next = flow;
+	sd->flowsTail = flow;
+}
+static void topology_egress_push(ServerData *sd, request_server_say *datagram) {
+	/* Queues a say in its channel's flow, making room by dropping the oldest of the longest flow. */
+	if (sd->flowIndex == NULL) {
+		sd->flowIndex = (TopologyFlow **)calloc(TOPOLOGY_FLOW_BUCKETS, sizeof(TopologyFlow *));
+		sd->flowsByCount = (TopologyFlow **)calloc(TOPOLOGY_EGRESS_DEPTH + 2, sizeof(TopologyFlow *));
+		if ((sd->flowIndex == NULL) || (sd->flowsByCount == NULL)) {
+			fprintf(stderr, "Out of memory");
+			free(sd->flowIndex);
+			free(sd->flowsByCount);
+			sd->flowIndex = sd->flowsByCount = NULL;
+			return;
+		}
+	}
+	TopologyQueued *entry = (TopologyQueued *)malloc(sizeof(TopologyQueued));
+	if (entry == NULL) {fprintf(stderr, "Out of memory"); return;}
+	entry->next = NULL;
+	memcpy(&(entry->datagram), datagram, sizeof(request_server_say));
+
+	unsigned long long hash = channel_list_hash(datagram->txt_channel);
+	TopologyFlow **bucket = &((sd->flowIndex)[hash % TOPOLOGY_FLOW_BUCKETS]);
+	TopologyFlow *flow = *bucket;
+	while ((flow != NULL) && ((flow->hash != hash) || (strncmp(flow->channel, datagram->txt_channel, CHANNEL_MAX) != 0)))
+		flow = flow->hashNext;
+	if (flow == NULL) {
+		// New flows wait for the turns already under way.
+		flow = (TopologyFlow *)malloc(sizeof(TopologyFlow));
+		if (flow == NULL) {fprintf(stderr, "Out of memory"); free(entry); return;}
+		memset(flow, 0, sizeof(TopologyFlow));
+		flow->hash = hash;
+		memcpy(flow->channel, datagram->txt_channel, CHANNEL_MAX);
+		flow->hashNext = *bucket;
+		*bucket = flow;
+		flow->previous = sd->flowsTail;
+		if (sd->flowsTail != NULL) sd->flowsTail->next = flow;
+		else sd->flows = flow;
+		sd->flowsTail = flow;
+	}
+	if (flow->tail != NULL) flow->tail->next = entry;
+	else flow->head = entry;
+	flow->tail = entry;
+	sd->queued += 1;
+	sd->queuedBytes += sizeof(request_server_say);
+	topology_flow_recount(sd, flow, flow->count + 1);
+
+	while (sd->queuedBytes > TOPOLOGY_EGRESS_BUDGET) {
+		topology_flow_take(sd, (sd->flowsByCount)[sd->longest]);
+		sd->dropped += 1;
+	}
+}
+static bool topology_egress_refill(TopologyData *tpd, ServerData *sd, double now) {
+	/* Tops up sd's token bucket; true if it holds a say's worth, as it always does unpaced. */
+	if (tpd->egressRate > 0) {
+		sd->tokens += (now - sd->tokensAt) * tpd->egressRate;
+		if (sd->tokens > TOPOLOGY_EGRESS_BURST) sd->tokens = TOPOLOGY_EGRESS_BURST;
+	}
+	sd->tokensAt = now;
+	return (tpd->egressRate <= 0) || (sd->tokens >= sizeof(request_server_say));
+}
+static void topology_egress_wait(TopologyData *tpd, ServerData *sd) {
+	/* Holds sd's queue until its socket takes more. */
+	sd->blocked = true;
+	sd->stalls += 1;
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLOUT;
+	event.data.fd = sd->socket;
+	if ((tpd->egressPoll < 0) || (epoll_ctl(tpd->egressPoll, EPOLL_CTL_ADD, sd->socket, &event) < 0)) {
+		// Nothing will tell us, so try again with the next say.
+		fprintf(stderr, "Could not wait for a neighbor's socket. (%d)\n", errno);
+		sd->blocked = false;
+	}
+}
+static void topology_egress_run(TopologyData *tpd, ServerData *sd, double now) {
+	/* Sends sd's queued says, a flow at a time, as far as its tokens and its socket allow. */
+	if (sd->blocked) return;
+	sd->egressAt = 0;
+	topology_egress_refill(tpd, sd, now);
+
+	while (sd->flows != NULL) {
+		if ((tpd->egressRate > 0) && (sd->tokens < sizeof(request_server_say))) {
+			sd->egressAt = now + ((sizeof(request_server_say) - sd->tokens) / tpd->egressRate);
+			topology_arm_timer(tpd);
+			break;
+		}
+		if (!topology_egress_send(tpd, sd, &(sd->flows->head->datagram))) {
+			topology_egress_wait(tpd, sd);
+			return;
+		}
+		topology_egress_pop(sd);
+		if (tpd->egressRate > 0) sd->tokens -= sizeof(request_server_say);
+	}
+	if (!topology_flush_server(tpd, sd)) topology_egress_wait(tpd, sd);
+}
+static void topology_egress_drop(TopologyData *tpd, ServerData *sd) {
+	/* Forgets every say waiting for sd, and stops waiting on its socket. */
+	while (sd->flows != NULL) {
+		TopologyFlow *next = sd->flows->next;
+		while (sd->flows->head != NULL) {
+			TopologyQueued *entry = sd->flows->head;
+			sd->flows->head = entry->next;
+			free(entry);
+		}
+		free(sd->flows);
+		sd->flows = next;
+	}
+	sd->flowsTail = NULL;
+	free(sd->flowIndex);
+	free(sd->flowsByCount);
+	sd->flowIndex = sd->flowsByCount = NULL;
+	sd->longest = 0;
+	sd->queued = 0;
+	sd->queuedBytes = 0;
+	sd->egressAt = 0;
+	if (sd->blocked && (tpd->egressPoll >= 0)) epoll_ctl(tpd->egressPoll, EPOLL_CTL_DEL, sd->socket, NULL);
+	sd->blocked = false;
+}
+static bool topology_say_forward(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, request_server_say *datagram) {
+	/*
+	 * Sends a finished S2S say, byte for byte, to every server on its
+	 * channel except address. Returns true if anyone got it.
+	 */
+	bool hasSent = false;
     // printf("S2S SAY - Forwarding message..\n");
 	TopologyData *tpd = (TopologyData *)tp->self;
+	ServerData *upstream = tpd->rendezvous ? topology_upstream(tpd, serverAddr, datagram->txt_channel) : NULL;
+	double now = topology_now();
 	for (int i = 0; i < tpd->size; i++) {
 		// Print what we are sending to this server.
 		ServerData *sd = (tpd->serverTopology)[i];
@@ -307,30 +1220,100 @@ static bool topology_s2s_say_send(const Topology *tp, struct sockaddr_in *server
 			if (cmpaddress(*(sd->address), *address)) continue;
 		}
 
-		// Is this server sendable?
-		if (!(sd->channelList->has_channel(sd->channelList, channelName))) {
+		// Keep to the tree where link state has one; rendezvous trees are per channel.
+		if (!(tpd->rendezvous) && tpd->linkState->off_tree(tpd->linkState, serverAddr, sd->address)) continue;
+
+		// Is this server sendable? Toward the home always is.
+		if ((sd != upstream) && !(sd->channelList->has_channel(sd->channelList, datagram->txt_channel))) {
 			// printf("S2S SAY - Attempted to send message to a server, but they were not present in routing table\n");
 			continue;
 		}
 
 		// OK, begin print and start sending!
 		print_addresses(serverAddr, sd->address);
-        printf("send S2S Say %s %s \"%s\"\n", username, channelName, text);
+        printf("send S2S Say %s %s \"%s\"\n", datagram->txt_username, datagram->txt_channel, datagram->txt_text);
         hasSent = true;
 
-        // Send our datagram over.
-        int result = sendto(
-            sd->socket, datagram, sizeof(request_server_say), MSG_DONTWAIT,
-            (struct sockaddr *)(sd->address), sizeof(struct sockaddr_in)
-        );
-        if (result == -1) fprintf(stderr, "S2S say send failure. (%d)\n", result);
+        // Nothing queued ahead of it and nothing holding it back: out it goes, uncopied.
+        if ((sd->flows == NULL) && !(sd->blocked) && topology_egress_refill(tpd, sd, now)) {
+        	if (topology_egress_send(tpd, sd, datagram)) {
+        		if (tpd->egressRate > 0) sd->tokens -= sizeof(request_server_say);
+        		continue;
+        	}
+        	topology_egress_push(sd, datagram);
+        	topology_egress_wait(tpd, sd);
+        	continue;
+        }
+
+        // Otherwise it waits its turn; with offload on, the queue drains into the batch at flush.
+        topology_egress_push(sd, datagram);
+        if (!(tpd->segmentOffload)) topology_egress_run(tpd, sd, now);
 	}
 
+	return hasSent;
+}
+static bool topology_s2s_say_send(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *username, char *channelName, char *text, long long id) {
+	// Create our datagram.
+    request_server_say *datagram = (request_server_say *)malloc(sizeof(request_server_say));
+    memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
+    datagram->req_type = S2S_SAY;
+    memcpy(datagram->txt_username, username, sizeof(char) * USERNAME_MAX);
+    memcpy(datagram->txt_channel, channelName, sizeof(char) * CHANNEL_MAX);
+    memcpy(datagram->txt_text, text, sizeof(char) * SAY_MAX);
+
+    if (id == 0) {
+        // give it a random id, and store it in the pool
+        datagram->id = topology_new_id((TopologyData *)(tp->self));
+    	tp->id_store(tp, datagram->id);
+    } else {
+    	// otherwise use the one we were passed
+    	datagram->id = id;
+    }
+
+    // Forward it to EVERY SERVER with the channel.
+    bool hasSent = topology_say_forward(tp, serverAddr, address, datagram);
+
 	// cleanup
 	free(datagram);
 	return hasSent;
 }
-static bool topology_s2s_join_recv(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName) {
+static bool topology_s2s_say_originate(const Topology *tp, struct sockaddr_in *serverAddr, request_server_say *datagram) {
+	/* Stamps a new ID on an encoded say from one of our users and sends it everywhere. */
+	datagram->id = topology_new_id((TopologyData *)(tp->self));
+	tp->id_store(tp, datagram->id);
+	return topology_say_forward(tp, serverAddr, NULL, datagram);
+}
+static bool topology_prune(const Topology *tp, struct sockaddr_in *serverAddr, char *channelName) {
+	/*
+	 * Leaves a channel none of our users are in, unless other servers
+	 * still hear it through us. Returns true if we left.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	if (tpd->stopping) return true;
+	if (tpd->rendezvous) {
+		// Off the tree once nobody joined through us; tell the way home.
+		if (topology_downstream(tpd, channelName)) return false;
+		ServerData *upstream = topology_upstream(tpd, serverAddr, channelName);
+		if (upstream != NULL) {
+			print_addresses(serverAddr, upstream->address);
+			printf("send S2S Leave %s\n", channelName);
+			topology_send_channel(tpd, serverAddr, upstream, S2S_LEAVE, channelName);
+		}
+		return true;
+	}
+
+	// Flooded, only a leaf of the say tree can go; its one branch stops sending to it.
+	int branches = 0;
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		if (tpd->linkState->off_tree(tpd->linkState, serverAddr, sd->address)) continue;
+		if (sd->channelList->has_channel(sd->channelList, channelName)) branches += 1;
+	}
+	if (branches > 1) return false;
+	tp->s2s_leave_send(tp, serverAddr, NULL, channelName);
+	return true;
+}
+static bool topology_join_channel(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName) {
     // Does the channel exist for us?
 	print_addresses(serverAddr, address);
     printf("recv S2S Join %s\n", channelName);
@@ -361,7 +1344,7 @@ static bool topology_s2s_join_recv(const Topology *tp, struct sockaddr_in *serve
     // We're done here.
     return true;
 }
-static bool topology_s2s_leave_recv(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName) {
+static bool topology_leave_channel(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName) {
 	// First, go ahead and print that we received this call.
 	print_addresses(serverAddr, address);
     printf("recv S2S Leave %s\n", channelName);
@@ -369,48 +1352,470 @@ static bool topology_s2s_leave_recv(const Topology *tp, struct sockaddr_in *serv
     // When we receive this call, we need to go ahead and remove the channel from the address's routing table.
     ServerData *sd = tp->find_server(tp, address);
     if (sd != NULL) {
+    	// The name may be the table's own, so find our channel before it goes.
+    	struct Channel *channel = topology_get_channel(channelName, false);
     	sd->channelList->remove_channel(sd->channelList, channelName);
+
+    	// A branch with nobody left on it prunes itself, right up the tree.
+    	if ((channel != NULL) && (channel->userCount == 0) && topology_prune(tp, serverAddr, channel->channelName))
+    		cleanup_channel(channel);
     	return true;
     }
 
     // We couldn't remove the channel, so return failure.
     return false;
 }
-static bool topology_s2s_say_recv(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, long long id, char *username, char *channelName, char *text) {
+static bool topology_s2s_join_recv(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName) {
+	((TopologyData *)(tp->self))->controlReceived += 1;
+	return topology_join_channel(tp, serverAddr, address, channelName);
+}
+static bool topology_s2s_leave_recv(const Topology *tp, struct sockaddr_in *serverAddr, struct sockaddr_in *address, char *channelName) {
+	((TopologyData *)(tp->self))->controlReceived += 1;
+	return topology_leave_channel(tp, serverAddr, address, channelName);
+}
+static bool topology_s2s_say_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_say *datagram) {
+	/*
+	 * Handles a say from another server, forwarding the received bytes as
+	 * they are. Returns true if it's new here and local users should get it.
+	 */
+	// Remember who handed it to us before we stamp it as ours.
+	struct sockaddr_in address;
+	memcpy(&address, &(datagram->address), sizeof(struct sockaddr_in));
+
 	// Print the receival addresses.
-	print_addresses(serverAddr, address);
-    printf("recv S2S Say %s %s \"%s\"\n", username, channelName, text);
+	print_addresses(serverAddr, &address);
+    printf("recv S2S Say %s %s \"%s\"\n", datagram->txt_username, datagram->txt_channel, datagram->txt_text);
+
+	// Reverse-path check: with a tree, says only ever arrive along it.
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	const LinkState *ls = tpd->linkState;
+	if (!(tpd->rendezvous) && ls->off_tree(ls, serverAddr, &address)) {
+		// printf("Declining S2S Say Recv - off the tree\n");
+		return false;
+	}
 
 	// Have we already received this ID?
-	if (tp->id_has(tp, id)) {
+	if (tp->id_has(tp, datagram->id)) {
 		// If we have, then this message is a duplicate -- we can break
 		// off from the tree from this address by sending that server a leave call.
-		tp->s2s_leave_send(tp, serverAddr, address, channelName);
+		// Tree links stay joined; a duplicate on one is a tree in flux.
+		if (!(tpd->rendezvous) && !(ls->on_tree(ls, serverAddr, &address)))
+			tp->s2s_leave_send(tp, serverAddr, &address, datagram->txt_channel);
 		// printf("Declining S2S Say Recv - duplicate\n");
 		return false;
 	}
 
     // is anyone here even in this channel?
-    struct Channel *channel = get_channel(channelName, false);
+    struct Channel *channel = get_channel(datagram->txt_channel, false);
+    if ((channel == NULL) && tpd->rendezvous && topology_downstream(tpd, datagram->txt_channel))
+    	// Our last user left, but we're still on the way for others.
+    	channel = get_channel(datagram->txt_channel, true);
     if (channel == NULL) {
     	// channel does not even exist for us, ignore the call
     	// printf("Declining S2S Say Recv - channel does not exist\n");
     	return false;
     }
 
-    // store and forward (get it??)
-    tp->id_store(tp, id);
-    // printf("Accepting S2S Say Recv - sending forward\n");
-    bool hasSent = tp->s2s_say_send(tp, serverAddr, address, username, channelName, text, id);
-    if ((hasSent == false) && (channel->userCount == 0)) {
+    // store and forward (get it??) -- only the sender changes on the way through
+    tp->id_store(tp, datagram->id);
+    memcpy(&(datagram->address), serverAddr, sizeof(struct sockaddr_in));
+    bool hasSent = topology_say_forward(tp, serverAddr, &address, datagram);
+    if ((hasSent == false) && (channel->userCount == 0) && !(tpd->rendezvous)) {
     	// We couldn't send it to anyone, so reply with a leave.
-    	tp->s2s_leave_send(tp, serverAddr, NULL, channelName);
+    	tp->s2s_leave_send(tp, serverAddr, NULL, datagram->txt_channel);
     	cleanup_channel(channel);
     	return false;
     }
     // All is well
     return true;
 }
+static bool topology_s2s_channels_send(const Topology *tp, struct sockaddr_in *serverAddr, s2s_t type, struct ChannelRef *channelList) {
+	/* Joins or leaves every channel in the list with every server. */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	for (int i = 0; i < tpd->size; i++)
+		if (!topology_channels_send_server(tpd, serverAddr, (tpd->serverTopology)[i], type, channelList)) return false;
+	return true;
+}
+static bool topology_apply_channels(const Topology *tp, struct sockaddr_in *serverAddr, request_server_channels *datagram) {
+	/* Handles a batch as that many single joins or leaves. */
+	print_addresses(serverAddr, &(datagram->address));
+	printf("recv S2S %s batch of %d\n", (datagram->req_type == S2S_JOIN_BATCH) ? "Join" : "Leave", datagram->req_count);
+
+	// They understand batches from now on.
+	ServerData *sd = tp->find_server(tp, &(datagram->address));
+	if (sd == NULL) return false;
+	sd->batches = true;
+
+	// Never read past the datagram, whatever the count claims.
+	int count = datagram->req_count;
+	if ((count < 0) || ((size_t)count > TOPOLOGY_BATCH_CHANNELS)) return false;
+	for (int i = 0; i < count; i++) {
+		char *channelName = datagram->req_channels[i];
+		channelName[CHANNEL_MAX - 1] = '\0';
+		if (channelName[0] == '\0') continue;
+		if (datagram->req_type == S2S_JOIN_BATCH) topology_join_channel(tp, serverAddr, &(datagram->address), channelName);
+		else topology_leave_channel(tp, serverAddr, &(datagram->address), channelName);
+	}
+	return true;
+}
+static bool topology_s2s_channels_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_channels *datagram) {
+	((TopologyData *)(tp->self))->controlReceived += 1;
+	return topology_apply_channels(tp, serverAddr, datagram);
+}
+static void topology_send_ack(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd) {
+	/* Tells sd how far we've applied its reliable datagrams. */
+	print_addresses(serverAddr, sd->address);
+	printf("send S2S Ack %u\n", sd->peerSeq);
+
+	request_server_ack datagram;
+	memset(&datagram, 0, sizeof(datagram));
+	memcpy((void *)(&datagram.address), serverAddr, sizeof(struct sockaddr_in));
+	datagram.req_type = S2S_ACK;
+	datagram.req_epoch = sd->peerEpoch;
+	datagram.req_seq = sd->peerSeq;
+
+	int result = topology_sendto(tpd, sd, &datagram, sizeof(request_server_ack));
+	if (result == -1) fprintf(stderr, "S2S ack send failure. (%d)\n", result);
+	tpd->controlDatagrams += 1;
+}
+static bool topology_s2s_reliable_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_reliable *datagram) {
+	/*
+	 * Applies a reliable batch if it's the next one from its sender, and
+	 * acks whatever arrives. Anything after a gap is dropped; the sender
+	 * goes back and sends it all again.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	tpd->controlReceived += 1;
+	print_addresses(serverAddr, &(datagram->address));
+	printf("recv S2S Reliable %u\n", datagram->req_seq);
+
+	ServerData *sd = tp->find_server(tp, &(datagram->address));
+	if (sd == NULL) return false;
+	sd->batches = true;
+
+	// A new epoch is a restart, or a sender that gave up on us; pick up where it is.
+	if (!(sd->peerKnown) || (datagram->req_epoch != sd->peerEpoch)) {
+		sd->peerKnown = true;
+		sd->peerEpoch = datagram->req_epoch;
+		sd->peerSeq = datagram->req_seq - 1;
+	}
+
+	if (datagram->req_seq == sd->peerSeq + 1) {
+		sd->peerSeq = datagram->req_seq;
+
+		// Never read past the datagram, whatever the count claims.
+		request_server_channels *payload = (request_server_channels *)(datagram->req_payload);
+		bool valid = (payload->req_type == S2S_JOIN_BATCH) || (payload->req_type == S2S_LEAVE_BATCH);
+		if (valid && (payload->req_count >= 0) && ((size_t)payload->req_count <= TOPOLOGY_PACK_CHANNELS))
+			topology_apply_channels(tp, serverAddr, payload);
+	}
+	topology_send_ack(tpd, serverAddr, sd);
+	return true;
+}
+static bool topology_s2s_ack_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_ack *datagram) {
+	/* Forgets what a server has acked, timing the round trip, and sends more. */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	tpd->controlReceived += 1;
+	print_addresses(serverAddr, &(datagram->address));
+	printf("recv S2S Ack %u\n", datagram->req_seq);
+
+	ServerData *sd = tp->find_server(tp, &(datagram->address));
+	if (sd == NULL) return false;
+	sd->batches = true;
+
+	// Acks for an epoch we gave up on, or for what we never sent, mean nothing.
+	unsigned int seq = datagram->req_seq;
+	if ((datagram->req_epoch != sd->sendEpoch) || ((int)(seq - sd->sendSeq) > 0)) return false;
+
+	if ((int)(seq - sd->ackedSeq) <= 0) {
+		// Nothing new: they're dropping what came after a loss, so don't wait for the timeout.
+		if ((sd->unacked != NULL) && (sd->unacked->sentAt > 0) && (++(sd->dupAcks) == TOPOLOGY_DUP_ACKS)) {
+			tpd->fastRetransmitted += 1;
+			topology_reliable_push(tpd, serverAddr, sd, true);
+		}
+		return true;
+	}
+	sd->ackedSeq = seq;
+	sd->dupAcks = 0;
+
+	double now = topology_now();
+	while ((sd->unacked != NULL) && ((int)(sd->unacked->seq - seq) <= 0)) {
+		TopologyUnacked *entry = sd->unacked;
+
+		// Only time what went out once; a retransmission's ack is ambiguous.
+		if ((entry->seq == seq) && (entry->transmissions == 1)) {
+			double sample = now - entry->sentAt;
+			if (sd->srtt == 0) {
+				sd->srtt = sample;
+				sd->rttvar = sample / 2;
+			} else {
+				sd->rttvar = (0.75 * sd->rttvar) + (0.25 * fabs(sd->srtt - sample));
+				sd->srtt = (0.875 * sd->srtt) + (0.125 * sample);
+			}
+			sd->rto = sd->srtt + (4 * sd->rttvar);
+			if (sd->rto < TOPOLOGY_RTO_MIN) sd->rto = TOPOLOGY_RTO_MIN;
+			if (sd->rto > TOPOLOGY_RTO_MAX) sd->rto = TOPOLOGY_RTO_MAX;
+		}
+		sd->unacked = entry->next;
+		sd->unackedCount -= 1;
+		free(entry);
+	}
+	topology_reliable_push(tpd, serverAddr, sd, false);
+	return true;
+}
+static int topology_get_timer_fd(const Topology *tp) {
+	return ((TopologyData *)(tp->self))->timer;
+}
+static double topology_phi(ServerData *sd, double now) {
+	/* How sure we are that sd is gone: -log10 of the chance a heartbeat is still this late. */
+	double stddev = sqrt(sd->helloVar);
+	if (stddev < TOPOLOGY_PHI_MIN_STDDEV) stddev = TOPOLOGY_PHI_MIN_STDDEV;
+	double y = (now - sd->lastHello - (sd->helloMean + TOPOLOGY_HELLO_PAUSE)) / stddev;
+
+	// The logistic approximation of the normal tail.
+	double e = exp(-y * (1.5976 + (0.070566 * y * y)));
+	return (y > 0) ? -log10(e / (1 + e)) : -log10(1 - (1 / (1 + e)));
+}
+static unsigned int topology_link_cost(ServerData *sd) {
+	/* What a link costs as measured: its round trip, inflated by the transmissions loss costs. */
+	double loss = (sd->linkLoss < 0.9) ? sd->linkLoss : 0.9;
+	double cost = (1 + ((sd->rttMin * 1000) / TOPOLOGY_COST_MS)) / (1 - loss);
+	return (unsigned int)(cost + 0.5);
+}
+static bool topology_renew(const Topology *tp, struct sockaddr_in *serverAddr, struct ChannelRef *currentChannel);
+static void topology_neighbor_down(const Topology *tp, struct sockaddr_in *serverAddr, ServerData *sd) {
+	/*
+	 * Withdraws everything routed through a neighbor that's stopped
+	 * answering and moves paths off it now, rather than when its routes
+	 * and advertisement expire. Everyone then renews along the new paths.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	sd->down = true;
+	tpd->failovers += 1;
+	topology_reliable_drop(sd);
+	topology_egress_drop(tpd, sd);
+
+	// As if it left every channel it joined through us.
+	ChannelListData *cld = (ChannelListData *)(sd->channelList->self);
+	while (cld->channelName != NULL) topology_leave_channel(tp, serverAddr, sd->address, cld->channelName);
+
+	// Those leaves may have emptied channels out, the list's first among them.
+	topology_originate_lsa(tpd, serverAddr, false);
+	topology_renew(tp, serverAddr, get_channel_list());
+}
+static void topology_run_gossip(const Topology *tp, struct sockaddr_in *serverAddr, double now);
+static void topology_run_timers(const Topology *tp, struct sockaddr_in *serverAddr, struct ChannelRef *) {
+	/*
+	 * Sends heartbeats when they're due, routing around neighbors whose
+	 * own have stopped and re-advertising links whose cost has moved,
+	 * and says pacing was holding back. Then sends every server's window again whose oldest datagram has
+	 * gone unacked too long.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	uint64_t expirations;
+	if (read(tpd->timer, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+	double now = topology_now();
+	topology_release_delayed(tpd, now);
+	if ((now >= tpd->helloAt) && !(tpd->stopping)) {
+		// Jittered a little, so neighbors' heartbeats don't march in step.
+		tpd->helloAt = now + (TOPOLOGY_HELLO_INTERVAL * (0.9 + (0.2 * topology_random(tpd))));
+
+		request_server_hello datagram;
+		memset(&datagram, 0, sizeof(datagram));
+		memcpy((void *)(&datagram.address), serverAddr, sizeof(struct sockaddr_in));
+		datagram.req_type = S2S_HELLO;
+		datagram.req_seq = ++(tpd->helloSeq);
+		datagram.req_stamp = (long long)(now * 1e6);
+		bool moved = false;
+		for (int i = 0; i < tpd->size; i++) {
+			ServerData *sd = (tpd->serverTopology)[i];
+			datagram.req_echo = sd->echoStamp;
+			datagram.req_held = (sd->echoStamp != 0) ? (long long)((now - sd->echoAt) * 1e6) : 0;
+			int result = topology_sendto(tpd, sd, &datagram, sizeof(request_server_hello));
+			if (result == -1) fprintf(stderr, "S2S hello send failure. (%d)\n", result);
+
+			// Only those we've heard heartbeats from are watched; ex_server never sends any.
+			if (sd->down || (sd->lastHello == 0)) continue;
+			double phi = topology_phi(sd, now);
+			if (phi >= TOPOLOGY_PHI_THRESHOLD) {
+				print_addresses(serverAddr, sd->address);
+				printf("S2S neighbor down, silent %.2fs (phi %.1f)\n", now - sd->lastHello, phi);
+				topology_neighbor_down(tp, serverAddr, sd);
+				continue;
+			}
+
+			// Has its cost moved by more than half what we advertise?
+			unsigned int cost = topology_link_cost(sd);
+			int moves = abs((int)cost - (int)(sd->cost));
+			if ((sd->rttMin > 0) && (2 * moves > (int)(sd->cost)) && (moves >= TOPOLOGY_COST_STEP) && (now >= tpd->costAt)) {
+				print_addresses(serverAddr, sd->address);
+				printf("S2S link cost %u -> %u (rtt %.2fms, loss %.1f%%)\n", sd->cost, cost, sd->rttMin * 1000, sd->linkLoss * 100);
+				sd->cost = cost;
+				moved = true;
+			}
+		}
+		if (moved) {
+			tpd->costAt = now + TOPOLOGY_COST_HOLD;
+			topology_originate_lsa(tpd, serverAddr, false);
+		}
+	}
+	if ((tpd->membership != NULL) && !(tpd->stopping)) topology_run_gossip(tp, serverAddr, now);
+
+	// Pacing has let more says through.
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		if ((sd->egressAt > 0) && (sd->egressAt <= now)) topology_egress_run(tpd, sd, now);
+	}
+
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		TopologyUnacked *oldest = sd->unacked;
+		if ((oldest == NULL) || (oldest->sentAt == 0) || (oldest->sentAt + sd->rto > now)) continue;
+		if (oldest->transmissions > TOPOLOGY_MAX_RETRIES) {
+			print_addresses(serverAddr, sd->address);
+			printf("S2S Reliable %u unacked after %d tries, resyncing\n", oldest->seq, oldest->transmissions);
+			topology_reliable_reset(tpd, sd);
+			continue;
+		}
+
+		// Back off until an ack comes back.
+		sd->rto *= 2;
+		if (sd->rto > TOPOLOGY_RTO_MAX) sd->rto = TOPOLOGY_RTO_MAX;
+		topology_reliable_push(tpd, serverAddr, sd, true);
+	}
+	topology_arm_timer(tpd);
+}
+static void topology_set_loss(const Topology *tp, double loss) {
+	/* Makes every datagram we send another server (bar segmented say bursts) go missing with this probability. */
+	((TopologyData *)(tp->self))->loss = loss;
+}
+static void topology_set_delay(const Topology *tp, double delay) {
+	/* Holds every datagram we send another server (bar segmented say bursts) this long. */
+	((TopologyData *)(tp->self))->delay = delay;
+}
+static bool topology_s2s_hello_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_hello *datagram) {
+	/* Times a neighbor's heartbeat, and takes it back if we'd given up on it. */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	ServerData *sd = tp->find_server(tp, &(datagram->address));
+	if (sd == NULL) return false;
+
+	double now = topology_now();
+	if (sd->down) {
+		print_addresses(serverAddr, sd->address);
+		printf("S2S neighbor up\n");
+		sd->down = false;
+		sd->lastHello = 0;
+		sd->lastHelloSeq = 0;
+		sd->renewAt = now;
+		topology_originate_lsa(tpd, serverAddr, false);
+		topology_send_database(tpd, serverAddr, sd);
+	} else if (sd->fresh) {
+		// Just added, and it has us too: it needs our links, and our channels by digest.
+		print_addresses(serverAddr, sd->address);
+		printf("S2S neighbor answered\n");
+		sd->fresh = false;
+		sd->batches = true;
+		sd->renewAt = now;
+		topology_originate_lsa(tpd, serverAddr, false);
+		topology_send_database(tpd, serverAddr, sd);
+	}
+
+	// Our stamp, back with how long they sat on it, is a round trip.
+	if (datagram->req_echo != 0) {
+		double sample = now - ((datagram->req_echo + datagram->req_held) / 1e6);
+		if (sample >= 0) {
+			if (sd->linkRtt == 0) sd->linkRtt = sample;
+			else sd->linkRtt += TOPOLOGY_RTT_SMOOTHING * (sample - sd->linkRtt);
+
+			// The least over this window and the last, once there's been one.
+			if ((sd->rttMin > 0) && (sample < sd->rttMin)) sd->rttMin = sample;
+			if ((sd->rttWindowMin == 0) || (sample < sd->rttWindowMin)) sd->rttWindowMin = sample;
+			if (sd->rttWindowEnd == 0) sd->rttWindowEnd = now + TOPOLOGY_RTT_WINDOW;
+			else if (now >= sd->rttWindowEnd) {
+				sd->rttMin = sd->rttWindowMin;
+				sd->rttWindowMin = 0;
+				sd->rttWindowEnd = now + TOPOLOGY_RTT_WINDOW;
+			}
+		}
+	}
+	sd->echoStamp = datagram->req_stamp;
+	sd->echoAt = now;
+
+	// Each heartbeat missing since the last counts toward the loss; a restart starts over.
+	unsigned int gap = datagram->req_seq - sd->lastHelloSeq - 1;
+	if ((sd->lastHelloSeq != 0) && ((int)gap >= 0) && (gap < 1000))
+		for (unsigned int i = 0; i < gap; i++) sd->linkLoss += TOPOLOGY_LOSS_SMOOTHING * (1 - sd->linkLoss);
+	sd->linkLoss -= TOPOLOGY_LOSS_SMOOTHING * sd->linkLoss;
+	sd->lastHelloSeq = datagram->req_seq;
+
+	// Smoothed mean and variance of the spacing; the first just starts the clock.
+	if (sd->lastHello > 0) {
+		double diff = (now - sd->lastHello) - sd->helloMean;
+		sd->helloMean += 0.1 * diff;
+		sd->helloVar = 0.9 * (sd->helloVar + (0.1 * diff * diff));
+	} else {
+		sd->helloMean = TOPOLOGY_HELLO_INTERVAL;
+		sd->helloVar = 0;
+	}
+	sd->lastHello = now;
+	return true;
+}
+static bool topology_s2s_digest_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_digest *datagram, struct ChannelRef *channelList) {
+	/*
+	 * A digest renews everything we have for its sender if it matches
+	 * our table for them, and asks them to resync if not. A resync
+	 * request gets every channel we have, batched.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	tpd->controlReceived += 1;
+	print_addresses(serverAddr, &(datagram->address));
+	printf("recv S2S %s of %d channels\n", (datagram->req_type == S2S_DIGEST) ? "Digest" : "Resync", datagram->req_count);
+
+	ServerData *sd = tp->find_server(tp, &(datagram->address));
+	if (sd == NULL) return false;
+	sd->batches = true;
+
+	if (datagram->req_type == S2S_RESYNC)
+		return topology_channels_send_server(tpd, serverAddr, sd, S2S_JOIN, channelList);
+
+	int count = 0;
+	unsigned long long digest = sd->channelList->digest(sd->channelList, &count);
+	if ((digest == datagram->req_digest) && (count == datagram->req_count)) {
+		sd->channelList->renew_all(sd->channelList);
+		return true;
+	}
+	topology_send_digest(tpd, serverAddr, sd, S2S_RESYNC, digest, count);
+	return true;
+}
+static bool topology_s2s_lsa_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_lsa *datagram) {
+	/* Keeps an advertisement that's news and floods it on to everyone but its sender. */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	tpd->controlReceived += 1;
+	print_addresses(serverAddr, &(datagram->address));
+	printf("recv S2S LSA %u of %d links\n", datagram->req_seq, datagram->req_count);
+
+	// Never read past the datagram, whatever the count claims.
+	int count = datagram->req_count;
+	if ((count < 0) || ((size_t)count > (BUFFER_SIZE - sizeof(request_server_lsa)) / sizeof(struct server_link))) return false;
+
+	// Only our own kind advertise, so the hop takes batches and reliable joins.
+	ServerData *hop = tp->find_server(tp, &(datagram->address));
+	if (hop != NULL) hop->batches = true;
+
+	// Our own come back around; they're never news.
+	if (cmpaddress(datagram->origin, *serverAddr)) return false;
+	if (!(tpd->linkState->update(tpd->linkState, &(datagram->origin), datagram->req_seq, datagram->req_links, count)))
+		return false;
+
+	struct sockaddr_in address;
+	memcpy(&address, &(datagram->address), sizeof(struct sockaddr_in));
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		if (!cmpaddress(*(sd->address), address)) topology_send_lsa(tpd, serverAddr, sd, datagram);
+	}
+	return true;
+}
 static void topology_id_store(const Topology *tp, long long id) {
 	/* stores an ID in the id pool */
 	// get the data
@@ -436,6 +1841,383 @@ static bool topology_id_has(const Topology *tp, long long id) {
 	return false;
 }
 
+static void topology_set_segment_offload(const Topology *tp, bool enabled) {
+	/* Batches says per server into UDP_SEGMENT sends. */
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	if (!enabled) tp->flush(tp);
+	tpd->segmentOffload = enabled;
+}
+static void topology_flush(const Topology *tp) {
+	/* Pushes out every queued and batched say that may go. */
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	double now = topology_now();
+	for (int i = 0; i < tpd->size; i++)
+		topology_egress_run(tpd, (tpd->serverTopology)[i], now);
+}
+
+static bool topology_s2s_channel_empty(const Topology *tp, struct sockaddr_in *serverAddr, char *channelName) {
+	return topology_prune(tp, serverAddr, channelName);
+}
+static void topology_farewell(TopologyData *tpd, struct sockaddr_in *serverAddr, ServerData *sd, struct ChannelRef *channelList) {
+	/* Sends a server a Leave for every channel either of us routes through the other, batched where understood. */
+	request_server_channels *datagram = (request_server_channels *)malloc(BUFFER_SIZE);
+	if (datagram == NULL) {fprintf(stderr, "Out of memory"); return;}
+	memset(datagram, 0, BUFFER_SIZE);
+	memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
+	datagram->req_type = S2S_LEAVE_BATCH;
+
+	// Ours, and whatever they joined through us, once each.
+	const ChannelList *leaving = ChannelList_create();
+	for (struct ChannelRef *channelRef = channelList; channelRef != NULL; channelRef = channelRef->_next) {
+		if ((channelRef->_this == NULL) || (channelRef->_this->channelName == NULL)) break;
+		leaving->add_channel(leaving, channelRef->_this->channelName);
+	}
+	for (ChannelListData *cld = (ChannelListData *)(sd->channelList->self); cld != NULL;
+	     cld = (cld->next != NULL) ? (ChannelListData *)(cld->next->self) : NULL)
+		if (cld->channelName != NULL) leaving->add_channel(leaving, cld->channelName);
+
+	for (ChannelListData *cld = (ChannelListData *)(leaving->self); cld != NULL;
+	     cld = (cld->next != NULL) ? (ChannelListData *)(cld->next->self) : NULL)
+		if (cld->channelName != NULL) topology_pack_channel(tpd, serverAddr, sd, S2S_LEAVE, datagram, cld->channelName);
+	if (datagram->req_count > 0) topology_send_batch(tpd, serverAddr, sd, datagram);
+	leaving->cleanup(leaving);
+	free(datagram);
+}
+static void topology_shutdown(const Topology *tp, struct sockaddr_in *serverAddr, struct ChannelRef *channelList) {
+	/*
+	 * Says goodbye to each server, then sends an advertisement with no
+	 * links so paths move off us at once.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	for (int i = 0; i < tpd->size; i++)
+		topology_farewell(tpd, serverAddr, (tpd->serverTopology)[i], channelList);
+
+	topology_originate_lsa(tpd, serverAddr, true);
+	tpd->stopping = true;
+	fflush(stdout);
+}
+static ServerData *topology_attach(TopologyData *tpd, struct sockaddr_in *serverAddr, int socket, struct sockaddr_in *address) {
+	/*
+	 * Adds a neighbor while we run. Nothing goes to it but heartbeats
+	 * until it answers one, having added us too; then it gets our links
+	 * and a digest, and only the channels it's missing follow.
+	 */
+	ServerData *sd = topology_insert(tpd, socket, address);
+	if (sd == NULL) return NULL;
+	sd->fresh = true;
+	print_addresses(serverAddr, sd->address);
+	printf("S2S neighbor added\n");
+	return sd;
+}
+static void topology_detach(const Topology *tp, struct sockaddr_in *serverAddr, int index) {
+	/*
+	 * Removes a neighbor while we run: it gets a Leave for everything
+	 * between us, and what it joined through us is withdrawn as if it had
+	 * left. Its heartbeats stop, so it routes around us even if the
+	 * Leaves go missing. Our links need re-advertising after.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	ServerData *sd = (tpd->serverTopology)[index];
+
+	topology_egress_run(tpd, sd, topology_now());
+	topology_egress_drop(tpd, sd);
+	topology_farewell(tpd, serverAddr, sd, get_channel_list());
+	sd->down = true;
+	topology_reliable_drop(sd);
+	ChannelListData *cld = (ChannelListData *)(sd->channelList->self);
+	while (cld->channelName != NULL) topology_leave_channel(tp, serverAddr, sd->address, cld->channelName);
+
+	// Forget it, and anything the delay shim still holds for it.
+	for (TopologyDelayed **held = &(tpd->delayed); *held != NULL;) {
+		if ((*held)->sd != sd) {held = &((*held)->next); continue;}
+		TopologyDelayed *next = (*held)->next;
+		free(*held);
+		*held = next;
+	}
+	tpd->delayedTail = NULL;
+	for (TopologyDelayed *held = tpd->delayed; held != NULL; held = held->next) tpd->delayedTail = held;
+	for (int i = index; i < (tpd->size - 1); i++) (tpd->serverTopology)[i] = (tpd->serverTopology)[i + 1];
+	tpd->size -= 1;
+
+	print_addresses(serverAddr, sd->address);
+	printf("S2S neighbor removed\n");
+	sd->channelList->cleanup(sd->channelList);
+	if (sd->sayBatch != NULL) free(sd->sayBatch);
+	close(sd->socket);
+	free(sd->address);
+	free(sd);
+	topology_arm_timer(tpd);
+}
+static bool topology_add_neighbor(const Topology *tp, struct sockaddr_in *serverAddr, int socket, char *hostname, char *port) {
+	TopologyData *tpd = (TopologyData *)tp->self;
+	struct sockaddr_in address;
+	if (!topology_resolve(hostname, port, &address)) return false;
+	if (cmpaddress(address, *serverAddr) || (tp->find_server(tp, &address) != NULL)) {
+		fprintf(stderr, "Already a neighbor\n");
+		return false;
+	}
+	if (topology_attach(tpd, serverAddr, socket, &address) == NULL) return false;
+	topology_originate_lsa(tpd, serverAddr, false);
+	fflush(stdout);
+	return true;
+}
+static bool topology_remove_neighbor(const Topology *tp, struct sockaddr_in *serverAddr, char *hostname, char *port) {
+	TopologyData *tpd = (TopologyData *)tp->self;
+	struct sockaddr_in address;
+	if (!topology_resolve(hostname, port, &address)) return false;
+	int index = 0;
+	while ((index < tpd->size) && !cmpaddress(*((tpd->serverTopology)[index]->address), address)) index++;
+	if (index == tpd->size) {
+		fprintf(stderr, "Not a neighbor\n");
+		return false;
+	}
+	topology_detach(tp, serverAddr, index);
+	topology_originate_lsa(tpd, serverAddr, false);
+	fflush(stdout);
+	return true;
+}
+static void topology_reconcile(const Topology *tp, struct sockaddr_in *serverAddr) {
+	/*
+	 * Links us to the overlay peers membership now gives us and unlinks
+	 * those it's taken away. Neighbors added by hand or on the command
+	 * line stay.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	struct sockaddr_in peers[TOPOLOGY_MAX_SIZE];
+	int count = tpd->membership->neighbors(tpd->membership, peers, TOPOLOGY_MAX_SIZE);
+	bool moved = false;
+	for (int i = tpd->size - 1; i >= 0; i--) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		if (!(sd->gossiped)) continue;
+		bool kept = false;
+		for (int j = 0; (j < count) && !kept; j++) kept = cmpaddress(*(sd->address), peers[j]);
+		if (kept) continue;
+		topology_detach(tp, serverAddr, i);
+		moved = true;
+	}
+	for (int j = 0; j < count; j++) {
+		if (tp->find_server(tp, &(peers[j])) != NULL) continue;
+		int socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (socket < 0) {fprintf(stderr, "Topolgy socket make failed.\n"); break;}
+		ServerData *sd = topology_attach(tpd, serverAddr, socket, &(peers[j]));
+		if (sd == NULL) {close(socket); break;}
+		sd->gossiped = true;
+		moved = true;
+	}
+	if (moved) topology_originate_lsa(tpd, serverAddr, false);
+}
+static void topology_send_gossip(TopologyData *tpd, struct sockaddr_in *serverAddr, s2s_t type, struct sockaddr_in *to, struct sockaddr_in *target, unsigned int seq) {
+	/* Sends a ping, ping request or ack, with what news fits alongside. */
+	size_t size = sizeof(request_server_gossip) + (sizeof(struct gossip_update) * TOPOLOGY_PIGGYBACK);
+	char buffer[sizeof(request_server_gossip) + (sizeof(struct gossip_update) * TOPOLOGY_PIGGYBACK)];
+	request_server_gossip *datagram = (request_server_gossip *)buffer;
+	memset(buffer, 0, size);
+	datagram->req_type = type;
+	memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
+	if (target != NULL) memcpy((void *)(&datagram->target), target, sizeof(struct sockaddr_in));
+	datagram->req_seq = seq;
+	datagram->req_count = tpd->membership->piggyback(tpd->membership, datagram->req_updates, TOPOLOGY_PIGGYBACK);
+
+	size = sizeof(request_server_gossip) + (sizeof(struct gossip_update) * datagram->req_count);
+	int result = sendto(tpd->gossipSocket, buffer, size, MSG_DONTWAIT, (struct sockaddr *)to, sizeof(struct sockaddr_in));
+	if (result == -1) fprintf(stderr, "S2S gossip send failure. (%d)\n", result);
+	tpd->controlDatagrams += 1;
+}
+static void topology_send_members(TopologyData *tpd, struct sockaddr_in *serverAddr, struct sockaddr_in *to) {
+	/* Tells a server that's just joined everyone we know of, as many datagrams as that takes. */
+	request_server_gossip *datagram = (request_server_gossip *)malloc(BUFFER_SIZE);
+	if (datagram == NULL) {fprintf(stderr, "Out of memory"); return;}
+	int fits = (BUFFER_SIZE - sizeof(request_server_gossip)) / sizeof(struct gossip_update);
+	for (int offset = 0;; offset += fits) {
+		memset(datagram, 0, BUFFER_SIZE);
+		datagram->req_type = S2S_MEMBERS;
+		memcpy((void *)(&datagram->address), serverAddr, sizeof(struct sockaddr_in));
+		datagram->req_count = tpd->membership->list(tpd->membership, offset, datagram->req_updates, fits);
+		if (datagram->req_count == 0) break;
+
+		size_t size = sizeof(request_server_gossip) + (sizeof(struct gossip_update) * datagram->req_count);
+		int result = sendto(tpd->gossipSocket, datagram, size, MSG_DONTWAIT, (struct sockaddr *)to, sizeof(struct sockaddr_in));
+		if (result == -1) fprintf(stderr, "S2S members send failure. (%d)\n", result);
+		tpd->controlDatagrams += 1;
+		if (datagram->req_count < fits) break;
+	}
+	free(datagram);
+}
+static void topology_run_gossip(const Topology *tp, struct sockaddr_in *serverAddr, double now) {
+	/*
+	 * One probe a period: a ping, then pings through others if it's
+	 * late, then suspicion if nobody heard back. Alone, we ping the
+	 * seeds until one of them tells us who else is out there.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	const Membership *ms = tpd->membership;
+	if (tpd->probing && !(tpd->probeAcked) && !(tpd->probeIndirect) && (now >= tpd->probeSentAt + TOPOLOGY_PING_TIMEOUT)) {
+		struct sockaddr_in helpers[TOPOLOGY_INDIRECT_PINGS];
+		int count = ms->pick(ms, &(tpd->probeTarget), helpers, TOPOLOGY_INDIRECT_PINGS);
+		for (int i = 0; i < count; i++)
+			topology_send_gossip(tpd, serverAddr, S2S_PING_REQ, &(helpers[i]), &(tpd->probeTarget), tpd->probeSeq);
+		tpd->probeIndirect = true;
+		tpd->indirectPings += count;
+	}
+
+	if (now >= tpd->probeAt) {
+		tpd->probeAt = now + TOPOLOGY_GOSSIP_PERIOD;
+		if (tpd->probing && !(tpd->probeAcked)) {
+			print_addresses(serverAddr, &(tpd->probeTarget));
+			printf("S2S gossip suspects it\n");
+			ms->suspect(ms, &(tpd->probeTarget));
+			tpd->suspicions += 1;
+		}
+		ms->expire(ms);
+
+		tpd->probing = ms->next_probe(ms, &(tpd->probeTarget));
+		if (tpd->probing) {
+			if (++(tpd->probeSeq) == 0) tpd->probeSeq = 1;
+			tpd->probeAcked = tpd->probeIndirect = false;
+			tpd->probeSentAt = now;
+			topology_send_gossip(tpd, serverAddr, S2S_PING, &(tpd->probeTarget), NULL, tpd->probeSeq);
+			tpd->pings += 1;
+		} else {
+			for (int i = 0; i < tpd->seedCount; i++)
+				topology_send_gossip(tpd, serverAddr, S2S_PING, &(tpd->seeds[i]), NULL, 0);
+		}
+	}
+	if (ms->changed(ms)) topology_reconcile(tp, serverAddr);
+}
+static void topology_set_gossip(const Topology *tp, struct sockaddr_in *serverAddr) {
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	if (tpd->membership != NULL) return;
+	tpd->gossipSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (tpd->gossipSocket < 0) {
+		fprintf(stderr, "Could not open the gossip socket. (%d)\n", errno);
+		return;
+	}
+	tpd->membership = Membership_create(serverAddr, (uint64_t)topology_new_id(tpd));
+	tpd->probeAt = topology_now();
+	topology_arm_timer(tpd);
+}
+static bool topology_add_seed(const Topology *tp, char *hostname, char *port) {
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	if (tpd->seedCount >= TOPOLOGY_MAX_SEEDS) {
+		fprintf(stderr, "Too many seeds, at most %d\n", TOPOLOGY_MAX_SEEDS);
+		return false;
+	}
+	if (!topology_resolve(hostname, port, &(tpd->seeds[tpd->seedCount]))) return false;
+	tpd->seedCount += 1;
+	return true;
+}
+static bool topology_s2s_gossip_recv(const Topology *tp, struct sockaddr_in *serverAddr, request_server_gossip *datagram) {
+	/*
+	 * Takes in the news, then answers: an ack for a ping, a ping on
+	 * someone else's behalf for a ping request, and for an ack, our probe
+	 * is answered, or it's relayed to whoever asked for it.
+	 */
+	TopologyData *tpd = (TopologyData *)tp->self;
+	const Membership *ms = tpd->membership;
+	if (ms == NULL) return false;
+	tpd->controlReceived += 1;
+
+	int fits = (BUFFER_SIZE - sizeof(request_server_gossip)) / sizeof(struct gossip_update);
+	if ((datagram->req_count < 0) || (datagram->req_count > fits)) return false;
+	bool known = ms->knows(ms, &(datagram->address));
+	for (int i = 0; i < datagram->req_count; i++) ms->apply(ms, &(datagram->req_updates[i]));
+
+	bool relayed = (datagram->target.sin_family == AF_INET) && !cmpaddress(datagram->target, *serverAddr);
+	switch (datagram->req_type) {
+	case S2S_PING:
+		topology_send_gossip(tpd, serverAddr, S2S_PING_ACK, &(datagram->address), relayed ? &(datagram->target) : NULL, datagram->req_seq);
+		if (!known) {
+			print_addresses(serverAddr, &(datagram->address));
+			printf("S2S gossip join\n");
+			topology_send_members(tpd, serverAddr, &(datagram->address));
+		}
+		break;
+	case S2S_PING_REQ:
+		if (datagram->target.sin_family == AF_INET)
+			topology_send_gossip(tpd, serverAddr, S2S_PING, &(datagram->target), &(datagram->address), datagram->req_seq);
+		break;
+	case S2S_PING_ACK:
+		if (relayed) topology_send_gossip(tpd, serverAddr, S2S_PING_ACK, &(datagram->target), NULL, datagram->req_seq);
+		else if (tpd->probing && (datagram->req_seq == tpd->probeSeq)) tpd->probeAcked = true;
+		break;
+	}
+	if (ms->changed(ms)) topology_reconcile(tp, serverAddr);
+	return true;
+}
+static void topology_set_pacing(const Topology *tp, double rate) {
+	((TopologyData *)(tp->self))->egressRate = rate;
+}
+static int topology_get_egress_fd(const Topology *tp) {
+	return ((TopologyData *)(tp->self))->egressPoll;
+}
+static void topology_egress_ready(const Topology *tp) {
+	/* Sends what waited on each neighbor whose socket has room again. */
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	struct epoll_event events[TOPOLOGY_EGRESS_EVENTS];
+	int count = epoll_wait(tpd->egressPoll, events, TOPOLOGY_EGRESS_EVENTS, 0);
+	double now = topology_now();
+	for (int i = 0; i < count; i++) {
+		epoll_ctl(tpd->egressPoll, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+		for (int j = 0; j < tpd->size; j++) {
+			ServerData *sd = (tpd->serverTopology)[j];
+			if (sd->socket != events[i].data.fd) continue;
+			sd->blocked = false;
+			topology_egress_run(tpd, sd, now);
+		}
+	}
+}
+static void topology_set_rendezvous(const Topology *tp, bool enabled) {
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	tpd->rendezvous = enabled;
+}
+
+static void topology_report(const Topology *tp) {
+	/* Prints the control-plane rates and resets their peaks. */
+	TopologyData *tpd = (TopologyData *)(tp->self);
+	printf("S2S control: sent %.1f/s (peak %.0f/s), received %.1f/s (peak %.0f/s)\n",
+	       tpd->sentRate, tpd->sentPeak, tpd->receivedRate, tpd->receivedPeak);
+	tpd->sentPeak = tpd->receivedPeak = 0;
+
+	// Report how well says are batching.
+	if (tpd->segmentOffload)
+		printf("S2S says: %lld datagrams in %lld sends\n", tpd->sayDatagrams, tpd->saySyscalls);
+	tpd->linkState->report(tpd->linkState);
+
+	// How much routing state we hold for our neighbors.
+	int routes = 0;
+	for (int i = 0; i < tpd->size; i++)
+		(tpd->serverTopology)[i]->channelList->digest((tpd->serverTopology)[i]->channelList, &routes);
+	printf("S2S routes: %d channel entries over %d servers\n", routes, tpd->size);
+
+	// How the reliable joins and leaves are faring.
+	int unacked = 0;
+	for (int i = 0; i < tpd->size; i++) unacked += (tpd->serverTopology)[i]->unackedCount;
+	printf("S2S reliable: %lld sent, %lld retransmitted (%lld early), %lld given up, %d unacked\n",
+	       tpd->reliableSent, tpd->retransmitted, tpd->fastRetransmitted, tpd->gaveUp, unacked);
+	if (tpd->loss > 0) printf("S2S loss shim: dropped %lld datagrams\n", tpd->lost);
+	if (tpd->egressRate > 0) printf("S2S pacing: %.0f bytes/s to each neighbor\n", tpd->egressRate);
+
+	// Who's answering heartbeats.
+	int up = 0;
+	for (int i = 0; i < tpd->size; i++) up += !((tpd->serverTopology)[i]->down);
+	printf("S2S liveness: %d of %d neighbors up, %lld failovers\n", up, tpd->size, tpd->failovers);
+	if (tpd->membership != NULL) {
+		tpd->membership->report(tpd->membership);
+		printf("S2S gossip: %lld pings, %lld through others, %lld suspicions\n", tpd->pings, tpd->indirectPings, tpd->suspicions);
+	}
+
+	// And how each link measures.
+	for (int i = 0; i < tpd->size; i++) {
+		ServerData *sd = (tpd->serverTopology)[i];
+		printf("S2S link to ");
+		fprintip(stdout, sd->address);
+		printf(": rtt %.2fms (least %.2fms), loss %.1f%%, cost %u, %d says queued (%zu bytes), %lld dropped, %lld stalls%s\n",
+		       sd->linkRtt * 1000, sd->rttMin * 1000, sd->linkLoss * 100, sd->cost,
+		       sd->queued, sd->queuedBytes, sd->dropped, sd->stalls, sd->down ? ", down" : "");
+	}
+	fflush(stdout);
+}
+
 const Topology *Topology_create() {
     Topology *tp = (Topology *)malloc(sizeof(Topology));
     memset(tp, 0, sizeof(Topology));
@@ -443,11 +2225,39 @@ const Topology *Topology_create() {
     TopologyData *tpd = (TopologyData *)malloc(sizeof(TopologyData));
 	memset(tpd, 0, sizeof(TopologyData));
 
+	// Seed the say ID generator.
+	int randomData = open("/dev/urandom", O_RDONLY);
+	if ((randomData < 0) || (read(randomData, &(tpd->idState), sizeof(tpd->idState)) != sizeof(tpd->idState))) {
+		printf("WARNING: Could not read random data to seed say IDs!\n");
+		tpd->idState = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
+	}
+	if (randomData >= 0) close(randomData);
+	tpd->linkState = LinkState_create();
+	tpd->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tpd->timer < 0) fprintf(stderr, "Could not create the heartbeat timer. (%d)\n", errno);
+	tpd->helloAt = topology_now() + TOPOLOGY_HELLO_INTERVAL;
+	topology_arm_timer(tpd);
+	tpd->egressPoll = epoll_create1(EPOLL_CLOEXEC);
+	if (tpd->egressPoll < 0) fprintf(stderr, "Could not create the egress poll set. (%d)\n", errno);
+
     *tp = {NULL, topology_cleanup, topology_get_size, topology_get_socket, topology_add_address,
     	   topology_find_server, topology_renew,
     	   topology_s2s_join_send, topology_s2s_leave_send, topology_s2s_say_send,
     	   topology_s2s_join_recv, topology_s2s_leave_recv, topology_s2s_say_recv,
-    	   topology_id_store, topology_id_has};
+    	   topology_id_store, topology_id_has,
+    	   topology_set_segment_offload, topology_flush,
+    	   topology_s2s_say_originate,
+    	   topology_s2s_channels_send, topology_s2s_channels_recv,
+    	   topology_s2s_digest_recv, topology_report,
+    	   topology_s2s_lsa_recv, topology_set_rendezvous,
+    	   topology_s2s_channel_empty, topology_shutdown,
+    	   topology_s2s_reliable_recv, topology_s2s_ack_recv,
+    	   topology_get_timer_fd, topology_run_timers,
+    	   topology_set_loss, topology_s2s_hello_recv,
+    	   topology_set_delay,
+    	   topology_add_neighbor, topology_remove_neighbor,
+    	   topology_set_gossip, topology_add_seed, topology_s2s_gossip_recv,
+    	   topology_set_pacing, topology_get_egress_fd, topology_egress_ready};
     tp->self = (void *)tpd;
     return tp;
 }
@@ -0,0 +1,104 @@
+#ifndef _UDPOFFLOAD_H_
+#define _UDPOFFLOAD_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+/*
+ * UDP segmentation offload helpers
+ *
+ * GSO (UDP_SEGMENT) hands the kernel one buffer of equally sized
+ * datagrams to a single destination and lets it split them after the
+ * syscall. GRO (UDP_GRO) does the reverse on receive: a burst from one
+ * sender arrives as one buffer plus the segment size in a cmsg.
+ */
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#define UDP_OFFLOAD_MAX_SEGMENTS 64
+#define UDP_OFFLOAD_MAX_DATAGRAM 65536
+
+bool udp_enable_gro(int socket) {
+    /* Asks the kernel to hand us coalesced bursts. */
+    int on = 1;
+    return setsockopt(socket, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+int udp_send_segments(int socket, const void *data, int segmentSize, int count, struct sockaddr_in *address, int *sent) {
+    /*
+     * Sends count back-to-back datagrams of segmentSize bytes each.
+     * Returns how many syscalls it took, or -1 if sending failed; either
+     * way sent says how many datagrams went out, always the first ones.
+     */
+    *sent = 0;
+    if (count == 1) {
+        int result = sendto(
+            socket, data, segmentSize, MSG_DONTWAIT,
+            (struct sockaddr *)address, sizeof(struct sockaddr_in)
+        );
+        if (result < 0) return -1;
+        *sent = 1;
+        return 1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = segmentSize * count;
+
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = address;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *((uint16_t *)CMSG_DATA(cmsg)) = (uint16_t)segmentSize;
+
+    if (sendmsg(socket, &msg, MSG_DONTWAIT) >= 0) {
+        *sent = count;
+        return 1;
+    }
+
+    // No GSO here (or the burst didn't fit) -- fall back to one send each.
+    for (int i = 0; i < count; i++) {
+        int result = sendto(
+            socket, ((const char *)data) + (segmentSize * i), segmentSize, MSG_DONTWAIT,
+            (struct sockaddr *)address, sizeof(struct sockaddr_in)
+        );
+        if (result < 0) return -1;
+        *sent += 1;
+    }
+    return *sent;
+}
+
+int udp_gro_segment_size(struct msghdr *msg) {
+    /* Returns the segment size of a coalesced receive, or -1 if it wasn't. */
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+            int segmentSize;
+            memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(int));
+            return segmentSize;
+        }
+    }
+    return -1;
+}
+
+#endif /* _UDPOFFLOAD_H_ */
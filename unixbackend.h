@@ -0,0 +1,268 @@
+#ifndef _UNIXBACKEND_H_
+#define _UNIXBACKEND_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "duckchat.h"
+#include "server.h"
+#include "iobackend.h"
+#include "spscqueue.h"
+
+/*
+ * Unix domain backend -- an AF_UNIX SOCK_DGRAM socket for clients on
+ * this host.
+ *
+ * The user table is keyed by sockaddr_in, so each unix peer gets a stand-in
+ * address: sin_family AF_UNIX, sin_addr LOCAL_TAG_UNIX (never a real
+ * sender) and the peer's slot in sin_port. recv hands out stand-ins and send
+ * maps them back to paths, so unix users live in the same tables as UDP ones.
+ * Paths are found through a hash table.
+ *
+ * When a unix user goes, forget() hands their slot back to recv, which
+ * may run on another thread, over a queue. A slot is only handed out again
+ * UNIX_BACKEND_REUSE_DELAY seconds later: by then anything still holding
+ * the old stand-in -- a datagram in a pipeline queue, a user logged in from
+ * one, a send on an egress thread -- has timed out or gone.
+ *
+ * Every backend is given every address list; each one only sends to the
+ * addresses of its own family.
+ */
+
+#define UNIX_BACKEND_CHUNK_PEERS 256
+#define UNIX_BACKEND_CHUNKS 256
+#define UNIX_BACKEND_MAX_PEERS ((UNIX_BACKEND_CHUNK_PEERS * UNIX_BACKEND_CHUNKS) - 1)
+#define UNIX_BACKEND_BUCKETS 4096                          // a power of two
+#define UNIX_BACKEND_REUSE_DELAY (3 * SERVER_KEEPALIVE)    // seconds
+
+// Slots in links are stored plus one, so 0 is the end.
+struct unix_peer {
+    struct sockaddr_un address;
+    socklen_t length;
+    int hashNext, freeNext;
+    bool free;
+    time_t releasedAt;
+};
+
+// Peers live in fixed chunks that never move, so a sending thread can
+// read slots while the receiving one adds more.
+typedef struct unixbackenddata {
+    int socket;
+    struct unix_peer *peers[UNIX_BACKEND_CHUNKS];
+    int peerCount;
+
+    // owned by recv
+    int buckets[UNIX_BACKEND_BUCKETS];
+    int freeHead, freeTail;    // released slots, oldest first
+
+    struct spsc_queue *released;    // forgotten slots, forget -> recv
+} UnixBackendData;
+
+static struct unix_peer *unix_backend_peer(UnixBackendData *ubd, int slot) {
+    return &(ubd->peers[slot / UNIX_BACKEND_CHUNK_PEERS][slot % UNIX_BACKEND_CHUNK_PEERS]);
+}
+
+static void unix_backend_cleanup(const IOBackend *io) {
+    UnixBackendData *ubd = (UnixBackendData *)(io->self);
+    for (int i = 0; i < UNIX_BACKEND_CHUNKS; i++)
+        if (ubd->peers[i] != NULL) free(ubd->peers[i]);
+    spsc_queue_destroy(ubd->released);
+    free(io->self);
+    free((void *)io);
+}
+
+static const char *unix_backend_get_name(const IOBackend *) {
+    return "unix";
+}
+
+static int unix_backend_get_fd(const IOBackend *io) {
+    UnixBackendData *ubd = (UnixBackendData *)(io->self);
+    return ubd->socket;
+}
+
+static unsigned unix_backend_hash(struct sockaddr_un *address, socklen_t length) {
+    /* FNV-1a over the path, abstract names included. */
+    const unsigned char *bytes = (const unsigned char *)address;
+    unsigned hash = 2166136261u;
+    for (socklen_t i = 0; i < length; i++) hash = (hash ^ bytes[i]) * 16777619u;
+    return hash & (UNIX_BACKEND_BUCKETS - 1);
+}
+
+static void unix_backend_take_released(UnixBackendData *ubd) {
+    /* Unhooks every forgotten slot and queues it up for reuse. */
+    void *item;
+    while ((item = spsc_queue_pop(ubd->released)) != NULL) {
+        int slot = (int)(intptr_t)item - 1;
+        struct unix_peer *peer = unix_backend_peer(ubd, slot);
+        if (peer->free) continue;
+
+        int *link = &(ubd->buckets[unix_backend_hash(&(peer->address), peer->length)]);
+        while ((*link != 0) && (*link != slot + 1))
+            link = &(unix_backend_peer(ubd, *link - 1)->hashNext);
+        if (*link != 0) *link = peer->hashNext;
+
+        peer->free = true;
+        peer->freeNext = 0;
+        if (ubd->freeTail != 0) unix_backend_peer(ubd, ubd->freeTail - 1)->freeNext = slot + 1;
+        else ubd->freeHead = slot + 1;
+        ubd->freeTail = slot + 1;
+    }
+}
+
+static int unix_backend_find_peer(UnixBackendData *ubd, struct sockaddr_un *address, socklen_t length) {
+    /*
+     * Finds the slot for a peer path, handing out a new one if needed.
+     * Returns -1 if we're out of slots.
+     */
+    unsigned hash = unix_backend_hash(address, length);
+    for (int link = ubd->buckets[hash]; link != 0; ) {
+        struct unix_peer *peer = unix_backend_peer(ubd, link - 1);
+        if ((peer->length == length) && (memcmp(&(peer->address), address, length) == 0)) return link - 1;
+        link = peer->hashNext;
+    }
+
+    // Reuse the oldest released slot once it's been quiet long enough.
+    int slot = ubd->peerCount;
+    struct unix_peer *peer;
+    if ((ubd->freeHead != 0) &&
+        (time(NULL) - unix_backend_peer(ubd, ubd->freeHead - 1)->releasedAt >= UNIX_BACKEND_REUSE_DELAY)) {
+        slot = ubd->freeHead - 1;
+        peer = unix_backend_peer(ubd, slot);
+        ubd->freeHead = peer->freeNext;
+        if (ubd->freeHead == 0) ubd->freeTail = 0;
+    } else {
+        if (slot >= UNIX_BACKEND_MAX_PEERS) return -1;
+
+        // Start a new chunk when the last one fills up.
+        int chunk = slot / UNIX_BACKEND_CHUNK_PEERS;
+        if (ubd->peers[chunk] == NULL) {
+            ubd->peers[chunk] = (struct unix_peer *)malloc(sizeof(struct unix_peer) * UNIX_BACKEND_CHUNK_PEERS);
+            if (ubd->peers[chunk] == NULL) {fprintf(stderr, "Out of memory"); return -1;}
+        }
+        peer = unix_backend_peer(ubd, slot);
+    }
+
+    memset(peer, 0, sizeof(struct unix_peer));
+    memcpy(&(peer->address), address, length);
+    peer->length = length;
+    peer->hashNext = ubd->buckets[hash];
+    ubd->buckets[hash] = slot + 1;
+
+    // Only count a new peer once it's filled in.
+    if (slot == ubd->peerCount) __atomic_store_n(&(ubd->peerCount), slot + 1, __ATOMIC_RELEASE);
+    return slot;
+}
+
+static int unix_backend_recv(const IOBackend *io, char *buffer, int size, struct sockaddr_in *address) {
+    /* Receives one waiting datagram and gives its sender a stand-in address. */
+    UnixBackendData *ubd = (UnixBackendData *)(io->self);
+    unix_backend_take_released(ubd);
+    while (1) {
+        struct sockaddr_un peerAddress;
+        socklen_t peerLength = sizeof(struct sockaddr_un);
+        int result = recvfrom(
+            ubd->socket, buffer, size, MSG_DONTWAIT,
+            (struct sockaddr *)&peerAddress, &peerLength
+        );
+        if (result < 0) {
+            // Nothing left to read is not an error.
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+            return -1;
+        }
+
+        // Unbound senders can't be answered, so don't let them log in.
+        if (peerLength <= sizeof(sa_family_t)) continue;
+
+        int slot = unix_backend_find_peer(ubd, &peerAddress, peerLength);
+        if (slot < 0) {
+            fprintf(stderr, "Too many unix peers, dropping a datagram.\n");
+            continue;
+        }
+        memset(address, 0, sizeof(struct sockaddr_in));
+        address->sin_family = AF_UNIX;
+        address->sin_addr.s_addr = htonl(LOCAL_TAG_UNIX);
+        address->sin_port = htons(slot);
+        return result;
+    }
+}
+
+static bool unix_backend_send(const IOBackend *io, const void *datagram, int size, struct AddressRef *addressList) {
+    /* Sends the datagram to every unix address in the list. */
+    UnixBackendData *ubd = (UnixBackendData *)(io->self);
+    bool success = true;
+    while ((addressList != NULL) && (addressList->_this != NULL)) {
+        struct sockaddr_in *address = addressList->_this;
+        addressList = addressList->_next;
+        if (!has_local_tag(address, LOCAL_TAG_UNIX)) continue;
+
+        int slot = ntohs(address->sin_port);
+        if (slot >= __atomic_load_n(&(ubd->peerCount), __ATOMIC_ACQUIRE)) continue;
+        struct unix_peer *peer = unix_backend_peer(ubd, slot);
+        int result = sendto(
+            ubd->socket, datagram, size, MSG_DONTWAIT,
+            (struct sockaddr *)&(peer->address), peer->length
+        );
+        if (result == -1) {
+            // Something went wrong with sending this.
+            fprintf(stderr, "Response to client failed to send. (%d)\n", result);
+            success = false;
+        }
+    }
+    return success;
+}
+
+static void unix_backend_flush(const IOBackend *) {
+    // Every send already went out.
+    return;
+}
+
+static bool unix_backend_enable_gro(const IOBackend *) {
+    // Unix datagrams never get coalesced.
+    return false;
+}
+
+static void unix_backend_forget(const IOBackend *io, struct sockaddr_in *address) {
+    /* Hands a gone user's slot back to recv; only one thread may call this. */
+    UnixBackendData *ubd = (UnixBackendData *)(io->self);
+    if (!has_local_tag(address, LOCAL_TAG_UNIX)) return;
+    int slot = ntohs(address->sin_port);
+    if (slot >= __atomic_load_n(&(ubd->peerCount), __ATOMIC_ACQUIRE)) return;
+
+    // recv reads the time only after it pops the slot.
+    unix_backend_peer(ubd, slot)->releasedAt = time(NULL);
+    if (!spsc_queue_push(ubd->released, (void *)(intptr_t)(slot + 1))) return;
+    spsc_queue_publish(ubd->released);
+}
+
+static bool unix_backend_can_split(const IOBackend *) {
+    return true;
+}
+
+const IOBackend *IOBackend_create_unix(int socket) {
+    IOBackend *io = (IOBackend *)malloc(sizeof(IOBackend));
+    memset(io, 0, sizeof(IOBackend));
+
+    UnixBackendData *ubd = (UnixBackendData *)malloc(sizeof(UnixBackendData));
+    memset(ubd, 0, sizeof(UnixBackendData));
+    ubd->socket = socket;
+    ubd->released = spsc_queue_create(UNIX_BACKEND_MAX_PEERS + 1);
+    if (ubd->released == NULL) {fprintf(stderr, "Out of memory"); exit(1);}
+
+    *io = {NULL, unix_backend_cleanup, unix_backend_get_name, unix_backend_get_fd,
+           unix_backend_recv, unix_backend_send, unix_backend_flush, unix_backend_enable_gro,
+           unix_backend_forget, unix_backend_can_split};
+    io->self = (void *)ubd;
+    return io;
+}
+
+#endif /* _UNIXBACKEND_H_ */
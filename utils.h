@@ -12,6 +12,10 @@
  * Networking Utility Functions
  */
 
+// Which same-host transport a stand-in address belongs to (its sin_addr).
+#define LOCAL_TAG_UNIX 0
+#define LOCAL_TAG_SHM  1
+
 void fprintaddr(FILE *stream, struct sockaddr_in *address) {
     /* Prints the values of a given address onto a filestream. */
     fprintf(stream, "-=- address -=-\n");
@@ -22,6 +26,12 @@ void fprintaddr(FILE *stream, struct sockaddr_in *address) {
 
 void fprintip(FILE *stream, struct sockaddr_in *address) {
     /* Prints an IP address directly to a stream. */
+    if (address->sin_family == AF_UNIX) {
+        // A same-host peer; all we have is its slot.
+        const char *transport = (ntohl(address->sin_addr.s_addr) == LOCAL_TAG_SHM) ? "shm" : "unix";
+        fprintf(stream, "%s:%d", transport, ntohs(address->sin_port));
+        return;
+    }
     // char buffer[INET_ADDRSTRLEN];
     // inet_ntop( AF_INET, &(address->sin_addr), buffer, sizeof( buffer ));
     char *ip = inet_ntoa(address->sin_addr);